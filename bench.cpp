@@ -0,0 +1,476 @@
+// ========================================================================== //
+// INCLUDES
+// ========================================================================== //
+
+// Standard Libraries
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// C libraries
+#include <cstdio>
+#include <cstring>
+
+// Local
+#include "busypoll.h"
+#include "checksum.h"
+#include "common.h"
+#include "compress.h"
+#include "delta.h"
+#include "fec.h"
+#include "protocol.h"
+
+// ========================================================================== //
+// DEFINITIONS
+// ========================================================================== //
+
+// Microbenchmarks for the integrity checks (-C): how long CRC32C takes per
+// segment and per byte with each implementation, next to how long a segment
+// takes on the wire at a given line rate. Then the same for packing blocks
+// for compression (-z), on text and on random bytes, with and without trying
+// to deflate them. Last, the delta block sums (-D): the weak sum per block
+// with each implementation, and summing a whole basis on one thread and on
+// all of them. And the parity XOR (-F) with each implementation. Last, the
+// round trip of one datagram over loopback with both ends sleeping in poll,
+// and with both busy polling (-B), which is most of what a small file costs;
+// then whole small uploads over loopback, a ClientConn against a ServerCore
+// from SYN to FINACK, sleeping, busy polling, and busy polling pinned (-A).
+
+#define BENCH_PINGS 20000
+#define BENCH_TRANSFERS 1000
+
+typedef uint32_t (*crc_fn)(uint32_t, const void*, size_t);
+typedef void (*weak_fn)(const void*, size_t, uint32_t*, uint32_t*);
+typedef void (*xor_fn)(char*, const char*, size_t);
+
+// the compiler must not drop the loop
+static volatile uint32_t sink;
+
+// nanoseconds per call, taking the best of a few runs
+static double bench(crc_fn fn, const char* buf, size_t len, uint64_t bytes) {
+    uint64_t iters = std::max<uint64_t>(bytes / len, 1);
+    double best    = 1e18;
+    for (int run = 0; run < 5; run++) {
+        uint32_t crc   = 0;
+        uint64_t start = time_now_ns();
+        for (uint64_t i = 0; i < iters; i++) crc = fn(crc, buf, len);
+        uint64_t took = time_now_ns() - start;
+        sink          = crc;
+        best          = std::min(best, (double)took / iters);
+    }
+    return best;
+}
+
+// nanoseconds to pack one block, best of a few runs, and the frame length
+static double bench_pack(const char* raw, bool deflate, uint64_t bytes, int* frame_len) {
+    std::vector<char> out(COMPRESS_MAX_FRAME);
+    uint64_t iters = std::max<uint64_t>(bytes / COMPRESS_BLOCK_SIZE, 1);
+    double best    = 1e18;
+    for (int run = 0; run < 5; run++) {
+        uint64_t start = time_now_ns();
+        for (uint64_t i = 0; i < iters; i++) *frame_len = pack_block(raw, COMPRESS_BLOCK_SIZE, out.data(), deflate);
+        uint64_t took = time_now_ns() - start;
+        best          = std::min(best, (double)took / iters);
+    }
+    return best;
+}
+
+// nanoseconds per weak sum of len bytes, best of a few runs
+static double bench_weak(weak_fn fn, const char* buf, size_t len, uint64_t bytes) {
+    uint64_t iters = std::max<uint64_t>(bytes / len, 1);
+    double best    = 1e18;
+    for (int run = 0; run < 5; run++) {
+        uint32_t a = 0, b = 0, acc = 0;
+        uint64_t start = time_now_ns();
+        for (uint64_t i = 0; i < iters; i++) {
+            fn(buf, len, &a, &b);
+            acc += a ^ b;
+        }
+        uint64_t took = time_now_ns() - start;
+        sink          = acc;
+        best          = std::min(best, (double)took / iters);
+    }
+    return best;
+}
+
+// nanoseconds per XOR of len bytes, best of a few runs
+static double bench_xor(xor_fn fn, char* dst, const char* src, size_t len, uint64_t bytes) {
+    uint64_t iters = std::max<uint64_t>(bytes / len, 1);
+    double best    = 1e18;
+    for (int run = 0; run < 5; run++) {
+        uint64_t start = time_now_ns();
+        for (uint64_t i = 0; i < iters; i++) fn(dst, src + (i & 63), len);
+        uint64_t took = time_now_ns() - start;
+        sink          = dst[0];
+        best          = std::min(best, (double)took / iters);
+    }
+    return best;
+}
+
+// wait until fd has a datagram, the way the server loop does
+static void wait_readable(int fd, BusyPoller* poller) {
+    struct pollfd p = {fd, POLLIN, 0};
+    while (poll(&p, 1, poller && poller->spinning(time_now_us()) ? 0 : -1) <= 0) continue;
+    if (poller) poller->on_event(time_now_us());
+}
+
+// a pair of UDP sockets on loopback, each connected to the other
+static void socket_pair(int fds[2]) {
+    struct sockaddr_in addr[2];
+    for (int i = 0; i < 2; i++) {
+        fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        err(fds[i], "Opening socket");
+        memset(&addr[i], 0, sizeof(addr[i]));
+        addr[i].sin_family      = AF_INET;
+        addr[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len           = sizeof(addr[i]);
+        err(bind(fds[i], (struct sockaddr*)&addr[i], len), "Binding socket");
+        getsockname(fds[i], (struct sockaddr*)&addr[i], &len);
+    }
+    for (int i = 0; i < 2; i++) err(connect(fds[i], (struct sockaddr*)&addr[1 - i], sizeof(addr[i])), "Connecting socket");
+}
+
+// round trips in nanoseconds of a full datagram bounced off another thread,
+// one every gap_us, with both ends sleeping in poll, or busy polling for up
+// to busy_us
+static std::vector<uint64_t> bench_ping(int count, uint64_t gap_us, uint64_t busy_us) {
+    int fds[2];
+    socket_pair(fds);
+    std::unique_ptr<BusyPoller> near, far;
+    if (busy_us > 0) {
+        near.reset(new BusyPoller(busy_us));
+        far.reset(new BusyPoller(busy_us));
+        busy_poll_socket(fds[0]);
+        busy_poll_socket(fds[1]);
+    }
+
+    std::thread echo([&]() {
+        char buf[SPEC_MAX_PACKET_SIZE];
+        for (int i = 0; i < count; i++) {
+            wait_readable(fds[1], far.get());
+            int n = recv(fds[1], buf, sizeof(buf), 0);
+            if (n > 0) send(fds[1], buf, n, 0);
+        }
+    });
+
+    char buf[SPEC_MAX_PACKET_SIZE];
+    memset(buf, 0, sizeof(buf));
+    std::vector<uint64_t> rtts;
+    for (int i = 0; i < count; i++) {
+        if (gap_us > 0) std::this_thread::sleep_for(std::chrono::microseconds(gap_us));
+        uint64_t start = time_now_ns();
+        err(send(fds[0], buf, sizeof(buf), 0), "Sending ping");
+        wait_readable(fds[0], near.get());
+        if (recv(fds[0], buf, sizeof(buf), 0) > 0) rtts.push_back(time_now_ns() - start);
+    }
+    echo.join();
+    close(fds[0]);
+    close(fds[1]);
+    std::sort(rtts.begin(), rtts.end());
+    return rtts;
+}
+
+// poll timeout in ms until deadline, rounding up, or 0 while spinning
+static int poll_timeout(uint64_t deadline, uint64_t now, BusyPoller* poller, int longest) {
+    if (poller && poller->spinning(now)) return 0;
+    if (deadline <= now) return 0;
+    return std::min<uint64_t>((deadline - now + 999) / 1000, longest);
+}
+
+// completion times in nanoseconds, SYN to FINACK, of count uploads of size
+// bytes one after another, the client and the server each on a thread of its
+// own; busy_us as for bench_ping, and with pin, the server runs on the first
+// cpu and the client on the last
+static std::vector<uint64_t> bench_transfers(int count, int size, uint64_t busy_us, bool pin) {
+    int fds[2];
+    socket_pair(fds);
+    std::unique_ptr<BusyPoller> near, far;
+    if (busy_us > 0) {
+        near.reset(new BusyPoller(busy_us));
+        far.reset(new BusyPoller(busy_us));
+        busy_poll_socket(fds[0]);
+        busy_poll_socket(fds[1]);
+    }
+    int cpus = std::max(1u, std::thread::hardware_concurrency());
+
+    // the server loop, as in server.cpp, writing to files nobody keeps
+    std::atomic<bool> stop(false);
+    std::thread server([&]() {
+        if (pin && !pin_thread(0)) _exit("Pinning to CPU");
+        ServerCore core([](uint16_t, int mode) { return mode == OPEN_NEW ? tmpfile() : NULL; },
+                        [&](const Peer&, const packet* pack, int len) { send(fds[1], pack, len, 0); }, NULL);
+        Peer from;
+        struct pollfd p = {fds[1], POLLIN, 0};
+        while (!stop.load()) {
+            uint64_t now = time_now_us();
+            // wake now and then to see whether to stop
+            if (poll(&p, 1, poll_timeout(core.next_deadline(), now, far.get(), 10)) <= 0) {
+                core.on_tick(time_now_us());
+                continue;
+            }
+            packet* incoming = core.rx_buffer();
+            from.len         = sizeof(from.addr);
+            int n = recvfrom(fds[1], incoming, sizeof(packet), 0, (struct sockaddr*)&from.addr, &from.len);
+            if (n <= 0) continue;
+            now = time_now_us();
+            if (far) far->on_event(now);
+            core.on_tick(now);
+            core.on_packet(incoming, n, from, now);
+        }
+    });
+
+    std::vector<uint64_t> times;
+    std::thread client([&]() {
+        if (pin && !pin_thread(cpus - 1)) _exit("Pinning to CPU");
+        std::string data(size, 'x');
+        MemorySource source(data);
+        packet incoming;
+        struct pollfd p = {fds[0], POLLIN, 0};
+        for (int i = 0; i < count; i++) {
+            ClientConn conn(&source, [&](const packet* pack, int len) { send(fds[0], pack, len, 0); }, NULL);
+            conn.nonce     = i % UINT16_MAX + 1;
+            uint64_t start = time_now_ns();
+            conn.start(time_now_us());
+            if (near) near->on_event(time_now_us());
+            // the FINACK is where the upload is done; TIME_WAIT is only for
+            // a lost final ACK
+            while (conn.state != CLIENT_TIME_WAIT && !conn.finished()) {
+                uint64_t now = time_now_us();
+                if (poll(&p, 1, poll_timeout(conn.next_deadline(), now, near.get(), INT_MAX)) > 0) {
+                    int n = recv(fds[0], &incoming, sizeof(incoming), 0);
+                    now   = time_now_us();
+                    if (n > 0 && near) near->on_event(now);
+                    if (n > 0) conn.on_packet(&incoming, n, now);
+                }
+                conn.on_tick(time_now_us());
+            }
+            if (conn.state == CLIENT_TIME_WAIT) times.push_back(time_now_ns() - start);
+        }
+    });
+    client.join();
+    stop.store(true);
+    server.join();
+    close(fds[0]);
+    close(fds[1]);
+    std::sort(times.begin(), times.end());
+    return times;
+}
+
+// nanoseconds to sum every block of fd, best of a few runs
+static double bench_sums(int fd, uint64_t size, int threads) {
+    BlockSums sums;
+    double best = 1e18;
+    for (int run = 0; run < 3; run++) {
+        uint64_t start = time_now_ns();
+        if (!compute_block_sums(fd, size, delta_block_size(size), &sums, threads)) _exit("Summing basis");
+        best = std::min(best, (double)(time_now_ns() - start));
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    double OPT_GBPS   = 10;
+    uint64_t OPT_BYTES = 1ULL << 28;
+
+    const char* usage = "usage: ./bench [-g LINE-RATE-GBPS] [-b BYTES-PER-RUN]";
+
+    int opt;
+    try {
+        while ((opt = getopt(argc, argv, "g:b:")) != -1) {
+            switch (opt) {
+                case 'g': OPT_GBPS = std::stod(optarg); break;
+                case 'b': OPT_BYTES = std::stoull(optarg); break;
+                default: throw std::invalid_argument("Unknown option");
+            }
+        }
+        if (OPT_GBPS <= 0 || OPT_BYTES == 0) throw std::invalid_argument("Invalid value");
+    } catch (const std::exception& e) {
+        _exit((std::string("Invalid arguments.\n") + usage).c_str());
+    }
+
+    // check them against the standard test vector before timing anything,
+    // and the interleaved one against the table over lengths that end in
+    // each of its block sizes
+    const char* check = "123456789";
+    if (crc32c_portable(0, check, 9) != 0xe3069283) _exit("crc32c_portable gives the wrong CRC");
+    if (crc32c_hw(0, check, 9) != 0xe3069283) _exit("crc32c_hw gives the wrong CRC");
+    if (crc32c_clmul(0, check, 9) != 0xe3069283) _exit("crc32c_clmul gives the wrong CRC");
+
+    std::vector<char> buf(1 << 20);
+    for (size_t i = 0; i < buf.size(); i++) buf[i] = (char)(i * 131 + 7);
+    for (size_t len : {383, 384, 508, 1151, 6143, 6144, 6529, 100003}) {
+        for (size_t off = 0; off < 8; off += 3) {
+            if (crc32c_clmul(len, buf.data() + off, len) != crc32c_portable(len, buf.data() + off, len))
+                _exit("crc32c_clmul disagrees with crc32c_portable");
+        }
+    }
+
+    // one full datagram on the wire, with UDP, IPv4 and Ethernet framing
+    double wire_ns = (SPEC_MAX_PACKET_SIZE + 8 + 20 + 38) * 8 / OPT_GBPS;
+    printf("segment at %.1f Gbit/s: %.1f ns on the wire\n", OPT_GBPS, wire_ns);
+    printf("hardware crc32c: %s\n\n",
+           crc32c_clmul_available() ? "sse4.2, pclmul" : crc32c_hw_available() ? "sse4.2" : "not available");
+
+    struct {
+        const char* name;
+        crc_fn fn;
+    } impls[] = {{"portable", crc32c_portable}, {"sse4.2", crc32c_hw}, {"pclmul", crc32c_clmul}, {"dispatch", crc32c}};
+
+    size_t sizes[] = {12 + SPEC_MAX_PAYLOAD_SIZE - 4, 4096, 1 << 20};
+
+    printf("%-10s %10s %12s %10s %14s\n", "impl", "bytes", "ns/call", "GB/s", "x line rate");
+    for (auto& impl : impls) {
+        if (impl.fn == crc32c_hw && !crc32c_hw_available()) continue;
+        if (impl.fn == crc32c_clmul && !crc32c_clmul_available()) continue;
+        for (size_t len : sizes) {
+            double ns = bench(impl.fn, buf.data(), len, OPT_BYTES);
+            // how many segments' worth of checking fits in one segment's wire time
+            double per_segment = ns * (12 + SPEC_MAX_PAYLOAD_SIZE) / len;
+            printf("%-10s %10zu %12.1f %10.2f %14.1f\n", impl.name, len, ns, len / ns, wire_ns / per_segment);
+        }
+    }
+
+    // a log-like block and a random one
+    std::vector<char> text(COMPRESS_BLOCK_SIZE);
+    for (size_t i = 0; i < text.size();) {
+        int n = snprintf(text.data() + i, text.size() - i, "ts=%zu level=INFO path=/api/items/%zu status=200\n",
+                         1700000000 + i / 64, (i * 2654435761u) % 9973);
+        i += std::min((size_t)n, text.size() - i);
+    }
+    std::vector<char> noise(COMPRESS_BLOCK_SIZE);
+    uint64_t x = 88172645463325252ULL;
+    for (size_t i = 0; i < noise.size(); i++) {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        noise[i] = (char)x;
+    }
+
+    // the "raw" rows are what a block costs once the adaptive policy stops
+    // trying to deflate
+    struct {
+        const char* name;
+        const char* data;
+        bool deflate;
+    } packs[] = {{"text", text.data(), true}, {"random", noise.data(), true}, {"random raw", noise.data(), false}};
+
+    printf("\n%-10s %10s %12s %10s %10s\n", "block", "bytes", "ns/block", "MB/s", "ratio");
+    for (auto& p : packs) {
+        int frame_len = 0;
+        double ns     = bench_pack(p.data, p.deflate, OPT_BYTES / 16, &frame_len);
+        printf("%-10s %10d %12.0f %10.1f %10.2f\n", p.name, COMPRESS_BLOCK_SIZE, ns, COMPRESS_BLOCK_SIZE * 1000 / ns,
+               (double)COMPRESS_BLOCK_SIZE / frame_len);
+    }
+
+    // the vector weak sum has to agree with the plain one, tail and all
+    for (size_t len = 0; len < 4096; len += 1 + len / 3) {
+        uint32_t a1, b1, a2, b2;
+        weak_sum_portable(buf.data(), len, &a1, &b1);
+        weak_sum_avx2(buf.data(), len, &a2, &b2);
+        if (a1 != a2 || b1 != b2) _exit("weak_sum_avx2 gives the wrong sum");
+    }
+    printf("\nvector weak sum: %s\n", weak_sum_avx2_available() ? "avx2" : "not available");
+
+    struct {
+        const char* name;
+        weak_fn fn;
+    } weaks[] = {{"portable", weak_sum_portable}, {"avx2", weak_sum_avx2}};
+    size_t blocks[] = {DELTA_MIN_BLOCK, 8192, DELTA_MAX_BLOCK};
+
+    printf("%-10s %10s %12s %10s\n", "weak sum", "bytes", "ns/block", "GB/s");
+    for (auto& w : weaks) {
+        if (w.fn == weak_sum_avx2 && !weak_sum_avx2_available()) continue;
+        for (size_t len : blocks) {
+            double ns = bench_weak(w.fn, buf.data(), len, OPT_BYTES);
+            printf("%-10s %10zu %12.1f %10.2f\n", w.name, len, ns, len / ns);
+        }
+    }
+
+    // a basis in the page cache, summed the way the server does at SYN
+    FILE* basis = tmpfile();
+    if (basis == NULL) _exit("Creating basis");
+    uint64_t basis_size = OPT_BYTES / 4;
+    for (uint64_t i = 0; i < basis_size; i += buf.size())
+        fwrite(buf.data(), 1, std::min<uint64_t>(buf.size(), basis_size - i), basis);
+    fflush(basis);
+
+    int cores = std::max(1u, std::thread::hardware_concurrency());
+    printf("\n%-10s %10s %12s %10s\n", "basis", "threads", "ms", "GB/s");
+    for (int threads : {1, cores}) {
+        double ns = bench_sums(fileno(basis), basis_size, threads);
+        printf("%-10llu %10d %12.1f %10.2f\n", (unsigned long long)basis_size, std::min(threads, DELTA_MAX_THREADS),
+               ns / 1e6, basis_size / ns);
+    }
+    fclose(basis);
+
+    // the vector XOR has to agree with the plain one, at every alignment
+    std::vector<char> want(8192), got(8192);
+    for (size_t len = 0; len < 4096; len += 1 + len / 3) {
+        memcpy(want.data(), buf.data() + 4096, want.size());
+        memcpy(got.data(), buf.data() + 4096, got.size());
+        xor_bytes_portable(want.data() + len % 7, buf.data() + len % 61, len);
+        xor_bytes_avx2(got.data() + len % 7, buf.data() + len % 61, len);
+        if (want != got) _exit("xor_bytes_avx2 gives the wrong bytes");
+    }
+    printf("\nvector xor: %s\n", xor_bytes_avx2_available() ? "avx2" : "not available");
+
+    struct {
+        const char* name;
+        xor_fn fn;
+    } xors[] = {{"portable", xor_bytes_portable}, {"avx2", xor_bytes_avx2}};
+    // one segment folded into a parity, a whole largest group, and a long run
+    size_t width   = SPEC_MAX_PAYLOAD_SIZE - CRC_TRAILER_SIZE - FEC_HEAD_SIZE;
+    size_t spans[] = {width, FEC_MAX_GROUP * width, 1 << 19};
+    std::vector<char> parity(1 << 19);
+
+    printf("%-10s %10s %12s %10s %14s\n", "xor", "bytes", "ns/call", "GB/s", "x line rate");
+    for (auto& x : xors) {
+        if (x.fn == xor_bytes_avx2 && !xor_bytes_avx2_available()) continue;
+        for (size_t len : spans) {
+            double ns          = bench_xor(x.fn, parity.data(), buf.data(), len, OPT_BYTES);
+            double per_segment = ns * (12 + SPEC_MAX_PAYLOAD_SIZE) / len;
+            printf("%-10s %10zu %12.1f %10.2f %14.1f\n", x.name, len, ns, len / ns, wire_ns / per_segment);
+        }
+    }
+
+    // busy polling pays off with a cpu for each end; with fewer the ends
+    // take turns
+    printf("\nloopback round trip, %d pings of %d bytes, %u cpus\n", BENCH_PINGS, SPEC_MAX_PACKET_SIZE,
+           std::thread::hardware_concurrency());
+    printf("%-10s %10s %10s %10s %10s %10s\n", "wait", "gap us", "p50 us", "p99 us", "p99.9 us", "max us");
+    for (uint64_t gap : {0, 100}) {
+        for (uint64_t busy : {0, BUSY_POLL_IDLE_US}) {
+            std::vector<uint64_t> rtts = bench_ping(BENCH_PINGS, gap, busy);
+            if (rtts.empty()) continue;
+            auto pct = [&](double p) { return rtts[(rtts.size() - 1) * p] / 1000.0; };
+            printf("%-10s %10llu %10.1f %10.1f %10.1f %10.1f\n", busy ? "busy poll" : "sleep", (unsigned long long)gap,
+                   pct(0.5), pct(0.99), pct(0.999), rtts.back() / 1000.0);
+        }
+    }
+
+    // pinning puts the two ends on different cpus where there are two
+    printf("\nloopback uploads, %d of each size, SYN to FINACK\n", BENCH_TRANSFERS);
+    printf("%-14s %10s %10s %10s %10s\n", "wait", "bytes", "p50 us", "p99 us", "failed");
+    for (int size : {1000, 16000, 64000}) {
+        struct {
+            const char* name;
+            uint64_t busy_us;
+            bool pin;
+        } modes[] = {{"sleep", 0, false}, {"busy poll", BUSY_POLL_IDLE_US, false}, {"busy, pinned", BUSY_POLL_IDLE_US, true}};
+        for (auto& mode : modes) {
+            std::vector<uint64_t> times = bench_transfers(BENCH_TRANSFERS, size, mode.busy_us, mode.pin);
+            if (times.empty()) continue;
+            auto pct = [&](double p) { return times[(times.size() - 1) * p] / 1000.0; };
+            printf("%-14s %10d %10.1f %10.1f %10zu\n", mode.name, size, pct(0.5), pct(0.99),
+                   BENCH_TRANSFERS - times.size());
+        }
+    }
+    return 0;
+}
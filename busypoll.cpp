@@ -0,0 +1,91 @@
+#include "busypoll.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// ========================================================================== //
+// SOCKETS AND CPUS
+// ========================================================================== //
+
+bool busy_poll_socket(int fd) {
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) return false;
+#ifdef SO_BUSY_POLL
+    // raising it past the system default needs CAP_NET_ADMIN
+    int usec = BUSY_POLL_SOCKET_US;
+    return setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == 0;
+#else
+    return false;
+#endif
+}
+
+static std::atomic<int> pinned_cpu(-1);
+static cpu_set_t allowed; // the cpus the process had before pinning
+static thread_local bool own_cpu = false; // pinned where no other thread stays
+
+bool pin_thread(int cpu) {
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return false;
+    if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) return false;
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    if (sched_setaffinity(0, sizeof(one), &one) < 0) return false;
+    pinned_cpu.store(cpu);
+    own_cpu = CPU_COUNT(&allowed) > 1;
+    return true;
+}
+
+void leave_pinned_cpu() {
+    int cpu = pinned_cpu.load();
+    if (cpu < 0) return;
+    cpu_set_t rest = allowed;
+    CPU_CLR(cpu, &rest);
+    // with one cpu there is nowhere else to go
+    if (CPU_COUNT(&rest) > 0) sched_setaffinity(0, sizeof(rest), &rest);
+}
+
+// ========================================================================== //
+// POLLER
+// ========================================================================== //
+
+BusyPoller::BusyPoller(uint64_t idle) : idle_us(idle) {
+    spins      = 0;
+    sleeps     = 0;
+    last_event = 0;
+    avg_gap    = idle / BUSY_POLL_GAP_MULT;
+    yield_in   = BUSY_POLL_YIELD_SPINS;
+}
+
+bool BusyPoller::spinning(uint64_t now) {
+    uint64_t window = std::min(std::max<uint64_t>(avg_gap * BUSY_POLL_GAP_MULT, BUSY_POLL_MIN_US), idle_us);
+    bool spin       = last_event != 0 && now - last_event < window;
+    if (spin) {
+        spins++;
+#if defined(__x86_64__)
+        _mm_pause();
+#endif
+        if (!own_cpu || --yield_in == 0) {
+            sched_yield();
+            yield_in = BUSY_POLL_YIELD_SPINS;
+        }
+    } else {
+        sleeps++;
+    }
+    return spin;
+}
+
+void BusyPoller::on_event(uint64_t now) {
+    if (last_event != 0) {
+        // a gap we slept through counts as no longer than the idle limit
+        int64_t gap = std::min(now - last_event, idle_us);
+        avg_gap += (gap - (int64_t)avg_gap) / BUSY_POLL_GAP_GAIN;
+    }
+    last_event = now;
+}
@@ -0,0 +1,54 @@
+#ifndef BUSYPOLL
+#define BUSYPOLL
+#include <stdint.h>
+
+// Low-latency mode (-B). A network loop that sleeps in poll or epoll until a
+// datagram comes pays for a wake-up and a trip through the scheduler on every
+// one, which is most of the time a small file takes on a fast link. With a
+// BusyPoller the loop asks with a zero timeout instead, for as long as
+// datagrams keep coming, and goes back to sleeping once none has come for a
+// while, so an idle server or client doesn't keep a core busy.
+//
+// How long it spins adapts to the traffic: a few times the average gap
+// between datagrams, at least BUSY_POLL_MIN_US and at most the idle limit.
+
+#define BUSY_POLL_IDLE_US 1000 // default longest spin with nothing coming
+#define BUSY_POLL_MIN_US 50
+#define BUSY_POLL_GAP_MULT 4   // spin this many average gaps
+#define BUSY_POLL_GAP_GAIN 8   // a gap moves the average by 1/8 of the difference
+#define BUSY_POLL_SOCKET_US 50 // SO_BUSY_POLL: how long a receive polls the device queue
+#define BUSY_POLL_YIELD_SPINS 64 // spins between yields on a cpu of our own
+
+// make fd non-blocking and, where the kernel has SO_BUSY_POLL and lets us,
+// have receives on it poll the device queue; false if that part didn't take
+bool busy_poll_socket(int fd);
+
+// run the calling thread on cpu alone; false if it can't. Threads that call
+// leave_pinned_cpu() once started then keep off that cpu, so they don't take
+// it from the loop spinning there. With only the one cpu to run on, they
+// can't, and a BusyPoller on the pinned thread keeps yielding to them.
+bool pin_thread(int cpu);
+void leave_pinned_cpu();
+
+class BusyPoller {
+    public:
+        BusyPoller(uint64_t idle_us = BUSY_POLL_IDLE_US);
+        // whether to wait with a zero timeout rather than sleep. A spin
+        // pauses the cpu; on a cpu shared with other threads it yields too, so
+        // they get a turn between polls rather than a time slice later, and
+        // on one pinned to this thread alone only every BUSY_POLL_YIELD_SPINS
+        bool spinning(uint64_t now);
+        // a datagram came in, or one sent wants an answer soon
+        void on_event(uint64_t now);
+
+        uint64_t spins;  // waits that didn't sleep
+        uint64_t sleeps; // waits that may have
+
+    private:
+        uint64_t idle_us;
+        uint64_t last_event; // 0 before the first
+        uint64_t avg_gap;
+        int yield_in; // spins left before the next yield
+};
+
+#endif
@@ -0,0 +1,256 @@
+#include "checksum.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // reflected
+
+// bytes per lane in the 3-way interleaved loop: long blocks for file reads,
+// short ones so a single segment gets split too
+#define CRC32C_LONG_LANE 2048
+#define CRC32C_SHORT_LANE 128
+
+// ========================================================================== //
+// PORTABLE
+// ========================================================================== //
+
+struct crc32c_tables {
+    uint32_t t[8][256];
+
+    crc32c_tables() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c >> 1) ^ (CRC32C_POLY & (0 - (c & 1)));
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++)
+            for (int k = 1; k < 8; k++) t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+    }
+};
+
+static const crc32c_tables tables;
+
+uint32_t crc32c_portable(uint32_t crc, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    uint32_t c             = ~crc;
+
+    // slicing-by-8: one table lookup per byte, eight of them independent
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c = tables.t[7][lo & 0xff] ^ tables.t[6][(lo >> 8) & 0xff] ^ tables.t[5][(lo >> 16) & 0xff] ^
+            tables.t[4][lo >> 24] ^ tables.t[3][hi & 0xff] ^ tables.t[2][(hi >> 8) & 0xff] ^
+            tables.t[1][(hi >> 16) & 0xff] ^ tables.t[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) c = (c >> 8) ^ tables.t[0][(c ^ *p++) & 0xff];
+    return ~c;
+}
+
+// ========================================================================== //
+// SSE4.2
+// ========================================================================== //
+
+#if defined(__x86_64__)
+bool crc32c_hw_available() {
+    static const bool has = __builtin_cpu_supports("sse4.2");
+    return has;
+}
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    uint64_t c             = ~crc;
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        c = _mm_crc32_u64(c, word);
+        p += 8;
+        len -= 8;
+    }
+    uint32_t c32 = (uint32_t)c;
+    while (len--) c32 = _mm_crc32_u8(c32, *p++);
+    return ~c32;
+}
+#else
+bool crc32c_hw_available() {
+    return false;
+}
+
+uint32_t crc32c_hw(uint32_t crc, const void* data, size_t len) {
+    return crc32c_portable(crc, data, len);
+}
+#endif
+
+// ========================================================================== //
+// SSE4.2 + PCLMUL
+// ========================================================================== //
+
+#if defined(__x86_64__)
+bool crc32c_clmul_available() {
+    static const bool has = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+    return has;
+}
+
+// x^n mod P, reflected like the CRC: bit 31 is x^0, and each step multiplies
+// by x, reducing what passes x^31
+static uint32_t crc32c_x_pow(uint32_t n) {
+    uint32_t v = 0x80000000;
+    while (n--) v = (v >> 1) ^ (CRC32C_POLY & (0 - (v & 1)));
+    return v;
+}
+
+// Moving a CRC over n more bytes is multiplying it by x^(8n) mod P. A
+// carry-less product of the CRC and x^(8n - 33) comes out one bit up in 64
+// bits, and crc32 of that word multiplies by x^32 and reduces, which makes
+// x^(8n). These are the x^(8n - 33) for one and two lanes.
+struct crc32c_shifts {
+    uint32_t long1, long2, short1, short2;
+
+    crc32c_shifts()
+        : long1(crc32c_x_pow(8 * CRC32C_LONG_LANE - 33)), long2(crc32c_x_pow(16 * CRC32C_LONG_LANE - 33)),
+          short1(crc32c_x_pow(8 * CRC32C_SHORT_LANE - 33)), short2(crc32c_x_pow(16 * CRC32C_SHORT_LANE - 33)) {}
+};
+
+static const crc32c_shifts shifts;
+
+// CRCs of three lanes running side by side, then the first two moved over
+// the lanes after them and folded into the third
+__attribute__((target("sse4.2,pclmul")))
+static uint64_t crc32c_lanes(uint64_t c, const unsigned char* p, size_t lane, uint32_t k1, uint32_t k2) {
+    uint64_t c0 = c, c1 = 0, c2 = 0;
+    for (size_t i = 0; i < lane; i += 8) {
+        uint64_t w0, w1, w2;
+        memcpy(&w0, p + i, 8);
+        memcpy(&w1, p + lane + i, 8);
+        memcpy(&w2, p + 2 * lane + i, 8);
+        c0 = _mm_crc32_u64(c0, w0);
+        c1 = _mm_crc32_u64(c1, w1);
+        c2 = _mm_crc32_u64(c2, w2);
+    }
+    __m128i a = _mm_clmulepi64_si128(_mm_cvtsi32_si128((uint32_t)c0), _mm_cvtsi32_si128(k2), 0);
+    __m128i b = _mm_clmulepi64_si128(_mm_cvtsi32_si128((uint32_t)c1), _mm_cvtsi32_si128(k1), 0);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(_mm_xor_si128(a, b))) ^ c2;
+}
+
+// A crc32 can start every cycle but takes three to finish, so one chain runs
+// the unit at a third of its rate and three independent lanes keep it busy.
+// What is left after the last block goes to crc32c_hw().
+__attribute__((target("sse4.2,pclmul")))
+uint32_t crc32c_clmul(uint32_t crc, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    uint64_t c             = ~crc;
+
+    while (len >= 3 * CRC32C_LONG_LANE) {
+        c = crc32c_lanes(c, p, CRC32C_LONG_LANE, shifts.long1, shifts.long2);
+        p += 3 * CRC32C_LONG_LANE;
+        len -= 3 * CRC32C_LONG_LANE;
+    }
+    while (len >= 3 * CRC32C_SHORT_LANE) {
+        c = crc32c_lanes(c, p, CRC32C_SHORT_LANE, shifts.short1, shifts.short2);
+        p += 3 * CRC32C_SHORT_LANE;
+        len -= 3 * CRC32C_SHORT_LANE;
+    }
+    return crc32c_hw(~(uint32_t)c, p, len);
+}
+#else
+bool crc32c_clmul_available() {
+    return false;
+}
+
+uint32_t crc32c_clmul(uint32_t crc, const void* data, size_t len) {
+    return crc32c_portable(crc, data, len);
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+    static uint32_t (*const impl)(uint32_t, const void*, size_t) =
+        crc32c_clmul_available() ? crc32c_clmul : crc32c_hw_available() ? crc32c_hw : crc32c_portable;
+    return impl(crc, data, len);
+}
+
+// ========================================================================== //
+// ROLLING CHECKSUM
+// ========================================================================== //
+
+void weak_sum_portable(const void* data, size_t len, uint32_t* pa, uint32_t* pb) {
+    const unsigned char* p = (const unsigned char*)data;
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += p[i];
+        b += (uint32_t)(len - i) * p[i];
+    }
+    *pa = a;
+    *pb = b;
+}
+
+#if defined(__x86_64__)
+bool weak_sum_avx2_available() {
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+}
+
+// Like adler32: going 32 bytes at a time, every byte already summed into a
+// gets 32 more weight in b, and the new bytes get 32 down to 1. All in
+// vector registers until the end.
+__attribute__((target("avx2")))
+void weak_sum_avx2(const void* data, size_t len, uint32_t* pa, uint32_t* pb) {
+    const unsigned char* p = (const unsigned char*)data;
+    const __m256i zero     = _mm256_setzero_si256();
+    const __m256i ones     = _mm256_set1_epi16(1);
+    const __m256i weights  = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                              16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    __m256i va = zero; // byte sums, four 64-bit lanes
+    __m256i vb = zero; // 32 times the byte sums before each chunk
+    __m256i vw = zero; // weighted sums within each chunk, eight 32-bit lanes
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(p + i));
+        vb        = _mm256_add_epi64(vb, _mm256_slli_epi64(va, 5));
+        va        = _mm256_add_epi64(va, _mm256_sad_epu8(x, zero));
+        vw        = _mm256_add_epi32(vw, _mm256_madd_epi16(_mm256_maddubs_epi16(x, weights), ones));
+    }
+
+    uint64_t la[4], lb[4];
+    uint32_t lw[8];
+    _mm256_storeu_si256((__m256i*)la, va);
+    _mm256_storeu_si256((__m256i*)lb, vb);
+    _mm256_storeu_si256((__m256i*)lw, vw);
+    uint32_t a = la[0] + la[1] + la[2] + la[3];
+    uint32_t b = lb[0] + lb[1] + lb[2] + lb[3];
+    for (int k = 0; k < 8; k++) b += lw[k];
+
+    // the tail adds its length in weight to everything before it
+    size_t tail = len - i;
+    b += (uint32_t)tail * a;
+    for (size_t k = 0; k < tail; k++) {
+        a += p[i + k];
+        b += (uint32_t)(tail - k) * p[i + k];
+    }
+    *pa = a;
+    *pb = b;
+}
+#else
+bool weak_sum_avx2_available() {
+    return false;
+}
+
+void weak_sum_avx2(const void* data, size_t len, uint32_t* a, uint32_t* b) {
+    weak_sum_portable(data, len, a, b);
+}
+#endif
+
+void weak_sum(const void* data, size_t len, uint32_t* a, uint32_t* b) {
+    static void (*const impl)(const void*, size_t, uint32_t*, uint32_t*) =
+        weak_sum_avx2_available() ? weak_sum_avx2 : weak_sum_portable;
+    impl(data, len, a, b);
+}
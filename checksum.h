@@ -0,0 +1,38 @@
+#ifndef CHECKSUM
+#define CHECKSUM
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli polynomial, as in iSCSI and ext4). Chains across calls:
+// crc32c(crc32c(0, a), b) is the CRC of a followed by b, so the same function
+// checks single segments and digests a whole stream. Uses the SSE4.2 crc32
+// instruction when the CPU has it, checked once at first use, and a
+// slicing-by-8 table otherwise. With PCLMUL too, buffers of 384 bytes and up
+// run as three interleaved crc32 chains, joined by carry-less multiplies.
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+// the three implementations behind crc32c(), for bench.cpp
+uint32_t crc32c_portable(uint32_t crc, const void* data, size_t len);
+bool crc32c_hw_available();
+uint32_t crc32c_hw(uint32_t crc, const void* data, size_t len);
+bool crc32c_clmul_available();
+uint32_t crc32c_clmul(uint32_t crc, const void* data, size_t len);
+
+// The rsync rolling checksum of a block of len bytes: a is the sum of the
+// bytes and b the sum of each byte times len minus its index, both mod 2^32.
+// Sliding the block one byte, from x_out to x_in, is
+//     a += x_in - x_out;  b += a - len * x_out;
+// and weak_sum_value() folds the pair into the 32-bit sum that is compared.
+// Uses AVX2 when the CPU has it.
+void weak_sum(const void* data, size_t len, uint32_t* a, uint32_t* b);
+
+inline uint32_t weak_sum_value(uint32_t a, uint32_t b) {
+    return (a & 0xffff) | (b << 16);
+}
+
+// the two implementations behind weak_sum(), for bench.cpp
+void weak_sum_portable(const void* data, size_t len, uint32_t* a, uint32_t* b);
+bool weak_sum_avx2_available();
+void weak_sum_avx2(const void* data, size_t len, uint32_t* a, uint32_t* b);
+
+#endif
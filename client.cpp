@@ -4,11 +4,19 @@
 
 // Standard Libraries
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <climits>
 #include <ctime>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <random>
 #include <queue>
 #include <string>
 #include <thread>
@@ -22,8 +30,10 @@
 // Networking
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <sys/epoll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <sys/time.h>
@@ -31,7 +41,11 @@
 // Filesystem
 
 // Local
+#include "busypoll.h"
 #include "common.h"
+#include "pcap.h"
+#include "pipeline.h"
+#include "protocol.h"
 
 // ========================================================================== //
 // DEFINITIONS
@@ -43,39 +57,25 @@
 #define OPT_LOG 0
 #endif
 
-using namespace std;
+#define CLIENT_DEFAULT_CONCURRENCY 8
+#define CLIENT_RESUME_RETRIES 3 // times a resumable stripe is tried again after a timeout
+#define CLIENT_MAX_EVENTS 16    // epoll events taken per wakeup
 
-std::queue<uint32_t> cwnd_q;
-std::queue<int> paysize_q;
+using namespace std;
 
-int cwnd     = SPEC_INIT_CWND;
-int ssthresh = SPEC_INIT_SS_THRESH;
+// every datagram sent and received, when run with -w
+std::unique_ptr<PcapWriter> capture;
 
 // ========================================================================== //
 // FUNCTIONS
 // ========================================================================== //
-void update_cwnd_ssthresh() {
-    if (cwnd < ssthresh) {
-        cwnd += SPEC_INIT_CWND;
-    } else {
-        cwnd += SPEC_INIT_CWND * SPEC_INIT_CWND / cwnd;
-    }
-    if (cwnd > SPEC_MAX_CWND) {
-        cwnd = SPEC_MAX_CWND;
-    }
-}
-
-void on_timeout() {
-    ssthresh = cwnd / 2;
-    cwnd     = SPEC_INIT_CWND;
-}
 
 void sig_handle(int sig) {
     if (sig == SIGTERM || sig == SIGQUIT) exit(0);
     exit(sig);
 }
 
-std::tuple<int, struct addrinfo*> open_socket(const char* hostname, int port) {
+std::tuple<int, Peer> open_socket(const char* hostname, int port) {
 
     auto port_name = std::to_string(port);
     _log("SOCKET SETUP: Port name: ", port_name, "\n");
@@ -107,65 +107,443 @@ std::tuple<int, struct addrinfo*> open_socket(const char* hostname, int port) {
     if (p == NULL) _exit("Failed to bind to socket", 2);
     _log("SOCKET: ready to send");
 
+    Peer server;
+    memset(&server, 0, sizeof(server));
+    memcpy(&server.addr, p->ai_addr, p->ai_addrlen);
+    server.len = p->ai_addrlen;
+
     freeaddrinfo(server_info);
-    return std::make_tuple(socket_fd, p);
+    return std::make_tuple(socket_fd, server);
 }
 
-int handshake(int socket_fd, struct sockaddr* addr, socklen_t size, uint32_t* seq_num, uint32_t* ack_num, uint16_t* cid) {
-    *seq_num = 12345;
-    *ack_num = 0;
-
-    packet syn;
-    memset(&syn, 0, sizeof(struct packet));
-    syn.packet_head.sequence_number = htonl(*seq_num);
-    syn.packet_head.ack_number      = htonl(*ack_num);
-    syn.packet_head.connection_id   = htons(0);
-    syn.packet_head.flags           = SYN;
-
-    int numbytes = 0;
-    numbytes     = sendto(socket_fd, &syn, 12, 0, addr, size);
-    err(numbytes, "Sending SYN");
-    _log("handshake syn talker: sent ", numbytes, " bytes");
-    _log("SENT SYN PACKET:");
-    printpacket(&syn);
-    output_packet(&syn, cwnd, ssthresh, TYPE_SEND);
-
-    packet syn_ack;
-    memset(&syn_ack, 0, sizeof(struct packet));
-    int rc = 0;
-    rc     = recvfrom(socket_fd, &syn_ack, 12, 0, NULL, 0);
-    _log("RECV returned: ", rc);
-    err(rc, "HANDSHAKE while recv from socket");
+// A resume token that stays the same for as long as the file does: a hash of
+// its full path, size, modification time and how it is split into stripes.
+// 0 if the file can't be resumed, like stdin.
+uint64_t resume_token(const std::string& path, uint16_t stripes) {
+    struct stat st;
+    char full[PATH_MAX];
+    if (path == "-" || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+    if (realpath(path.c_str(), full) == NULL) return 0;
+
+    std::string id = std::string(full) + ":" + std::to_string(st.st_size) + ":" + std::to_string(st.st_mtim.tv_sec) +
+                     "." + std::to_string(st.st_mtim.tv_nsec) + ":" + std::to_string(stripes);
+    // 64-bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : id) hash = (hash ^ c) * 1099511628211ULL;
+    return hash != 0 ? hash : 1;
+}
+
+// ========================================================================== //
+// TRANSFER ENGINE
+// ========================================================================== //
 
-    if (syn_ack.packet_head.flags != SYNACK) {
-        _exit("BAD SYNACK RECEIVED");
+// one file to upload, split into one or more stripes
+struct Job {
+    std::string path;  // "-" for stdin
+    uint64_t size;     // UINT64_MAX if not known up front
+    uint64_t stripe_len;
+    uint16_t stripes;
+    uint16_t launched;
+    uint16_t running;  // stripes launched but not finished
+    uint32_t transfer_id;
+    uint64_t token;     // resume token, 0 without -R
+    const char* failed; // why, if any stripe failed
+};
+
+// a stripe to be tried again
+struct Retry {
+    Job* job;
+    uint16_t index;
+    int attempt;
+};
+
+// one stripe of a job being uploaded over its own connection
+struct Transfer {
+    ~Transfer() {
+        // the reader thread has to be gone before its fd is, and the
+        // compressor and delta before whatever they read from
+        conn.reset();
+        packed.reset();
+        delta.reset();
+        source.reset();
+        if (fd > STDIN_FILENO) close(fd);
     }
 
-    *cid     = ntohs(syn_ack.packet_head.connection_id);
-    *seq_num = ntohl(syn_ack.packet_head.ack_number);
-    *ack_num = ntohl(syn_ack.packet_head.sequence_number) + 1;
-    _log("RCV SYNACK PACKET:");
-    printpacket(&syn_ack);
-    output_packet(&syn_ack, cwnd, ssthresh, TYPE_RECV);
-
-    // packet ack;
-    // memset(&ack, 0, sizeof(struct packet));
-    // ack.packet_head.sequence_number = htonl(*seq_num);
-    // ack.packet_head.ack_number      = htonl(*ack_num);
-    // ack.packet_head.connection_id   = htons(*cid);
-    // ack.packet_head.flags           = ACK;
-
-    // int numbytes2 = 0;
-    // numbytes2     = sendto(socket_fd, &ack, 12, 0, addr, size);
-    // err(numbytes2, "Sending handshake ACK");
-    // _log("talker: sent ", numbytes, " bytes");
-    // _log("SENT ACK PACKET:");
-    // printpacket(&ack);
-    // output_packet(&ack, cwnd, ssthresh, TYPE_SEND);
+    Job* job;
+    uint16_t index;
+    int attempt; // 0 the first time
+    int fd;
+    std::unique_ptr<ReadAheadSource> source;
+    BlockSums sums;                         // of the basis, with -D
+    std::unique_ptr<DeltaSource> delta;     // with -D
+    std::unique_ptr<CompressSource> packed; // with -z
+    std::unique_ptr<ClientConn> conn;
+    size_t sock;
+};
+
+// A socket shared by several transfers. Replies are told apart by connection
+// id, except the SYNACK, which only carries the id it hands out, so each
+// socket has at most one handshake in progress at a time.
+struct Socket {
+    int fd;
+    Peer local;
+    std::unique_ptr<SendStage> sender;
+    Transfer* connecting;
+    std::map<uint16_t, Transfer*> by_cid;
+    int active;
+    uint16_t nonce; // of the last SYN, never 0
+};
+
+// Runs any number of uploads from one thread, at most concurrency connections
+// at once, spread over a small pool of sockets. Files are split into up to
+// stripes ranges that upload in parallel into the same server-side file.
+class Engine {
+    public:
+        Engine(const char* hostname, int port, int num_sockets, size_t concurrency, int stripes, bool integrity,
+               bool compress, bool resume, int basis, bool zero_rtt, bool parity, uint64_t busy_us);
+        ~Engine();
+
+        // upload every file, returns how many failed
+        int run(const std::vector<std::string>& files);
+
+        const char* last_failure; // why the last failed job failed
+
+    private:
+        void launch(Job* job, uint16_t index, int attempt, size_t sock, uint64_t now);
+        void receive(size_t sock, uint64_t now);
+        void arm_timer(uint64_t deadline, uint64_t now);
+        void finish(Transfer* t);
+        void stripe_done(Job* job, const char* failure);
+
+        Peer server;
+        std::vector<std::unique_ptr<Socket>> sockets;
+        // the loop sleeps in epoll on the sockets and a timer set to the
+        // earliest deadline, so it wakes to the microsecond rather than the
+        // millisecond a poll timeout rounds to
+        int epoll_fd;
+        int timer_fd;
+        uint64_t armed; // deadline the timer is set for, NO_DEADLINE if none
+        // in low-latency mode, says when to spin on epoll rather than sleep
+        std::unique_ptr<BusyPoller> poller;
+        std::list<std::unique_ptr<Transfer>> active;
+        std::deque<Retry> retries;
+        size_t concurrency;
+        int max_stripes;
+        bool integrity;
+        bool compress;
+        bool resume;
+        int basis; // server file to send deltas against, -1 for none
+        bool zero_rtt;
+        bool parity;
+        std::mt19937 rng;
+        bool quiet_failures;
+        int failed;
+};
+
+Engine::Engine(const char* hostname, int port, int num_sockets, size_t limit, int stripes, bool check, bool pack,
+               bool resumable, int basis_id, bool early, bool fec, uint64_t busy_us) {
+    concurrency    = limit;
+    max_stripes    = stripes;
+    integrity      = check;
+    compress       = pack;
+    resume         = resumable;
+    basis          = basis_id;
+    zero_rtt       = early;
+    parity         = fec;
+    rng.seed(std::random_device()());
+    quiet_failures = false;
+    failed         = 0;
+    last_failure   = NULL;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    err(epoll_fd, "Creating epoll instance");
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    err(timer_fd, "Creating timer");
+    armed = NO_DEADLINE;
+    if (busy_us > 0) poller.reset(new BusyPoller(busy_us));
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.u64 = num_sockets;
+    err(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev), "Watching timer");
+
+    for (int i = 0; i < num_sockets; i++) {
+        std::unique_ptr<Socket> s(new Socket());
+        std::tie(s->fd, server) = open_socket(hostname, port);
+        err(fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK), "Setting socket non-blocking");
+        if (poller && !busy_poll_socket(s->fd)) _log("SO_BUSY_POLL not available, spinning on epoll alone");
+        ev.data.u64 = i;
+        err(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->fd, &ev), "Watching socket");
+
+        memset(&s->local, 0, sizeof(s->local));
+        if (capture) {
+            // pick our port now rather than on the sender thread's first sendto
+            struct sockaddr_in any;
+            memset(&any, 0, sizeof(any));
+            any.sin_family = AF_INET;
+            err(bind(s->fd, (struct sockaddr*)&any, sizeof(any)), "Binding socket");
+            s->local.len = sizeof(s->local.addr);
+            getsockname(s->fd, (struct sockaddr*)&s->local.addr, &s->local.len);
+        }
 
-    return 0;
+        s->sender.reset(new SendStage(s->fd, server, s->local, capture.get(), busy_us));
+        s->connecting = NULL;
+        s->active     = 0;
+        s->nonce      = 0;
+        sockets.push_back(std::move(s));
+    }
+}
+
+Engine::~Engine() {
+    active.clear();
+    for (auto& s : sockets) {
+        s->sender->close();
+        shutdown(s->fd, 2);
+        close(s->fd);
+    }
+    close(timer_fd);
+    close(epoll_fd);
+}
+
+// have the timer go off at deadline, on the time_now_us() clock. A later
+// deadline than the one set leaves it be, as waking early only costs a
+// trip round the loop, which saves a syscall on nearly every ACK.
+void Engine::arm_timer(uint64_t deadline, uint64_t now) {
+    if (armed != NO_DEADLINE && armed <= deadline) return;
+    uint64_t ns = (deadline - now) * 1000;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec  = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+    err(timerfd_settime(timer_fd, 0, &spec, NULL), "Setting timer");
+    armed = deadline;
+}
+
+void Engine::launch(Job* job, uint16_t index, int attempt, size_t sock, uint64_t now) {
+    // a retried stripe never stopped running
+    if (attempt == 0) job->running++;
+
+    std::unique_ptr<Transfer> t(new Transfer());
+    t->job     = job;
+    t->index   = index;
+    t->attempt = attempt;
+    t->sock    = sock;
+    t->fd   = job->path == "-" ? STDIN_FILENO : open(job->path.c_str(), O_RDONLY);
+    if (t->fd < 0) {
+        stripe_done(job, "Opening file");
+        return;
+    }
+
+    uint64_t base = index * job->stripe_len;
+    uint64_t len  = std::min(job->stripe_len, job->size - base);
+
+    Socket& s      = *sockets[sock];
+    SendStage* out = s.sender.get();
+    t->source.reset(new ReadAheadSource(t->fd, base, len));
+    DataSource* data = t->source.get();
+    if (basis >= 0) {
+        t->delta.reset(new DeltaSource(data, &t->sums));
+        data = t->delta.get();
+    }
+    t->conn.reset(new ClientConn(data, [out](const packet* pack, int len) { out->send(pack, len); }));
+    t->conn->integrity = integrity;
+    t->conn->token     = job->token;
+    t->conn->zero_rtt  = zero_rtt;
+    t->conn->parity    = parity;
+    do s.nonce++; while (s.nonce == 0);
+    t->conn->nonce = s.nonce;
+    if (basis >= 0) {
+        t->conn->basis = basis;
+        t->conn->sums  = &t->sums;
+    }
+    if (compress) {
+        t->packed.reset(new CompressSource(data));
+        t->conn->packed = t->packed.get();
+    }
+    if (job->stripes > 1) {
+        char info[STRIPE_INFO_SIZE];
+        encode_stripe(info, {job->transfer_id, base, index, job->stripes});
+        t->conn->syn_payload.assign(info, sizeof(info));
+    }
+    t->conn->start(now);
+    // the SYNACK is worth spinning for too
+    if (poller) poller->on_event(now);
+
+    s.connecting = t.get();
+    s.active++;
+    active.push_back(std::move(t));
+}
+
+void Engine::receive(size_t sock, uint64_t now) {
+    Socket& s = *sockets[sock];
+    packet incoming;
+    while (true) {
+        int rc = recvfrom(s.fd, &incoming, sizeof(struct packet), 0, NULL, 0);
+        if (rc < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) err(rc, "CLIENT while recvfrom socket");
+            return;
+        }
+        if (capture) capture->record(&incoming, rc, server, s.local);
+        if (poller) poller->on_event(now);
+        if (rc < 12) continue;
+
+        fields in   = decode_header(&incoming.packet_head);
+        Transfer* t = NULL;
+        if (in.flags == SYNACK && s.connecting != NULL && s.by_cid.count(in.cid) == 0) {
+            t = s.connecting;
+        } else {
+            auto it = s.by_cid.find(in.cid);
+            if (it != s.by_cid.end()) t = it->second;
+        }
+        if (t == NULL) continue;
+
+        t->conn->on_packet(&incoming, rc, now);
+        if (t == s.connecting && t->conn->state != CLIENT_SYN_SENT) {
+            s.connecting = NULL;
+            // the id may still belong to one of ours in time-wait, which only
+            // has the server's FIN left to hear and can do without
+            s.by_cid[t->conn->cid] = t;
+        }
+    }
+}
+
+void Engine::finish(Transfer* t) {
+    Socket& s = *sockets[t->sock];
+    if (s.connecting == t) s.connecting = NULL;
+    auto it = s.by_cid.find(t->conn->cid);
+    if (it != s.by_cid.end() && it->second == t) s.by_cid.erase(it);
+    s.active--;
+
+    if (t->conn->compressed && t->packed->raw_bytes > 0) {
+        _log("COMPRESSED ", t->packed->raw_bytes, " bytes to ", t->packed->packed_bytes, ", ",
+             t->packed->deflated_blocks, " blocks deflated, ", t->packed->skipped_blocks, " not tried");
+    }
+
+    if (t->sums.block_size > 0 && t->delta->raw_bytes > 0) {
+        _log("DELTA OF ", t->delta->raw_bytes, " bytes: ", t->delta->copied_blocks, " blocks of ",
+             t->sums.block_size, " copied, ", t->delta->literal_bytes, " bytes sent");
+    }
+
+    if (t->conn->parity_sent > 0) _log("SENT ", t->conn->parity_sent, " PARITY SEGMENTS");
+    if (t->conn->rack_losses > 0) _log("DECLARED ", t->conn->rack_losses, " SEGMENTS LOST BEFORE AN RTO");
+
+    if (t->conn->resumed_from > 0) _log("RESUMED ", t->job->path, " stripe ", t->index, " at ", t->conn->resumed_from);
+
+    // a resumable stripe goes again, the server will say how much it kept
+    if (t->conn->state == CLIENT_FAILED && t->job->token != 0 && t->attempt < CLIENT_RESUME_RETRIES)
+        retries.push_back({t->job, t->index, t->attempt + 1});
+    else if (t->conn->state == CLIENT_FAILED) stripe_done(t->job, "10 second timeout");
+    else if (t->conn->mismatch) stripe_done(t->job, "Server's copy does not match");
+    else if (integrity && !t->conn->verified) stripe_done(t->job, "Server's copy could not be verified");
+    else stripe_done(t->job, NULL);
 }
 
+// a job is only reported once every one of its stripes has finished
+void Engine::stripe_done(Job* job, const char* failure) {
+    job->running--;
+    if (failure != NULL && job->failed == NULL) job->failed = failure;
+    if (job->running > 0 || job->launched < job->stripes || job->failed == NULL) return;
+
+    if (!quiet_failures) fprintf(stderr, "ERROR: %s: %s.\n", job->path.c_str(), job->failed);
+    last_failure = job->failed;
+    failed++;
+}
+
+int Engine::run(const std::vector<std::string>& files) {
+    // a lone transfer keeps the old single-file error output
+    quiet_failures = files.size() == 1;
+
+    std::vector<Job> jobs(files.size());
+    for (size_t i = 0; i < files.size(); i++) {
+        Job& job = jobs[i];
+        job.path = files[i];
+        job.size = UINT64_MAX;
+        struct stat st;
+        if (job.path != "-" && stat(job.path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) job.size = st.st_size;
+
+        // whole payloads per stripe, and no more stripes than payloads; a
+        // stream of unknown length, or a delta, goes in one piece
+        uint64_t segments = std::max<uint64_t>((job.size + SPEC_MAX_PAYLOAD_SIZE - 1) / SPEC_MAX_PAYLOAD_SIZE, 1);
+        uint64_t per      = (segments + max_stripes - 1) / max_stripes;
+        job.stripe_len    = per * SPEC_MAX_PAYLOAD_SIZE;
+        job.stripes       = (segments + per - 1) / per;
+        if (job.size == UINT64_MAX || basis >= 0) {
+            job.stripe_len = UINT64_MAX;
+            job.stripes    = 1;
+        }
+        job.launched      = 0;
+        job.running       = 0;
+        job.failed        = NULL;
+        job.token         = resume && basis < 0 ? resume_token(job.path, job.stripes) : 0;
+        do job.transfer_id = rng(); while (job.transfer_id == 0);
+    }
+
+    struct epoll_event events[CLIENT_MAX_EVENTS];
+    size_t next = 0;
+    while (next < jobs.size() || !active.empty() || !retries.empty()) {
+        uint64_t now = time_now_us();
+
+        // start stripes up to the limit, retries first, on the least busy
+        // socket that has no handshake in progress
+        while ((next < jobs.size() || !retries.empty()) && active.size() < concurrency) {
+            size_t best = sockets.size();
+            for (size_t i = 0; i < sockets.size(); i++) {
+                if (sockets[i]->connecting != NULL) continue;
+                if (best == sockets.size() || sockets[i]->active < sockets[best]->active) best = i;
+            }
+            if (best == sockets.size()) break;
+            if (!retries.empty()) {
+                Retry r = retries.front();
+                retries.pop_front();
+                launch(r.job, r.index, r.attempt, best, now);
+                continue;
+            }
+            Job& job = jobs[next];
+            launch(&job, job.launched++, 0, best, now);
+            if (job.launched == job.stripes) next++;
+        }
+
+        uint64_t deadline = NO_DEADLINE;
+        for (auto& t : active) deadline = std::min(deadline, t->conn->next_deadline());
+        int timeout = -1;
+        if (active.empty() || deadline <= now || (poller && poller->spinning(now))) {
+            timeout = 0;
+        } else if (deadline != NO_DEADLINE) {
+            arm_timer(deadline, now);
+        }
+
+        int rc = epoll_wait(epoll_fd, events, CLIENT_MAX_EVENTS, timeout);
+        if (rc < 0 && errno != EINTR) err(rc, "CLIENT while waiting on sockets");
+
+        now = time_now_us();
+        for (int i = 0; i < rc; i++) {
+            size_t sock = events[i].data.u64;
+            if (sock < sockets.size()) {
+                receive(sock, now);
+                continue;
+            }
+            uint64_t expirations;
+            if (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) armed = NO_DEADLINE;
+        }
+
+        for (auto it = active.begin(); it != active.end();) {
+            Transfer* t = it->get();
+            t->conn->on_tick(now);
+            if (t->conn->finished()) {
+                finish(t);
+                it = active.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    return failed;
+}
+
+// ========================================================================== //
+// MAIN
+// ========================================================================== //
+
 int main(int argc, char** argv) {
     // ========================================================================== //
     //     get arguments
@@ -173,257 +551,109 @@ int main(int argc, char** argv) {
 
     int OPT_PORT = 0;
     std::string OPT_HOST;
-    std::string OPT_DIR;
+    std::vector<std::string> OPT_FILES;
+    std::string OPT_MANIFEST;
+    std::string OPT_CAPTURE;
+    size_t OPT_CAPTURE_SLOTS = PCAP_DEFAULT_SLOTS;
+    size_t OPT_CONCURRENCY   = CLIENT_DEFAULT_CONCURRENCY;
+    int OPT_SOCKETS          = 1;
+    int OPT_STRIPES          = 1;
+    bool OPT_INTEGRITY       = false;
+    bool OPT_COMPRESS        = false;
+    bool OPT_RESUME          = false;
+    int OPT_BASIS            = -1;
+    bool OPT_ZERO_RTT        = false;
+    bool OPT_FEC             = false;
+    uint64_t OPT_BUSY_US     = 0;
+    int OPT_CPU              = -1;
 
     signal(SIGQUIT, sig_handle);
     signal(SIGTERM, sig_handle);
 
-    if (argc != 4)
-        _exit("Invalid arguments.\n usage: \"./client <HOSTNAME-OR-IP> <PORT> <FILENAME>\"");
+    const char* usage = "Invalid arguments.\nusage: \"./client [-w CAPTURE-FILE] [-W CAPTURE-SLOTS] [-c CONCURRENCY] "
+                        "[-s SOCKETS] [-P STRIPES] [-C] [-z] [-R] [-D BASIS-ID] [-0] [-F] [-B SPIN-US] [-A CPU] [-m MANIFEST] <HOSTNAME-OR-IP> <PORT> [FILENAME...]\"";
 
     _log("Logging enabled.");
 
     try {
-        OPT_HOST = argv[1];
-        OPT_PORT = std::stoi(argv[2]);
-        OPT_DIR  = argv[3];
+        int opt;
+        while ((opt = getopt(argc, argv, "w:W:c:s:P:CzRD:0FB:A:m:")) != -1) {
+            switch (opt) {
+                case 'w': OPT_CAPTURE = optarg; break;
+                case 'W': OPT_CAPTURE_SLOTS = std::stoul(optarg); break;
+                case 'c': OPT_CONCURRENCY = std::stoul(optarg); break;
+                case 's': OPT_SOCKETS = std::stoi(optarg); break;
+                case 'P': OPT_STRIPES = std::stoi(optarg); break;
+                case 'C': OPT_INTEGRITY = true; break;
+                case 'z': OPT_COMPRESS = true; break;
+                case 'R': OPT_RESUME = true; break;
+                case 'D': OPT_BASIS = std::stoi(optarg); break;
+                case '0': OPT_ZERO_RTT = true; break;
+                case 'F': OPT_FEC = true; break;
+                case 'B': OPT_BUSY_US = std::stoull(optarg); break;
+                case 'A': OPT_CPU = std::stoi(optarg); break;
+                case 'm': OPT_MANIFEST = optarg; break;
+                default: throw std::invalid_argument("Unknown option");
+            }
+        }
+        if (argc - optind < 2) throw std::invalid_argument("Wrong number of arguments");
+        OPT_HOST = argv[optind];
+        OPT_PORT = std::stoi(argv[optind + 1]);
+        for (int i = optind + 2; i < argc; i++) OPT_FILES.push_back(argv[i]);
         if (OPT_PORT < 0 || OPT_PORT > 65535) throw std::invalid_argument("Invalid Port");
+        if (OPT_CONCURRENCY < 1 || OPT_SOCKETS < 1 || OPT_STRIPES < 1 || OPT_STRIPES > 10) throw std::invalid_argument("Invalid concurrency");
+        if (OPT_BASIS < -1 || OPT_BASIS > 10) throw std::invalid_argument("Invalid basis");
+        if (OPT_FILES.empty() && OPT_MANIFEST.empty()) throw std::invalid_argument("No files");
         // if (validateHost(argv[1]) == -1) throw std::invalid_argument("Invalid Hostname");
     } catch (const std::exception& e) {
-        _exit("Invalid arguments.\nusage: \"./client <HOSTNAME-OR-IP> <PORT> <FILE-DIR>\"");
+        _exit(usage);
     }
 
-    std::ifstream readFile;
-    readFile.open(argv[3], std::ios::binary|std::ios::ate);
-    if (readFile.fail()) {
-        _exit("Opening file");
+    if (!OPT_MANIFEST.empty()) {
+        // one path per line
+        std::ifstream manifest(OPT_MANIFEST.c_str());
+        if (manifest.fail()) _exit("Opening manifest");
+        std::string line;
+        while (std::getline(manifest, line))
+            if (!line.empty()) OPT_FILES.push_back(line);
     }
-    else if (readFile.tellg() > (100*1024*1024)) {
-        _exit("File too big");
+
+    // check every file up front rather than failing halfway through the
+    // batch; "-" streams stdin, which can only be read once
+    if (std::count(OPT_FILES.begin(), OPT_FILES.end(), "-") > 1) _exit("stdin given more than once");
+    for (auto& path : OPT_FILES) {
+        if (path == "-") continue;
+        if (access(path.c_str(), R_OK) != 0) {
+            _exit(OPT_FILES.size() == 1 ? "Opening file" : ("Opening file " + path).c_str());
+        }
     }
-    // int file_fd = open(argv[3], O_RDONLY);
-    // err(file_fd, "Opening file");
 
     // ========================================================================== //
-    //     open sockets
+    //     transfer
     // ========================================================================== //
 
-
-    // open socket
-    int socket_fd;
-    struct addrinfo* p;
-    std::tie(socket_fd, p) = open_socket(OPT_HOST.c_str(), OPT_PORT);
-
-    uint32_t seq_num;
-    std::streampos streamposition = 0;
-    uint32_t ack_num = 0;
-    uint16_t cid = 0;
-    int amt_sent = 0;
-    bool done = false;
-    bool truedone = false;
-
-    // try handshake
-    handshake(socket_fd, p->ai_addr, p->ai_addrlen, &seq_num, &ack_num, &cid);
-
-    // make socket non-blocking
-    struct timeval socket_timeout;
-    socket_timeout.tv_sec  = 0;
-    socket_timeout.tv_usec = 5000;
-    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &socket_timeout, sizeof(socket_timeout));
-
-    uint64_t retransmit_last_time = time_now_ms();
-
-    uint64_t last_active_time = time_now_ms();
-    while (truedone == false) {
-        uint64_t current_time = time_now_ms();
-        uint64_t time_diff = current_time - last_active_time;
-        uint64_t retransmit_time_diff = current_time - retransmit_last_time;
-        if (time_diff > 10000) {
-            _exit("10 second timeout");
-        }
-        else if (retransmit_time_diff > 500) {
-            seq_num = cwnd_q.front();
-            while (!cwnd_q.empty()) {
-                streamposition -= paysize_q.front();
-                paysize_q.pop();
-                cwnd_q.pop();
-            }
-            on_timeout();
-        }
-
-        packet curr_pack;
-        memset(&curr_pack, 0, sizeof(struct packet));
-        packet rcv_ack;
-        memset(&rcv_ack, 0, sizeof(struct packet));
-
-        int rc = 0;
-        if (amt_sent > 0) {
-            rc = recvfrom(socket_fd, &rcv_ack, 12, 0, NULL, 0);
-            // _log("RECV returned, ", rc, "done: ", done, "truedone: ", truedone);
-            if (rc > 0) {
-                last_active_time = time_now_ms();
-                _log("ACK FROM PACK = ", ntohl(rcv_ack.packet_head.ack_number), " front ", cwnd_q.front(), "seq num", seq_num);
-                if (rcv_ack.packet_head.flags == ACK && (ntohl(rcv_ack.packet_head.ack_number) >= (seq_num%(SPEC_MAX_SEQ + 1)) || ntohl(rcv_ack.packet_head.ack_number) <= 511)) /*== cwnd_q.front()*/ {
-                    uint32_t curr_ack_num = ntohl(rcv_ack.packet_head.ack_number);
-                    // cwnd_q.pop();
-                    // amt_sent -= paysize_q.front();
-                    // paysize_q.pop();
-                    amt_sent -= curr_ack_num - cwnd_q.front();
-                    if (amt_sent > SPEC_MAX_SEQ) {
-                        amt_sent = SPEC_MAX_SEQ - cwnd_q.front() + curr_ack_num + 1;
-                    }
-                    _log("AMT SENT AFTER ACK = ", amt_sent, " front ", cwnd_q.front(), " ", paysize_q.front());
-                    while (!cwnd_q.empty() && (((cwnd_q.front() + paysize_q.front())%(SPEC_MAX_SEQ + 1)) <= curr_ack_num)) {
-                        _log("cwnd ", cwnd_q.front(), "pays", paysize_q.front());
-                        cwnd_q.pop();
-                        paysize_q.pop();
-                    }
-                    seq_num = curr_ack_num % (SPEC_MAX_SEQ + 1);
-                    retransmit_last_time = time_now_ms();
-                }
-                if (ntohl(rcv_ack.packet_head.ack_number) >= ((cwnd_q.front()+paysize_q.front())%(SPEC_MAX_SEQ + 1))) {
-                    _log("RCV ACK PACKET:");
-                    printpacket(&rcv_ack);
-                    output_packet(&rcv_ack, cwnd, ssthresh, TYPE_RECV);
-                    update_cwnd_ssthresh();
-                }
-            }
-            if (cwnd_q.size() == 0 && done) {
-                truedone = true;
-                break;
-            }
-        }
-
-        if (amt_sent <= cwnd) {
-            readFile.seekg(streamposition);
-            readFile.read(curr_pack.payload, SPEC_MAX_PAYLOAD_SIZE);
-            int readLen = readFile.gcount();
-            streamposition += readLen;
-            if (readLen < SPEC_MAX_PAYLOAD_SIZE) {
-                done = true;
-            }
-            if (readLen == 0) continue;
-            curr_pack.packet_head.sequence_number = htonl(seq_num);
-            curr_pack.packet_head.ack_number      = htonl(ack_num);
-            curr_pack.packet_head.connection_id   = htons(cid);
-            curr_pack.packet_head.flags           = ACK;
-
-            int numbytes = 0;
-            numbytes     = sendto(socket_fd, &curr_pack, 12 + readLen, 0, p->ai_addr, p->ai_addrlen);
-            err(numbytes, "Sending payload");
-            _log("SENT ", numbytes, " bytes");
-            _log("SENT payload PACKET:");
-            printpacket(&curr_pack);
-            output_packet(&curr_pack, cwnd, ssthresh, TYPE_SEND);
-            cwnd_q.push(seq_num);
-            seq_num += readLen;
-            seq_num %= SPEC_MAX_SEQ + 1;
-            // cwnd_q.push(seq_num);
-            _log("SEQ NUM = ", seq_num);
-            _log("READLEN = ", readLen);
-            paysize_q.push(readLen);
-            amt_sent += readLen;
-            _log("AMT SENT = ", amt_sent);
-        }
+    if (!OPT_CAPTURE.empty()) capture.reset(new PcapWriter(OPT_CAPTURE.c_str(), OPT_CAPTURE_SLOTS));
+
+    // this thread runs the protocol for every connection; file reads and
+    // sends happen on each transfer's read-ahead thread and each socket's
+    // sender thread
+    int failed;
+    const char* failure;
+    {
+        Engine engine(OPT_HOST.c_str(), OPT_PORT, OPT_SOCKETS, OPT_CONCURRENCY, OPT_STRIPES, OPT_INTEGRITY,
+                      OPT_COMPRESS, OPT_RESUME, OPT_BASIS, OPT_ZERO_RTT, OPT_FEC, OPT_BUSY_US);
+        // with -A the protocol thread runs on that cpu; the sender threads
+        // started before, unpinned, and read-ahead threads keep off it
+        if (OPT_CPU >= 0 && !pin_thread(OPT_CPU)) _exit("Pinning to CPU");
+        failed  = engine.run(OPT_FILES);
+        failure = engine.last_failure;
     }
+    capture.reset();
 
-    packet finpack;
-    memset(&finpack, 0, sizeof(struct packet));
-    finpack.packet_head.flags           = FIN;
-    finpack.packet_head.connection_id   = htons(cid);
-    finpack.packet_head.sequence_number = htonl(seq_num);
-    finpack.packet_head.ack_number      = htonl(0);
-
-    int numbytes = 0;
-    numbytes     = sendto(socket_fd, &finpack, 12, 0, p->ai_addr, p->ai_addrlen);
-    err(numbytes, "Sending FIN");
-    _log("fin talker: sent ", numbytes, " bytes");
-    _log("SENT FIN PACKET:");
-    printpacket(&finpack);
-    output_packet(&finpack, cwnd, ssthresh, TYPE_SEND);
-    
-
-    struct timeval time_val_struct;
-    time_val_struct.tv_sec = 0;
-    time_val_struct.tv_usec = 0;
-    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &time_val_struct, sizeof(time_val_struct));
-
-    packet finack;
-    memset(&finack, 0, sizeof(struct packet));
-    int rc = 0;
-    rc = recvfrom(socket_fd, &finack, 12, 0, NULL, 0);
-    err(rc, "CLIENT END while recvfrom socket");
-    _log("RCV FINACK PACKET:");
-    printpacket(&finack);
-    output_packet(&finack, cwnd, ssthresh, TYPE_RECV);
-
-    packet finalack;
-    memset(&finalack, 0, sizeof(struct packet));
-    finalack.packet_head.flags           = ACK;
-    finalack.packet_head.connection_id   = finack.packet_head.connection_id;
-    finalack.packet_head.sequence_number = finack.packet_head.ack_number;
-    finalack.packet_head.ack_number      = htonl(ntohl(finack.packet_head.sequence_number) + 1);
-
-    numbytes     = sendto(socket_fd, &finalack, 12, 0, p->ai_addr, p->ai_addrlen);
-    err(numbytes, "Sending final ACK");
-    _log("final ACK talker: sent ", numbytes, " bytes");
-    _log("SENT final ACK PACKET:");
-    printpacket(&finalack);
-    output_packet(&finalack, cwnd, ssthresh, TYPE_SEND);
-
-    packet leftover_fin;
-    memset(&leftover_fin, 0, sizeof(struct packet));
-
-    struct timeval waiting_room;
-    struct timeval waiting_room2;
-    gettimeofday(&waiting_room, NULL);
-
-    uint32_t start_time = 1000000 * waiting_room.tv_sec + waiting_room.tv_usec;
-    uint32_t curr_time;
-    seq_num++;
-    int newrc = 0;
-
-    while (true) {
-        gettimeofday(&waiting_room, NULL);
-        curr_time = 1000000 * waiting_room.tv_sec + waiting_room.tv_usec;
-        uint32_t time_diff = 2000000 - (curr_time - start_time);
-        if ((curr_time-start_time) > 2000000) {
-            break;
-        }
-        waiting_room2.tv_sec = time_diff/1000000;
-        waiting_room2.tv_usec = time_diff%1000000;
-
-        memset(&leftover_fin, 0, sizeof(struct packet));
-        _log("TIME DIFF", time_diff);
-        setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &waiting_room2, sizeof(waiting_room2));
-        newrc = recvfrom(socket_fd, &leftover_fin, 12, 0, NULL, 0);
-        // err(newrc, "WAITING ROOM while recvfrom socket");
-        _log("RCV LEFTOVER FIN PACKET:");
-        printpacket(&leftover_fin);
-        if (newrc > 0 && leftover_fin.packet_head.flags == FIN) {
-            output_packet(&leftover_fin, cwnd, ssthresh, TYPE_RECV);
-            packet newack;
-            memset(&newack, 0, sizeof(struct packet));
-            newack.packet_head.sequence_number = htonl(seq_num);
-            newack.packet_head.flags = ACK;
-            newack.packet_head.connection_id = htons(cid);
-            newack.packet_head.ack_number = htonl(ntohl(leftover_fin.packet_head.sequence_number)+1);
-
-            int newnumbytes = 0;
-            newnumbytes     = sendto(socket_fd, &newack, 12, 0, p->ai_addr, p->ai_addrlen);
-            err(newnumbytes, "Sending LEFTOVER ACK");
-            _log("LEFTOVER ACK talker: sent ", newnumbytes, " bytes");
-            _log("SENT LEFTOVER ACK PACKET:");
-            printpacket(&newack);
-            output_packet(&newack, cwnd, ssthresh, TYPE_SEND);
-        }
-        else if (newrc > 0) {
-            printpacket(&leftover_fin);
-            output_packet(&leftover_fin, cwnd, ssthresh, TYPE_DROP);
-        }
+    if (failed > 0) {
+        if (OPT_FILES.size() == 1) _exit(failure);
+        _exit((std::to_string(failed) + " of " + std::to_string(OPT_FILES.size()) + " transfers failed").c_str());
     }
 
-    shutdown(socket_fd, 2);
-
     return 0;
 }
@@ -1,5 +1,12 @@
 #include "common.h"
 
+#include <time.h>
+
+#if defined(USE_TSC) && defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
 // #define ACK_MASK 0b00000100
 // #define SYN_MASK 0b00000010
 // #define FIN_MASK 0b00000001
@@ -16,9 +23,57 @@
 // }
 
 
-uint64_t time_now_ms() {
-    using namespace std::chrono;
-    return std::chrono::duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(USE_TSC) && defined(__x86_64__)
+struct tsc_clock {
+    bool ok;
+    uint64_t tsc0;
+    uint64_t ns0;
+    uint64_t mult; // nanoseconds per tick, 32.32 fixed point
+};
+
+static tsc_clock calibrate_tsc() {
+    tsc_clock c = {false, 0, 0, 0};
+
+    // without an invariant TSC the rate changes with frequency scaling
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) return c;
+
+    uint64_t ns_start  = monotonic_ns();
+    uint64_t tsc_start = __rdtsc();
+    uint64_t ns_end    = ns_start;
+    while (ns_end - ns_start < 20000000) ns_end = monotonic_ns();
+    uint64_t tsc_end = __rdtsc();
+    if (tsc_end <= tsc_start) return c;
+
+    c.mult = (uint64_t)(((unsigned __int128)(ns_end - ns_start) << 32) / (tsc_end - tsc_start));
+    c.tsc0 = tsc_end;
+    c.ns0  = ns_end;
+    c.ok   = true;
+    return c;
+}
+#endif
+
+uint64_t time_now_ns() {
+#if defined(USE_TSC) && defined(__x86_64__)
+    static const tsc_clock tsc = calibrate_tsc();
+    if (tsc.ok) return tsc.ns0 + (uint64_t)(((unsigned __int128)(__rdtsc() - tsc.tsc0) * tsc.mult) >> 32);
+#endif
+    return monotonic_ns();
+}
+
+int64_t time_realtime_offset_ns() {
+    static const int64_t offset = [] {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - (int64_t)time_now_ns();
+    }();
+    return offset;
 }
 
 bool err(int rc, const char* message, int exit_code) {
@@ -36,6 +91,10 @@ bool err(int rc, const char* message, int exit_code) {
     return true;
 }
 
+bool send_dropped(int rc) {
+    return rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == EINTR);
+}
+
 void _exit(const char* message, int exit_code) {
     if (message)
         fprintf(stderr, "ERROR: %s.\n", message);
@@ -44,7 +103,7 @@ void _exit(const char* message, int exit_code) {
     exit(exit_code);
 }
 
-void printpacket(struct packet* pack) {
+void printpacket(const struct packet* pack) {
     _log("============================");
     _log("seq ", ntohl(pack->packet_head.sequence_number));
     _log("ack ", ntohl(pack->packet_head.ack_number));
@@ -55,130 +114,180 @@ void printpacket(struct packet* pack) {
 }
 
 
-void output_packet(struct packet* pack, int cwnd, int ss_thresh, int type) {            
+void output_packet(const struct packet* pack, int cwnd, int ss_thresh, int type, std::ostream& os) {            
     if (type == 1) {
         // RECV" <Sequence Number> <Acknowledgement Number> <Connection ID> <CWND> <SS-THRESH> ["ACK"] ["SYN"] ["FIN"]
-        std::cout << "RECV ";
-        std::cout << ntohl(pack->packet_head.sequence_number) << " ";
-        std::cout << ntohl(pack->packet_head.ack_number) << " ";
-        std::cout << ntohs(pack->packet_head.connection_id) << " ";
-        std::cout << cwnd << " ";
-        std::cout << ss_thresh;
-
-        if (pack->packet_head.flags == ACK) std::cout << " ACK";
-        if (pack->packet_head.flags == SYN) std::cout << " SYN";
-        if (pack->packet_head.flags == FIN) std::cout << " FIN";
-        if (pack->packet_head.flags == SYNACK) std::cout << " ACK SYN";
-        if (pack->packet_head.flags == FINACK) std::cout << " ACK FIN";
-        std::cout << std::endl;
+        os << "RECV ";
+        os << ntohl(pack->packet_head.sequence_number) << " ";
+        os << ntohl(pack->packet_head.ack_number) << " ";
+        os << ntohs(pack->packet_head.connection_id) << " ";
+        os << cwnd << " ";
+        os << ss_thresh;
+
+        if (pack->packet_head.flags == ACK) os << " ACK";
+        if (pack->packet_head.flags == SYN) os << " SYN";
+        if (pack->packet_head.flags == FIN) os << " FIN";
+        if (pack->packet_head.flags == SYNACK) os << " ACK SYN";
+        if (pack->packet_head.flags == FINACK) os << " ACK FIN";
+        os << std::endl;
     } else if (type == 2) {
         // "SEND" <Sequence Number> <Acknowledgement Number> <Connection ID> <CWND> <SS-THRESH> ["ACK"] ["SYN"] ["FIN"] ["DUP"]
-        std::cout << "SEND ";
-        std::cout << ntohl(pack->packet_head.sequence_number) << " ";
-        std::cout << ntohl(pack->packet_head.ack_number) << " ";
-        std::cout << ntohs(pack->packet_head.connection_id) << " ";
-        std::cout << cwnd << " ";
-        std::cout << ss_thresh;
-
-        if (pack->packet_head.flags == ACK) std::cout << " ACK";
-        if (pack->packet_head.flags == SYN) std::cout << " SYN";
-        if (pack->packet_head.flags == FIN) std::cout << " FIN";
-        if (pack->packet_head.flags == SYNACK) std::cout << " ACK SYN";
-        if (pack->packet_head.flags == FINACK) std::cout << " ACK FIN";
-        std::cout << std::endl;
+        os << "SEND ";
+        os << ntohl(pack->packet_head.sequence_number) << " ";
+        os << ntohl(pack->packet_head.ack_number) << " ";
+        os << ntohs(pack->packet_head.connection_id) << " ";
+        os << cwnd << " ";
+        os << ss_thresh;
+
+        if (pack->packet_head.flags == ACK) os << " ACK";
+        if (pack->packet_head.flags == SYN) os << " SYN";
+        if (pack->packet_head.flags == FIN) os << " FIN";
+        if (pack->packet_head.flags == SYNACK) os << " ACK SYN";
+        if (pack->packet_head.flags == FINACK) os << " ACK FIN";
+        os << std::endl;
     } else if (type == 3) {
-        std::cout << "SEND ";
-        std::cout << ntohl(pack->packet_head.sequence_number) << " ";
-        std::cout << ntohl(pack->packet_head.ack_number) << " ";
-        std::cout << ntohs(pack->packet_head.connection_id) << " ";
-        std::cout << cwnd << " ";
-        std::cout << ss_thresh;
-        if (pack->packet_head.flags == ACK) std::cout << " ACK";
-        if (pack->packet_head.flags == SYN) std::cout << " SYN";
-        if (pack->packet_head.flags == FIN) std::cout << " FIN";
-        if (pack->packet_head.flags == SYNACK) std::cout << " ACK SYN";
-        if (pack->packet_head.flags == FINACK) std::cout << " ACK FIN";
-        std::cout << " DUP";
-        std::cout << std::endl;
+        os << "SEND ";
+        os << ntohl(pack->packet_head.sequence_number) << " ";
+        os << ntohl(pack->packet_head.ack_number) << " ";
+        os << ntohs(pack->packet_head.connection_id) << " ";
+        os << cwnd << " ";
+        os << ss_thresh;
+        if (pack->packet_head.flags == ACK) os << " ACK";
+        if (pack->packet_head.flags == SYN) os << " SYN";
+        if (pack->packet_head.flags == FIN) os << " FIN";
+        if (pack->packet_head.flags == SYNACK) os << " ACK SYN";
+        if (pack->packet_head.flags == FINACK) os << " ACK FIN";
+        os << " DUP";
+        os << std::endl;
     } else if (type == 4) {
         // "DROP" <Sequence Number> <Acknowledgement Number> <Connection ID> ["ACK"] ["SYN"] ["FIN"]
-        std::cout << "DROP ";
-        std::cout << ntohl(pack->packet_head.sequence_number) << " ";
-        std::cout << ntohl(pack->packet_head.ack_number) << " ";
-        std::cout << ntohs(pack->packet_head.connection_id) << " ";
-
-        if (pack->packet_head.flags == ACK) std::cout << "ACK ";
-        if (pack->packet_head.flags == SYN) std::cout << "SYN ";
-        if (pack->packet_head.flags == FIN) std::cout << "FIN ";
-        if (pack->packet_head.flags == SYNACK) std::cout << "ACK SYN";
-        if (pack->packet_head.flags == FINACK) std::cout << "ACK FIN";
-        std::cout << std::endl;
+        os << "DROP ";
+        os << ntohl(pack->packet_head.sequence_number) << " ";
+        os << ntohl(pack->packet_head.ack_number) << " ";
+        os << ntohs(pack->packet_head.connection_id) << " ";
+
+        if (pack->packet_head.flags == ACK) os << "ACK ";
+        if (pack->packet_head.flags == SYN) os << "SYN ";
+        if (pack->packet_head.flags == FIN) os << "FIN ";
+        if (pack->packet_head.flags == SYNACK) os << "ACK SYN";
+        if (pack->packet_head.flags == FINACK) os << "ACK FIN";
+        os << std::endl;
     }
 }
 
-void output_packet_server(struct packet* pack, int type) {            
+void output_packet_server(const struct packet* pack, int type, std::ostream& os) {            
     if (type == TYPE_RECV) {
         // "RECV" <Sequence Number> <Acknowledgement Number> <Connection ID> ["ACK"] ["SYN"] ["FIN"]
-        std::cout << "RECV ";
-        std::cout << ntohl(pack->packet_head.sequence_number) << " ";
-        std::cout << ntohl(pack->packet_head.ack_number) << " ";
-        std::cout << ntohs(pack->packet_head.connection_id);
-
-        if (pack->packet_head.flags == ACK) std::cout << " ACK";
-        if (pack->packet_head.flags == SYN) std::cout << " SYN";
-        if (pack->packet_head.flags == FIN) std::cout << " FIN";
-        if (pack->packet_head.flags == SYNACK) std::cout << " ACK SYN";
-        if (pack->packet_head.flags == FINACK) std::cout << " ACK FIN";
-        std::cout << std::endl;
+        os << "RECV ";
+        os << ntohl(pack->packet_head.sequence_number) << " ";
+        os << ntohl(pack->packet_head.ack_number) << " ";
+        os << ntohs(pack->packet_head.connection_id);
+
+        if (pack->packet_head.flags == ACK) os << " ACK";
+        if (pack->packet_head.flags == SYN) os << " SYN";
+        if (pack->packet_head.flags == FIN) os << " FIN";
+        if (pack->packet_head.flags == SYNACK) os << " ACK SYN";
+        if (pack->packet_head.flags == FINACK) os << " ACK FIN";
+        os << std::endl;
     } else if (type == TYPE_SEND) {
         // "SEND" <Sequence Number> <Acknowledgement Number> <Connection ID> ["ACK"] ["SYN"] ["FIN"] ["DUP"]
-        std::cout << "SEND ";
-        std::cout << ntohl(pack->packet_head.sequence_number) << " ";
-        std::cout << ntohl(pack->packet_head.ack_number) << " ";
-        std::cout << ntohs(pack->packet_head.connection_id);
-
-        if (pack->packet_head.flags == ACK) std::cout << " ACK";
-        if (pack->packet_head.flags == SYN) std::cout << " SYN";
-        if (pack->packet_head.flags == FIN) std::cout << " FIN";
-        if (pack->packet_head.flags == SYNACK) std::cout << " ACK SYN";
-        if (pack->packet_head.flags == FINACK) std::cout << " ACK FIN";
-        std::cout << std::endl;
+        os << "SEND ";
+        os << ntohl(pack->packet_head.sequence_number) << " ";
+        os << ntohl(pack->packet_head.ack_number) << " ";
+        os << ntohs(pack->packet_head.connection_id);
+
+        if (pack->packet_head.flags == ACK) os << " ACK";
+        if (pack->packet_head.flags == SYN) os << " SYN";
+        if (pack->packet_head.flags == FIN) os << " FIN";
+        if (pack->packet_head.flags == SYNACK) os << " ACK SYN";
+        if (pack->packet_head.flags == FINACK) os << " ACK FIN";
+        os << std::endl;
     } else if (type == TYPE_DUP) {
         // "SEND" <Sequence Number> <Acknowledgement Number> <Connection ID> ["ACK"] ["SYN"] ["FIN"] ["DUP"]
-        std::cout << "SEND ";
-        std::cout << ntohl(pack->packet_head.sequence_number) << " ";
-        std::cout << ntohl(pack->packet_head.ack_number) << " ";
-        std::cout << ntohs(pack->packet_head.connection_id);
-
-        if (pack->packet_head.flags == ACK) std::cout << " ACK";
-        if (pack->packet_head.flags == SYN) std::cout << " SYN";
-        if (pack->packet_head.flags == FIN) std::cout << " FIN";
-        if (pack->packet_head.flags == SYNACK) std::cout << " ACK SYN";
-        if (pack->packet_head.flags == FINACK) std::cout << " ACK FIN";
-        std::cout << " DUP";
-        std::cout << std::endl;
+        os << "SEND ";
+        os << ntohl(pack->packet_head.sequence_number) << " ";
+        os << ntohl(pack->packet_head.ack_number) << " ";
+        os << ntohs(pack->packet_head.connection_id);
+
+        if (pack->packet_head.flags == ACK) os << " ACK";
+        if (pack->packet_head.flags == SYN) os << " SYN";
+        if (pack->packet_head.flags == FIN) os << " FIN";
+        if (pack->packet_head.flags == SYNACK) os << " ACK SYN";
+        if (pack->packet_head.flags == FINACK) os << " ACK FIN";
+        os << " DUP";
+        os << std::endl;
     } else if (type == TYPE_DROP) {
         // "DROP" <Sequence Number> <Acknowledgement Number> <Connection ID> ["ACK"] ["SYN"] ["FIN"]
-        std::cout << "DROP ";
-        std::cout << ntohl(pack->packet_head.sequence_number) << " ";
-        std::cout << ntohl(pack->packet_head.ack_number) << " ";
-        std::cout << ntohs(pack->packet_head.connection_id);
-
-        if (pack->packet_head.flags == ACK) std::cout << " ACK ";
-        if (pack->packet_head.flags == SYN) std::cout << " SYN ";
-        if (pack->packet_head.flags == FIN) std::cout << " FIN ";
-        if (pack->packet_head.flags == SYNACK) std::cout << " ACK SYN";
-        if (pack->packet_head.flags == FINACK) std::cout << " ACK FIN";
-        std::cout << std::endl;
+        os << "DROP ";
+        os << ntohl(pack->packet_head.sequence_number) << " ";
+        os << ntohl(pack->packet_head.ack_number) << " ";
+        os << ntohs(pack->packet_head.connection_id);
+
+        if (pack->packet_head.flags == ACK) os << " ACK ";
+        if (pack->packet_head.flags == SYN) os << " SYN ";
+        if (pack->packet_head.flags == FIN) os << " FIN ";
+        if (pack->packet_head.flags == SYNACK) os << " ACK SYN";
+        if (pack->packet_head.flags == FINACK) os << " ACK FIN";
+        os << std::endl;
     }
 }
 
+PacketPool::PacketPool(size_t initial) {
+    slots.resize(initial);
+    free_list.reserve(initial);
+    for (size_t i = initial; i > 0; i--) free_list.push_back(i - 1);
+}
+
+uint32_t PacketPool::acquire() {
+    if (free_list.empty()) {
+        slots.emplace_back();
+        return slots.size() - 1;
+    }
+    uint32_t handle = free_list.back();
+    free_list.pop_back();
+    return handle;
+}
+
+void PacketPool::release(uint32_t handle) {
+    free_list.push_back(handle);
+}
+
 Store::Store() {
     seq = 0;
     ack = 0;
     last_time = 0;
     writefd = 0;
     state = 0;
+    memset(&peer, 0, sizeof(peer));
+    transfer = 0;
+    file_pos = 0;
+    crc = false;
+    digest = 0;
+    fin_ext = 0;
+    compress = false;
+    unpack_failed = false;
+    file_id = 0;
+    token = 0;
+    index = 0;
+    committed = 0;
+    journaled = 0;
+    basis = NULL;
+    basis_id = 0;
+    delta_failed = false;
+    delta_ended = false;
+    rebuilt = 0;
+    syn_nonce = 0;
+    syn_seq = 0;
+    synack_ext = 0;
+    synack_ack = 0;
+    stream_pos = 0;
+    fec        = false;
+    fin_seq    = 0;
+    syncing    = 0;
+    unpaced    = 0;
+    pace_at    = 0;
+    paced_drop = 0;
+    acked      = seq;
 }
 
 Store::Store(uint32_t sq, uint32_t ak, uint64_t lte, FILE * wfd, int s) {
@@ -187,4 +296,34 @@ Store::Store(uint32_t sq, uint32_t ak, uint64_t lte, FILE * wfd, int s) {
     last_time = lte;
     writefd = wfd;
     state = s;
+    memset(&peer, 0, sizeof(peer));
+    transfer = 0;
+    file_pos = 0;
+    crc = false;
+    digest = 0;
+    fin_ext = 0;
+    compress = false;
+    unpack_failed = false;
+    file_id = 0;
+    token = 0;
+    index = 0;
+    committed = 0;
+    journaled = 0;
+    basis = NULL;
+    basis_id = 0;
+    delta_failed = false;
+    delta_ended = false;
+    rebuilt = 0;
+    syn_nonce = 0;
+    syn_seq = 0;
+    synack_ext = 0;
+    synack_ack = 0;
+    stream_pos = 0;
+    fec        = false;
+    fin_seq    = 0;
+    syncing    = 0;
+    unpaced    = 0;
+    pace_at    = 0;
+    paced_drop = 0;
+    acked      = seq;
 }
\ No newline at end of file
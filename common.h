@@ -1,6 +1,7 @@
 #ifndef COMMON
 #define COMMON
 #include <arpa/inet.h>
+#include <endian.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -11,7 +12,14 @@
 #include <cstring>
 
 #include <chrono>
+#include <deque>
+#include <map>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "checksum.h"
 
 #ifdef DEBUG
 #define OPT_LOG 1
@@ -27,7 +35,7 @@
   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
   |                     Acknowledgment Number                     |
   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-  |         Connection ID         |         Not Used        |A|S|F|
+  |         Connection ID         |  Extensions   |Not Used |A|S|F|
   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 */
 
@@ -40,6 +48,13 @@
 #define SPEC_MAX_CWND 51200
 #define SPEC_RWND 51200
 #define SPEC_INIT_SS_THRESH 10000
+#define SPEC_IDLE_TIMEOUT_MS 10000
+#define SPEC_TIME_WAIT_MS 2000
+
+// timers run on the microsecond clock below
+#define SPEC_RTO_US ((uint64_t)SPEC_RTO_MS * 1000)
+#define SPEC_IDLE_TIMEOUT_US ((uint64_t)SPEC_IDLE_TIMEOUT_MS * 1000)
+#define SPEC_TIME_WAIT_US ((uint64_t)SPEC_TIME_WAIT_MS * 1000)
 
 #define SYN 2 // ...010
 #define ACK 4 // ...100
@@ -52,6 +67,17 @@
 #define TYPE_DUP 3
 #define TYPE_DROP 4
 
+// bits of the header's otherwise unused byte, for optional features
+#define EXT_CRC 0x01        // payload ends in CRC32C of the datagram; on SYN/SYNACK, asked for/agreed to
+#define EXT_DIGEST 0x02     // FIN: payload is CRC32C of all data sent; FINACK: it matched
+#define EXT_DIGEST_BAD 0x04 // FINACK: it didn't match
+#define EXT_COMPRESS 0x08   // SYN/SYNACK: the data is sent as compress.h frames, asked for/agreed to
+#define EXT_RESUME 0x10     // SYN: payload starts with a resume token; SYNACK: payload is the resume point
+#define EXT_DELTA 0x20      // SYN: delta against a basis file; SYNACK: agreed; otherwise a block sums request/reply
+#define EXT_EARLY 0x40      // SYN: the first bytes of the data come with it
+#define EXT_FEC 0x80        // SYN/SYNACK: parity segments asked for/agreed to; otherwise a parity segment (fec.h) or its ACK
+#define CRC_TRAILER_SIZE 4
+
 #define STATE_ACTIVE 1
 #define STATE_FIN 2
 
@@ -59,12 +85,12 @@
 #define PACKET_FROM_BUFFER 1
 #define PACKET_LAST_FROM_BUFFER 2
 
-#pragma pack(1)
+#pragma pack(push, 1)
 struct header {
     uint32_t sequence_number;
     uint32_t ack_number;
     uint16_t connection_id;
-    uint8_t empty;
+    uint8_t empty; // EXT_ bits
     uint8_t flags;
 };
 typedef struct header header;
@@ -74,14 +100,190 @@ struct packet {
     char payload[SPEC_MAX_PAYLOAD_SIZE];
 };
 typedef struct packet packet;
+#pragma pack(pop)
+
+// header fields in host order
+struct fields {
+    uint32_t seq;
+    uint32_t ack;
+    uint16_t cid;
+    uint8_t flags;
+    uint8_t ext;
+};
+typedef struct fields fields;
+
+// write all 12 header bytes, leaving the payload alone
+inline void encode_header(header* h, uint32_t seq, uint32_t ack, uint16_t cid, uint8_t flags, uint8_t ext = 0) {
+    h->sequence_number = htonl(seq);
+    h->ack_number      = htonl(ack);
+    h->connection_id   = htons(cid);
+    h->empty           = ext;
+    h->flags           = flags;
+}
+
+inline fields decode_header(const header* h) {
+    return {ntohl(h->sequence_number), ntohl(h->ack_number), ntohs(h->connection_id), h->flags, h->empty};
+}
+
+// append the CRC32C of the first len bytes of the datagram, returns the new length
+inline int seal_crc(packet* pack, int len) {
+    uint32_t sum = htonl(crc32c(0, pack, len));
+    memcpy((char*)pack + len, &sum, CRC_TRAILER_SIZE);
+    return len + CRC_TRAILER_SIZE;
+}
+
+// whether a datagram of len bytes ends in a matching CRC32C trailer
+inline bool check_crc(const packet* pack, int len) {
+    if (len < 12 + CRC_TRAILER_SIZE) return false;
+    uint32_t sum;
+    memcpy(&sum, (const char*)pack + len - CRC_TRAILER_SIZE, CRC_TRAILER_SIZE);
+    return ntohl(sum) == crc32c(0, pack, len - CRC_TRAILER_SIZE);
+}
+
+// A SYN's payload is the length of its early data if EXT_EARLY is set, a
+// resume token if EXT_RESUME is, the basis file id if EXT_DELTA is, then
+// optionally a stripe record, and last the early data. A SYNACK's is the
+// resume point if EXT_RESUME is set, then the delta info if EXT_DELTA is:
+// basis size, block size and block count. All big endian.
+//
+// The connection id of a SYN is a nonce the client picks, so the server can
+// tell a SYN sent again from a new one from the same address.
+#define EARLY_LENGTH_SIZE 2
+#define RESUME_TOKEN_SIZE 8
+#define DELTA_BASIS_SIZE 2
+#define DELTA_INFO_SIZE 16
+
+// Once a delta is agreed, the client asks for the block sums with datagrams
+// flagged EXT_DELTA whose payload is a chunk number, and the server answers
+// each with the chunk number and that chunk's weak and strong sums.
+#define DELTA_SUM_SIZE 8
+#define DELTA_SUMS_PER_REPLY ((SPEC_MAX_PAYLOAD_SIZE - 4) / DELTA_SUM_SIZE)
+
+inline int encode_u32(char* buf, uint32_t v) {
+    v = htonl(v);
+    memcpy(buf, &v, 4);
+    return 4;
+}
+
+inline uint32_t decode_u32(const char* buf) {
+    uint32_t v;
+    memcpy(&v, buf, 4);
+    return ntohl(v);
+}
+
+inline int encode_u64(char* buf, uint64_t v) {
+    v = htobe64(v);
+    memcpy(buf, &v, 8);
+    return 8;
+}
+
+inline uint64_t decode_u64(const char* buf) {
+    uint64_t v;
+    memcpy(&v, buf, 8);
+    return be64toh(v);
+}
+
+// A SYN may carry this to open one stripe of an upload split across several
+// connections. The server writes every stripe with the same
+// transfer id into one output file, each starting at its own offset.
+struct stripe {
+    uint32_t transfer_id; // picked by the client, never 0
+    uint64_t offset;      // where the stripe starts in the file
+    uint16_t index;
+    uint16_t count;       // stripes in the transfer
+};
+typedef struct stripe stripe;
+
+#define STRIPE_INFO_SIZE 16
+
+inline int encode_stripe(char* buf, const stripe& s) {
+    uint32_t id     = htonl(s.transfer_id);
+    uint64_t offset = htobe64(s.offset);
+    uint16_t index  = htons(s.index);
+    uint16_t count  = htons(s.count);
+    memcpy(buf, &id, 4);
+    memcpy(buf + 4, &offset, 8);
+    memcpy(buf + 12, &index, 2);
+    memcpy(buf + 14, &count, 2);
+    return STRIPE_INFO_SIZE;
+}
 
-void printpacket(struct packet*);
+// false if the len bytes at buf aren't a valid stripe
+inline bool decode_stripe(const char* buf, int len, stripe* s) {
+    if (len < STRIPE_INFO_SIZE) return false;
+    uint32_t id;
+    uint64_t offset;
+    uint16_t index, count;
+    memcpy(&id, buf, 4);
+    memcpy(&offset, buf + 4, 8);
+    memcpy(&index, buf + 12, 2);
+    memcpy(&count, buf + 14, 2);
+    s->transfer_id = ntohl(id);
+    s->offset      = be64toh(offset);
+    s->index       = ntohs(index);
+    s->count       = ntohs(count);
+    return s->transfer_id != 0 && s->count > 0 && s->index < s->count;
+}
+
+// Reusable packet buffers handed out by index. Buffers are never zeroed or
+// moved, so a packet received into one can be kept without copying it.
+class PacketPool {
+    public:
+        PacketPool(size_t initial = 64);
+        // grows the pool when every buffer is in use
+        uint32_t acquire();
+        void release(uint32_t handle);
+        packet* get(uint32_t handle) { return &slots[handle].pack; }
+        int& len(uint32_t handle) { return slots[handle].len; }
+        size_t in_use() const { return slots.size() - free_list.size(); }
 
-void output_packet(struct packet*, int cwnd, int ss_thresh, int type);
+    private:
+        struct slot {
+            packet pack;
+            int len;
+        };
+        std::deque<slot> slots; // deque so growing never moves a buffer
+        std::vector<uint32_t> free_list;
+};
 
-void output_packet_server(struct packet*, int type);
+// address of the remote end of a datagram, as filled in by recvfrom
+struct Peer {
+    struct sockaddr_storage addr;
+    socklen_t len;
+};
+typedef struct Peer Peer;
 
-uint64_t time_now_ms();
+inline bool same_peer(const Peer& a, const Peer& b) {
+    return a.len == b.len && memcmp(&a.addr, &b.addr, a.len) == 0;
+}
+
+// signed distance from b to a in sequence space, sequence numbers wrap at SPEC_MAX_SEQ
+inline int32_t seq_diff(uint32_t a, uint32_t b) {
+    const int32_t space = SPEC_MAX_SEQ + 1;
+    int32_t d = ((int32_t)(a % space) - (int32_t)(b % space)) % space;
+    if (d < 0) d += space;
+    if (d >= space / 2) d -= space;
+    return d;
+}
+
+void printpacket(const struct packet*);
+
+void output_packet(const struct packet*, int cwnd, int ss_thresh, int type, std::ostream& os = std::cout);
+
+void output_packet_server(const struct packet*, int type, std::ostream& os = std::cout);
+
+// Monotonic clock, unaffected by wall clock jumps. Built with USE_TSC
+// ("make TSC=1") on a CPU with an invariant TSC it reads the TSC, calibrated
+// against CLOCK_MONOTONIC at first use, instead of calling clock_gettime.
+// Event loops read it once per batch and pass that time down.
+uint64_t time_now_ns();
+
+inline uint64_t time_now_us() {
+    return time_now_ns() / 1000;
+}
+
+// add to a time_now_ns() reading to get nanoseconds since the epoch
+int64_t time_realtime_offset_ns();
 
 // set header flags given ACK, SYN, FIN
 // uint8_t set_flags(uint8_t& flag, bool ACK, bool SYN, bool FIN);
@@ -92,6 +294,11 @@ bool err(int rc, const char* message, int exit_code = -1);
 // exit with error message and optional exit code
 void _exit(const char* message, int exit_code = 1);
 
+// true if a send on a non-blocking socket failed only for want of buffer
+// space; the datagram is then as good as lost on the way, and whatever the
+// protocol does about a loss covers it
+bool send_dropped(int rc);
+
 // log if built with "make debug" instead of plain "make server" or "make client"
 template <typename... Args>
 inline void _log(Args&&... args) {
@@ -103,6 +310,8 @@ inline void _log(Args&&... args) {
     return;
 }
 
+struct BlockSums;
+
 class Store {
     public:
         Store();    
@@ -112,6 +321,43 @@ class Store {
         uint64_t last_time;
         FILE * writefd;
         int state;
+        Peer peer; // where replies for this connection go
+        uint32_t transfer;  // stripe's transfer id, 0 if the connection has the file to itself
+        uint64_t file_pos;  // where the next in-order byte goes in a shared file
+        bool crc;           // datagrams carry CRC trailers and the FIN a digest
+        uint32_t digest;    // CRC32C of everything written so far
+        uint8_t fin_ext;    // what the FINACK says about the digest
+        bool compress;      // the data comes as compressed frames
+        std::string frames; // compressed bytes short of a whole frame
+        bool unpack_failed; // a frame was bad, nothing more gets written
+        uint16_t file_id;   // the N of the N.file being written
+        uint64_t token;     // resume token, 0 if the upload can't be resumed
+        uint16_t index;     // stripe index, 0 if not striped
+        uint64_t committed; // bytes of the upload (or stripe) in the file, including before a resume
+        uint64_t journaled; // committed as of the last journal record
+        FILE * basis;       // the file a delta upload copies blocks from, NULL if not a delta
+        uint16_t basis_id;  // and its N
+        std::shared_ptr<BlockSums> sums; // of the basis, for the client to fetch
+        std::string ops;    // delta bytes short of a whole op
+        bool delta_failed;  // an op was bad, nothing more gets written
+        bool delta_ended;   // the end op came and its CRC32C matched
+        uint32_t rebuilt;   // CRC32C of the file rebuilt so far
+        uint16_t syn_nonce; // the SYN that opened the connection,
+        uint32_t syn_seq;   // to know it if it comes again
+        uint8_t synack_ext; // and what the SYNACK said, to say it again
+        uint32_t synack_ack;
+        std::string synack;
+        uint64_t stream_pos;    // bytes taken in order, whatever they turned into
+        bool fec;               // parity segments come with the data
+        std::vector<char> history; // the last FEC_HISTORY bytes taken, by stream_pos
+        std::map<uint64_t, std::string> parities; // group start -> parity payload, for gaps
+        uint32_t fin_seq;       // the FIN's seq, for a FINACK held back
+        uint64_t syncing;       // until this group commit is done, 0 if none
+        uint64_t unpaced;       // bytes taken, or written if more, not yet charged to the ingest budget
+        uint64_t pace_at;       // when the budget has paid for everything charged so far
+        uint64_t paced_drop;    // when a datagram was last dropped for running over the budget
+        uint32_t acked;         // last in-order seq an ACK went out for
+        std::deque<std::pair<uint64_t, uint32_t>> paced; // ACKs held back, (due, seq)
 };
 
 #endif
\ No newline at end of file
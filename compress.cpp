@@ -0,0 +1,43 @@
+#include "compress.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <zlib.h>
+
+int pack_block(const char* raw, int len, char* out, bool deflate) {
+    uint32_t raw_len = htonl(len);
+    memcpy(out, &raw_len, 4);
+
+    // leaving zlib no more room than the most we'd accept makes it give up
+    // as soon as the block turns out not to shrink enough
+    uLongf stored = len - len / COMPRESS_MIN_SAVING;
+    if (!deflate || stored == 0 ||
+        compress2((Bytef*)out + COMPRESS_FRAME_SIZE, &stored, (const Bytef*)raw, len, COMPRESS_LEVEL) != Z_OK) {
+        memcpy(out + COMPRESS_FRAME_SIZE, raw, len);
+        stored = len;
+    }
+
+    uint32_t stored_len = htonl(stored);
+    memcpy(out + 4, &stored_len, 4);
+    return COMPRESS_FRAME_SIZE + stored;
+}
+
+bool unpack_header(const char* frame, uint32_t* raw_len, uint32_t* stored_len) {
+    memcpy(raw_len, frame, 4);
+    memcpy(stored_len, frame + 4, 4);
+    *raw_len    = ntohl(*raw_len);
+    *stored_len = ntohl(*stored_len);
+    return *raw_len > 0 && *raw_len <= COMPRESS_BLOCK_SIZE && *stored_len > 0 && *stored_len <= *raw_len;
+}
+
+int unpack_block(const char* frame, char* out) {
+    uint32_t raw_len, stored_len;
+    if (!unpack_header(frame, &raw_len, &stored_len)) return -1;
+    if (stored_len == raw_len) {
+        memcpy(out, frame + COMPRESS_FRAME_SIZE, raw_len);
+        return raw_len;
+    }
+    uLongf n = raw_len;
+    if (uncompress((Bytef*)out, &n, (const Bytef*)frame + COMPRESS_FRAME_SIZE, stored_len) != Z_OK) return -1;
+    return n == raw_len ? (int)n : -1;
+}
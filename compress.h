@@ -0,0 +1,29 @@
+#ifndef COMPRESS
+#define COMPRESS
+#include <stddef.h>
+#include <stdint.h>
+
+// Block framing for compressed uploads. The client cuts the file into blocks
+// and sends each as a frame: raw length and stored length, both 32 bit big
+// endian, then the stored bytes. A block stored shorter than it is raw was
+// deflated with zlib; one stored at its raw length is sent as is, because
+// compressing didn't save enough to be worth it.
+
+#define COMPRESS_BLOCK_SIZE 65536
+#define COMPRESS_FRAME_SIZE 8
+#define COMPRESS_MAX_FRAME (COMPRESS_FRAME_SIZE + COMPRESS_BLOCK_SIZE)
+#define COMPRESS_LEVEL 1       // zlib's fastest
+#define COMPRESS_MIN_SAVING 8  // a block has to shrink by 1/8 to go deflated
+
+// frame len raw bytes into out, deflating them if deflate is set and it saves
+// enough, returns the frame length
+int pack_block(const char* raw, int len, char* out, bool deflate);
+
+// read the lengths at the start of a frame, false if they can't be right
+bool unpack_header(const char* frame, uint32_t* raw_len, uint32_t* stored_len);
+
+// turn a whole frame back into its raw bytes, returns how many or -1 if the
+// stored bytes don't inflate to the raw length
+int unpack_block(const char* frame, char* out);
+
+#endif
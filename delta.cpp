@@ -0,0 +1,85 @@
+#include "delta.h"
+
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "common.h"
+
+uint32_t delta_block_size(uint64_t size) {
+    uint64_t block = (uint64_t)sqrt((double)size);
+    block          = (block + 63) & ~(uint64_t)63;
+    return std::clamp(block, (uint64_t)DELTA_MIN_BLOCK, (uint64_t)DELTA_MAX_BLOCK);
+}
+
+// sum blocks [first, last), reading a batch of them at a time
+static bool sum_blocks(int fd, uint32_t block_size, uint64_t first, uint64_t last, BlockSums* sums) {
+    uint64_t batch = std::max<uint64_t>(1, (1 << 20) / block_size);
+    std::vector<char> buf(batch * block_size);
+    for (uint64_t i = first; i < last; i += batch) {
+        uint64_t n   = std::min(batch, last - i);
+        size_t want  = n * block_size;
+        size_t got   = 0;
+        while (got < want) {
+            ssize_t rc = pread(fd, buf.data() + got, want - got, i * block_size + got);
+            if (rc < 0 && errno == EINTR) continue;
+            if (rc <= 0) return false;
+            got += rc;
+        }
+        for (uint64_t k = 0; k < n; k++) {
+            const char* block = buf.data() + k * block_size;
+            uint32_t a, b;
+            weak_sum(block, block_size, &a, &b);
+            sums->weak[i + k]   = weak_sum_value(a, b);
+            sums->strong[i + k] = crc32c(0, block, block_size);
+        }
+    }
+    return true;
+}
+
+bool compute_block_sums(int fd, uint64_t size, uint32_t block_size, BlockSums* sums, int threads) {
+    uint64_t blocks  = size / block_size;
+    sums->basis_size = size;
+    sums->block_size = block_size;
+    sums->weak.assign(blocks, 0);
+    sums->strong.assign(blocks, 0);
+
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<uint64_t>({(uint64_t)threads, DELTA_MAX_THREADS, blocks / DELTA_THREAD_BLOCKS + 1});
+
+    // each thread takes its own run of blocks and writes only their sums
+    std::vector<std::thread> workers;
+    std::vector<char> ok(threads, 1);
+    uint64_t per = (blocks + threads - 1) / threads;
+    for (int t = 1; t < threads; t++) {
+        uint64_t first = std::min(blocks, t * per);
+        uint64_t last  = std::min(blocks, first + per);
+        workers.emplace_back([=, &ok] { ok[t] = sum_blocks(fd, block_size, first, last, sums); });
+    }
+    ok[0] = sum_blocks(fd, block_size, 0, std::min(blocks, per), sums);
+    for (auto& w : workers) w.join();
+    return std::all_of(ok.begin(), ok.end(), [](char c) { return c != 0; });
+}
+
+int put_copy(char* out, uint32_t first, uint32_t count) {
+    out[0] = DELTA_OP_COPY;
+    encode_u32(out + 1, first);
+    encode_u32(out + 5, count);
+    return DELTA_COPY_SIZE;
+}
+
+int put_literal(char* out, const char* data, uint32_t len) {
+    out[0] = DELTA_OP_LITERAL;
+    encode_u32(out + 1, len);
+    memcpy(out + DELTA_LITERAL_HEAD, data, len);
+    return DELTA_LITERAL_HEAD + len;
+}
+
+int put_end(char* out, uint32_t crc) {
+    out[0] = DELTA_OP_END;
+    encode_u32(out + 1, crc);
+    return DELTA_END_SIZE;
+}
@@ -0,0 +1,52 @@
+#ifndef DELTA
+#define DELTA
+#include <stdint.h>
+
+#include <vector>
+
+// Delta uploads, after rsync. The server cuts an existing file, the basis,
+// into blocks and hands the client a weak rolling sum and a CRC32C of each.
+// The client slides a block-sized window over its new file a byte at a time,
+// and wherever the window matches a basis block it sends a reference to the
+// block instead of its bytes. The upload is then a stream of ops:
+//
+//     'C' <first> <count>   copy count basis blocks, starting at block first
+//     'L' <length> <bytes>  these bytes as they are
+//     'E' <crc32c>          end of the file, and the CRC32C of all of it
+//
+// with every field 32 bit big endian. Only whole blocks of the basis are
+// summed; a short last block is never matched.
+
+#define DELTA_OP_COPY 'C'
+#define DELTA_OP_LITERAL 'L'
+#define DELTA_OP_END 'E'
+#define DELTA_COPY_SIZE 9
+#define DELTA_LITERAL_HEAD 5
+#define DELTA_END_SIZE 5
+#define DELTA_MAX_LITERAL 16384
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK 65536
+#define DELTA_MAX_THREADS 8
+#define DELTA_THREAD_BLOCKS 256 // fewest blocks worth another thread
+
+struct BlockSums {
+    uint64_t basis_size = 0;
+    uint32_t block_size = 0; // 0 for no delta, the file goes as it is
+    std::vector<uint32_t> weak;   // weak_sum_value() of each block
+    std::vector<uint32_t> strong; // CRC32C of each block
+};
+
+// about the square root of the basis size, like rsync, so neither the sums
+// nor the literals around a change get large
+uint32_t delta_block_size(uint64_t size);
+
+// sum every whole block of the first size bytes of fd, split over up to
+// threads threads (0 for one per core); false if fd can't be read
+bool compute_block_sums(int fd, uint64_t size, uint32_t block_size, BlockSums* sums, int threads = 0);
+
+// write one op to out, returns its length
+int put_copy(char* out, uint32_t first, uint32_t count);
+int put_literal(char* out, const char* data, uint32_t len);
+int put_end(char* out, uint32_t crc);
+
+#endif
@@ -0,0 +1,73 @@
+#include "durable.h"
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "common.h"
+
+GroupCommit::GroupCommit(int dir) : dir_fd(dir) {
+    batches  = 0;
+    files    = 0;
+    stopping = false;
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    err(event_fd, "Creating group commit event");
+    thread = std::thread(&GroupCommit::worker, this);
+}
+
+GroupCommit::~GroupCommit() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+    close(event_fd);
+}
+
+void GroupCommit::submit(int fd, uint64_t tag) {
+    int copy = dup(fd);
+    err(copy, "Duplicating file for group commit");
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pending.push_back({copy, tag});
+    }
+    wake.notify_one();
+}
+
+std::vector<Synced> GroupCommit::take_done() {
+    uint64_t count;
+    if (read(event_fd, &count, sizeof(count)) < 0) count = 0;
+    std::vector<Synced> out;
+    std::lock_guard<std::mutex> guard(lock);
+    out.swap(done);
+    return out;
+}
+
+void GroupCommit::worker() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        wake.wait(guard, [this] { return stopping || !pending.empty(); });
+        // files still waiting on a shutdown are synced all the same
+        if (pending.empty()) return;
+        std::vector<Pending> batch;
+        batch.swap(pending);
+        guard.unlock();
+
+        // start write-back on every file before waiting on any of them
+        for (auto& p : batch) sync_file_range(p.fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        std::vector<Synced> synced;
+        for (auto& p : batch) {
+            synced.push_back({p.tag, fdatasync(p.fd) == 0});
+            close(p.fd);
+        }
+        bool dir_ok = dir_fd < 0 || fsync(dir_fd) == 0;
+
+        guard.lock();
+        for (auto& s : synced) done.push_back({s.tag, s.ok && dir_ok});
+        batches++;
+        files += batch.size();
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) < 0) _log("Group commit: eventfd write failed");
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef DURABLE
+#define DURABLE
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Group commit for finished uploads. The server hands over each file whose
+// FIN has come in, and holds back the FINACK until the file is on disk. One
+// thread does the syncing. Files handed over while it is busy wait and then go
+// together as the next batch: write-back is started on all of them with
+// sync_file_range before fdatasync waits on any, and the output directory
+// is synced once per batch so new names last too. Under many uploads
+// finishing together a batch costs about one sync, not one per file.
+//
+// Each file is dup()ed when it is handed over, so the server can close its
+// own handle at once. Finished tags come back through take_done(), and fd()
+// becomes readable when there are some.
+
+struct Synced {
+    uint64_t tag;
+    bool ok; // fdatasync succeeded
+};
+
+class GroupCommit {
+    public:
+        // dir_fd is the output directory, synced with each batch; -1 for none
+        GroupCommit(int dir_fd = -1);
+        ~GroupCommit();
+
+        // make fd's data durable, then report tag as done
+        void submit(int fd, uint64_t tag);
+        // everything made durable since the last call
+        std::vector<Synced> take_done();
+        // readable while take_done() has something to return
+        int fd() const { return event_fd; }
+
+        std::atomic<uint64_t> batches;
+        std::atomic<uint64_t> files; // synced, over all batches
+
+    private:
+        struct Pending {
+            int fd;
+            uint64_t tag;
+        };
+        void worker();
+
+        int dir_fd;
+        int event_fd;
+        std::vector<Pending> pending;
+        std::vector<Synced> done;
+        bool stopping;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::thread thread;
+};
+
+#endif
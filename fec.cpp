@@ -0,0 +1,93 @@
+#include "fec.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// ========================================================================== //
+// XOR
+// ========================================================================== //
+
+void xor_bytes_portable(char* dst, const char* src, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++) dst[i] ^= src[i];
+}
+
+#if defined(__x86_64__)
+bool xor_bytes_avx2_available() {
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+}
+
+// 128 bytes a round in four registers, then 32 at a time
+__attribute__((target("avx2")))
+void xor_bytes_avx2(char* dst, const char* src, size_t len) {
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m256i d0 = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i d1 = _mm256_loadu_si256((const __m256i*)(dst + i + 32));
+        __m256i d2 = _mm256_loadu_si256((const __m256i*)(dst + i + 64));
+        __m256i d3 = _mm256_loadu_si256((const __m256i*)(dst + i + 96));
+        d0         = _mm256_xor_si256(d0, _mm256_loadu_si256((const __m256i*)(src + i)));
+        d1         = _mm256_xor_si256(d1, _mm256_loadu_si256((const __m256i*)(src + i + 32)));
+        d2         = _mm256_xor_si256(d2, _mm256_loadu_si256((const __m256i*)(src + i + 64)));
+        d3         = _mm256_xor_si256(d3, _mm256_loadu_si256((const __m256i*)(src + i + 96)));
+        _mm256_storeu_si256((__m256i*)(dst + i), d0);
+        _mm256_storeu_si256((__m256i*)(dst + i + 32), d1);
+        _mm256_storeu_si256((__m256i*)(dst + i + 64), d2);
+        _mm256_storeu_si256((__m256i*)(dst + i + 96), d3);
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        d         = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i*)(src + i)));
+        _mm256_storeu_si256((__m256i*)(dst + i), d);
+    }
+    xor_bytes_portable(dst + i, src + i, len - i);
+}
+#else
+bool xor_bytes_avx2_available() {
+    return false;
+}
+
+void xor_bytes_avx2(char* dst, const char* src, size_t len) {
+    xor_bytes_portable(dst, src, len);
+}
+#endif
+
+void xor_bytes(char* dst, const char* src, size_t len) {
+    static void (*const impl)(char*, const char*, size_t) =
+        xor_bytes_avx2_available() ? xor_bytes_avx2 : xor_bytes_portable;
+    impl(dst, src, len);
+}
+
+// ========================================================================== //
+// PARITY
+// ========================================================================== //
+
+void fec_fold(char* parity, int width, uint64_t at, const char* data, int len) {
+    int column = at % width;
+    while (len > 0) {
+        int n = std::min(len, width - column);
+        xor_bytes(parity + column, data, n);
+        data += n;
+        len -= n;
+        column = 0;
+    }
+}
+
+int fec_group_size(double loss) {
+    if (loss * FEC_LOSSES_PER_GROUP * FEC_MAX_GROUP <= 1) return FEC_MAX_GROUP;
+    int group = 1 / (loss * FEC_LOSSES_PER_GROUP);
+    return std::max(group, FEC_MIN_GROUP);
+}
@@ -0,0 +1,44 @@
+#ifndef FEC
+#define FEC
+#include <stddef.h>
+#include <stdint.h>
+
+// Forward error correction. The client sends a parity datagram after each
+// group of data segments, and the server rebuilds a lost segment from it
+// instead of waiting for it to be sent again.
+//
+// Parity is XOR over the group's bytes laid out in rows of width bytes, the
+// width being the most one segment holds: byte i of the group goes into byte
+// i % width of the parity. The bytes of one missing run no longer than width
+// fall in different columns, so XOR of the parity with every byte of the
+// group the server has leaves exactly the bytes missing, however the group
+// was cut into segments. Two losses in a group can't be rebuilt; those go
+// back to being resent.
+//
+// A parity datagram has EXT_FEC set, the sequence number of the group's first
+// byte, and a payload of the group length, 16 bit big endian, then the parity.
+
+#define FEC_HEAD_SIZE 2
+#define FEC_MIN_GROUP 2        // data segments per parity segment
+#define FEC_MAX_GROUP 16
+#define FEC_START_GROUP 8
+#define FEC_LOSS_GAIN 8        // a loss sample moves the estimate by 1/8 of the difference
+#define FEC_LOSSES_PER_GROUP 3 // groups are sized for about 1 loss in 3 groups
+#define FEC_HISTORY 16384      // in-order bytes the server keeps, a power of 2 over the largest group
+#define FEC_MAX_PARITIES 32    // parities a connection holds on to for gaps
+
+// dst ^= src, using AVX2 when the CPU has it
+void xor_bytes(char* dst, const char* src, size_t len);
+
+// the two implementations behind xor_bytes(), for bench.cpp
+void xor_bytes_portable(char* dst, const char* src, size_t len);
+bool xor_bytes_avx2_available();
+void xor_bytes_avx2(char* dst, const char* src, size_t len);
+
+// fold len bytes at offset at of a group into its parity of width bytes
+void fec_fold(char* parity, int width, uint64_t at, const char* data, int len);
+
+// data segments per parity for a loss rate between 0 and 1
+int fec_group_size(double loss);
+
+#endif
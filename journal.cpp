@@ -0,0 +1,97 @@
+#include "journal.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "common.h"
+
+Journal::Journal(const std::string& p) : path(p) {
+    log      = NULL;
+    appended = 0;
+    if (path.empty()) return;
+    load();
+    compact();
+}
+
+Journal::~Journal() {
+    if (log) fclose(log);
+}
+
+void Journal::load() {
+    FILE* in = fopen(path.c_str(), "r");
+    if (in == NULL) return;
+
+    // a line cut short by a crash doesn't parse and is skipped
+    char line[128];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        uint64_t token, committed;
+        unsigned stripe, file_id;
+        if (sscanf(line, "P %" SCNx64 " %u %u %" SCNu64, &token, &stripe, &file_id, &committed) == 4) {
+            entries[{token, (uint16_t)stripe}] = {(uint16_t)file_id, committed};
+        } else if (sscanf(line, "F %" SCNx64 " %u", &token, &stripe) == 2) {
+            entries.erase({token, (uint16_t)stripe});
+        }
+    }
+    fclose(in);
+}
+
+// rewrite the file with one record per live upload, swapped in by rename so
+// a crash part way leaves the old file
+void Journal::compact() {
+    if (log) fclose(log);
+    log = NULL;
+
+    std::string tmp = path + ".tmp";
+    FILE* out       = fopen(tmp.c_str(), "w");
+    if (out == NULL) _exit("Opening resume journal");
+    for (auto const& [key, point] : entries)
+        fprintf(out, "P %" PRIx64 " %u %u %" PRIu64 "\n", key.first, key.second, point.file_id, point.committed);
+    if (fclose(out) != 0 || rename(tmp.c_str(), path.c_str()) != 0) _exit("Writing resume journal");
+
+    log = fopen(path.c_str(), "a");
+    if (log == NULL) _exit("Opening resume journal");
+    appended = 0;
+}
+
+void Journal::append(const char* line) {
+    if (log == NULL) return;
+    fputs(line, log);
+    fflush(log);
+    if (++appended > JOURNAL_COMPACT_RECORDS + 4 * entries.size()) compact();
+}
+
+bool Journal::find(uint64_t token, uint16_t stripe, ResumePoint* point) const {
+    auto it = entries.find({token, stripe});
+    if (it == entries.end()) return false;
+    *point = it->second;
+    return true;
+}
+
+void Journal::record(uint64_t token, uint16_t stripe, const ResumePoint& point) {
+    entries[{token, stripe}] = point;
+    char line[128];
+    snprintf(line, sizeof(line), "P %" PRIx64 " %u %u %" PRIu64 "\n", token, stripe, point.file_id, point.committed);
+    append(line);
+}
+
+void Journal::forget(uint64_t token, uint16_t stripe) {
+    if (entries.erase({token, stripe}) == 0) return;
+    char line[128];
+    snprintf(line, sizeof(line), "F %" PRIx64 " %u\n", token, stripe);
+    append(line);
+}
+
+bool Journal::holds(uint16_t file_id) const {
+    for (auto const& [key, point] : entries)
+        if (point.file_id == file_id) return true;
+    return false;
+}
+
+void Journal::forget_file(uint16_t file_id) {
+    for (auto it = entries.begin(); it != entries.end();) {
+        auto key   = it->first;
+        bool match = it->second.file_id == file_id;
+        ++it;
+        if (match) forget(key.first, key.second);
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef JOURNAL
+#define JOURNAL
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <utility>
+
+// How far each resumable upload got, so an upload cut off by a timeout, a
+// client crash or a server restart can carry on where it stopped rather than
+// start again. Uploads are known by the token their client sends in the SYN
+// and, for striped uploads, the stripe index.
+//
+// Kept in memory and, given a path, in an append-only text file of one record
+// per line that is read back and compacted when the server starts:
+//
+//     P <token> <stripe> <file id> <committed>   upload writes <file id>.file,
+//                                                 first <committed> bytes are in
+//     F <token> <stripe>                          upload finished, forget it
+//
+// A record is only appended after the data it covers has been written, so the
+// journal may be behind the file but never ahead of it.
+
+#define JOURNAL_COMPACT_RECORDS 4096 // appended records that trigger a rewrite
+
+struct ResumePoint {
+    uint16_t file_id;
+    uint64_t committed; // bytes of the stream already in the file
+};
+
+class Journal {
+    public:
+        // an empty path keeps the journal in memory only
+        Journal(const std::string& path = "");
+        ~Journal();
+
+        bool find(uint64_t token, uint16_t stripe, ResumePoint* point) const;
+        void record(uint64_t token, uint16_t stripe, const ResumePoint& point);
+        void forget(uint64_t token, uint16_t stripe);
+        // whether an unfinished upload is still writing file_id
+        bool holds(uint16_t file_id) const;
+        // forget every upload writing file_id, which is about to be replaced
+        void forget_file(uint16_t file_id);
+        size_t size() const { return entries.size(); }
+
+    private:
+        void load();
+        void compact();
+        void append(const char* line);
+
+        std::string path;
+        FILE* log;
+        size_t appended; // records written since the last compaction
+        std::map<std::pair<uint64_t, uint16_t>, ResumePoint> entries;
+};
+
+#endif
@@ -0,0 +1,249 @@
+#include "pcap.h"
+
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include <chrono>
+#include <cstring>
+
+// ========================================================================== //
+// READER
+// ========================================================================== //
+
+static uint32_t swap32(uint32_t v) {
+    return ((v & 0xff) << 24) | ((v & 0xff00) << 8) | ((v >> 8) & 0xff00) | (v >> 24);
+}
+
+// offset of the IPv4 header inside a frame of the given link type, or -1
+static int link_header_len(uint32_t link, const unsigned char* frame, uint32_t len) {
+    switch (link) {
+        case PCAP_LINK_NULL:
+            return 4;
+        case PCAP_LINK_RAW:
+        case PCAP_LINK_IPV4:
+            return 0;
+        case PCAP_LINK_LINUX_SLL:
+            if (len < 16 || frame[14] != 0x08 || frame[15] != 0x00) return -1;
+            return 16;
+        case PCAP_LINK_ETHERNET: {
+            int off = 12;
+            // skip any 802.1Q tags
+            while (len >= (uint32_t)off + 2 && frame[off] == 0x81 && frame[off + 1] == 0x00) off += 4;
+            if (len < (uint32_t)off + 2 || frame[off] != 0x08 || frame[off + 1] != 0x00) return -1;
+            return off + 2;
+        }
+    }
+    return -1;
+}
+
+bool pcap_read_udp(const char* path, std::vector<PcapRecord>& out) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return false;
+
+    unsigned char global[24];
+    if (fread(global, 1, sizeof(global), f) != sizeof(global)) {
+        fclose(f);
+        return false;
+    }
+
+    uint32_t magic;
+    memcpy(&magic, global, 4);
+    bool swapped = magic == swap32(PCAP_MAGIC_US) || magic == swap32(PCAP_MAGIC_NS);
+    if (swapped) magic = swap32(magic);
+    if (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) {
+        fclose(f);
+        return false;
+    }
+    bool nanos = magic == PCAP_MAGIC_NS;
+
+    uint32_t link;
+    memcpy(&link, global + 20, 4);
+    if (swapped) link = swap32(link);
+    link &= 0x0fffffff;
+
+    std::vector<unsigned char> frame;
+    uint32_t rec[4];
+    while (fread(rec, 1, sizeof(rec), f) == sizeof(rec)) {
+        if (swapped)
+            for (int i = 0; i < 4; i++) rec[i] = swap32(rec[i]);
+        uint32_t incl = rec[2];
+        if (incl > (1 << 24)) break;
+        frame.resize(incl);
+        if (fread(frame.data(), 1, incl, f) != incl) break;
+
+        int off = link_header_len(link, frame.data(), incl);
+        if (off < 0) {
+            if (link != PCAP_LINK_ETHERNET && link != PCAP_LINK_LINUX_SLL) {
+                fclose(f);
+                return false;
+            }
+            continue;
+        }
+
+        const unsigned char* ip = frame.data() + off;
+        uint32_t ip_len         = incl - off;
+        if (ip_len < 20 || (ip[0] >> 4) != 4 || ip[9] != IPPROTO_UDP) continue;
+        uint32_t ihl = (ip[0] & 0x0f) * 4;
+        if (ip_len < ihl + 8) continue;
+
+        const unsigned char* udp = ip + ihl;
+        uint32_t udp_len         = (udp[4] << 8) | udp[5];
+        if (udp_len < 8 || ihl + udp_len > ip_len) continue;
+
+        PcapRecord r;
+        r.ts_us    = (uint64_t)rec[0] * 1000000 + (nanos ? rec[1] / 1000 : rec[1]);
+        r.src_ip   = (ip[12] << 24) | (ip[13] << 16) | (ip[14] << 8) | ip[15];
+        r.dst_ip   = (ip[16] << 24) | (ip[17] << 16) | (ip[18] << 8) | ip[19];
+        r.src_port = (udp[0] << 8) | udp[1];
+        r.dst_port = (udp[2] << 8) | udp[3];
+        r.payload.assign((const char*)udp + 8, udp_len - 8);
+        out.push_back(r);
+    }
+
+    fclose(f);
+    return true;
+}
+
+// ========================================================================== //
+// WRITER
+// ========================================================================== //
+
+static void peer_addr(const Peer& p, uint32_t* ip, uint16_t* port) {
+    if (p.addr.ss_family == AF_INET) {
+        const struct sockaddr_in* sin = (const struct sockaddr_in*)&p.addr;
+        *ip   = sin->sin_addr.s_addr;
+        *port = sin->sin_port;
+    } else {
+        *ip   = 0;
+        *port = 0;
+    }
+}
+
+PcapWriter::PcapWriter(const char* path, size_t slots) {
+    file = fopen(path, "wb");
+    if (file == NULL) _exit("Opening capture file");
+
+    size_t n = 1;
+    while (n < slots) n <<= 1;
+    mask       = n - 1;
+    ring_bytes = n * sizeof(PcapSlot);
+
+    // populate up front so recording never takes a page fault
+    ring = (PcapSlot*)mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (ring == MAP_FAILED) _exit("Mapping capture ring");
+    for (size_t i = 0; i < n; i++) new (&ring[i].seq) std::atomic<uint64_t>(i);
+
+    // settle the clock offset (and TSC calibration) before anyone records
+    time_realtime_offset_ns();
+    dropped     = 0;
+    enqueue_pos = 0;
+    dequeue_pos = 0;
+    stopping    = false;
+
+    uint32_t magic      = PCAP_MAGIC_NS;
+    uint16_t version[2] = {2, 4};
+    uint32_t rest[4]    = {0, 0, SPEC_MAX_PACKET_SIZE + 28, PCAP_LINK_RAW};
+    fwrite(&magic, sizeof(magic), 1, file);
+    fwrite(version, sizeof(version), 1, file);
+    fwrite(rest, sizeof(rest), 1, file);
+
+    thread = std::thread(&PcapWriter::flusher, this);
+}
+
+PcapWriter::~PcapWriter() {
+    close();
+}
+
+void PcapWriter::record(const void* data, int len, const Peer& from, const Peer& to) {
+    uint64_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    PcapSlot* slot;
+    while (true) {
+        slot         = &ring[pos & mask];
+        uint64_t seq = slot->seq.load(std::memory_order_acquire);
+        int64_t diff = (int64_t)seq - (int64_t)pos;
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            // ring full
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->ts_ns = time_now_ns() + time_realtime_offset_ns();
+    peer_addr(from, &slot->src_ip, &slot->src_port);
+    peer_addr(to, &slot->dst_ip, &slot->dst_port);
+    slot->len = std::min(len, SPEC_MAX_PACKET_SIZE);
+    memcpy(slot->data, data, slot->len);
+    slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+void PcapWriter::drain() {
+    unsigned char hdr[16 + 28];
+    while (true) {
+        PcapSlot* slot = &ring[dequeue_pos & mask];
+        if (slot->seq.load(std::memory_order_acquire) != dequeue_pos + 1) break;
+
+        uint32_t rec[4] = {(uint32_t)(slot->ts_ns / 1000000000), (uint32_t)(slot->ts_ns % 1000000000),
+                           (uint32_t)slot->len + 28, (uint32_t)slot->len + 28};
+        memcpy(hdr, rec, 16);
+
+        // IPv4 header, no options
+        unsigned char* ip = hdr + 16;
+        uint16_t total    = htons(slot->len + 28);
+        memset(ip, 0, 20);
+        ip[0] = 0x45;
+        memcpy(ip + 2, &total, 2);
+        ip[8] = 64;
+        ip[9] = IPPROTO_UDP;
+        memcpy(ip + 12, &slot->src_ip, 4);
+        memcpy(ip + 16, &slot->dst_ip, 4);
+        uint32_t sum = 0;
+        for (int i = 0; i < 20; i += 2) sum += (ip[i] << 8) | ip[i + 1];
+        while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+        ip[10] = ~sum >> 8;
+        ip[11] = ~sum & 0xff;
+
+        // UDP header, checksum left out as IPv4 allows
+        unsigned char* udp = ip + 20;
+        uint16_t udp_len   = htons(slot->len + 8);
+        memcpy(udp, &slot->src_port, 2);
+        memcpy(udp + 2, &slot->dst_port, 2);
+        memcpy(udp + 4, &udp_len, 2);
+        udp[6] = 0;
+        udp[7] = 0;
+
+        fwrite(hdr, sizeof(hdr), 1, file);
+        fwrite(slot->data, slot->len, 1, file);
+
+        slot->seq.store(dequeue_pos + mask + 1, std::memory_order_release);
+        dequeue_pos++;
+    }
+}
+
+void PcapWriter::flusher() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (!stopping) {
+        wake.wait_for(guard, std::chrono::milliseconds(PCAP_FLUSH_MS));
+        drain();
+        fflush(file);
+    }
+}
+
+void PcapWriter::close() {
+    if (file == NULL) return;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+
+    drain();
+    fclose(file);
+    file = NULL;
+    munmap(ring, ring_bytes);
+    if (dropped > 0) fprintf(stderr, "capture dropped %lu packets\n", (unsigned long)dropped.load());
+}
@@ -0,0 +1,92 @@
+#ifndef PCAP
+#define PCAP
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+// Minimal reader and writer for classic libpcap files, just enough to get the
+// Confundo datagrams out of a capture such as confundo.pcap and to record our
+// own traffic in a form confundo.lua can dissect.
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+
+#define PCAP_LINK_NULL 0
+#define PCAP_LINK_ETHERNET 1
+#define PCAP_LINK_RAW 101
+#define PCAP_LINK_LINUX_SLL 113
+#define PCAP_LINK_IPV4 228
+
+// one UDP over IPv4 datagram from a capture, addresses and ports in host order
+struct PcapRecord {
+    uint64_t ts_us;
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    std::string payload;
+};
+
+// append every UDP over IPv4 datagram in the capture at path to out, returns
+// false if the file can't be opened or isn't a pcap with a known link type
+bool pcap_read_udp(const char* path, std::vector<PcapRecord>& out);
+
+#define PCAP_DEFAULT_SLOTS 8192
+#define PCAP_FLUSH_MS 20
+
+// one captured datagram waiting in the ring, addresses in network order
+struct PcapSlot {
+    std::atomic<uint64_t> seq;
+    uint64_t ts_ns;
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t len;
+    char data[SPEC_MAX_PACKET_SIZE];
+};
+
+// Records every datagram handed to record() into a preallocated, pre-faulted
+// ring of memory-mapped slots. A background thread turns them into pcap
+// records, with IPv4 and UDP headers rebuilt from the addresses, so the
+// network thread only pays for a timestamp and one copy. When the writer falls
+// behind, datagrams are counted in dropped rather than making senders wait.
+class PcapWriter {
+    public:
+        // slots is rounded up to a power of two
+        PcapWriter(const char* path, size_t slots = PCAP_DEFAULT_SLOTS);
+        ~PcapWriter();
+
+        // safe to call from any number of threads
+        void record(const void* data, int len, const Peer& from, const Peer& to);
+        // write out everything recorded so far and close the file
+        void close();
+
+        std::atomic<uint64_t> dropped;
+
+    private:
+        void flusher();
+        void drain();
+
+        FILE* file;
+        PcapSlot* ring;
+        size_t mask;
+        size_t ring_bytes;
+        std::atomic<uint64_t> enqueue_pos;
+        uint64_t dequeue_pos;
+
+        std::mutex lock;
+        std::condition_variable wake;
+        bool stopping;
+        std::thread thread;
+};
+
+#endif
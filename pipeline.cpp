@@ -0,0 +1,528 @@
+#include "pipeline.h"
+
+#include <poll.h>
+#include <unistd.h>
+
+// the reader can only run a ring ahead of the oldest unACKed byte
+static_assert(PIPELINE_READ_AHEAD * SPEC_MAX_PAYLOAD_SIZE > SPEC_RWND, "read-ahead ring smaller than the window");
+
+// ========================================================================== //
+// READ-AHEAD
+// ========================================================================== //
+
+ReadAheadSource::ReadAheadSource(int f, uint64_t s, uint64_t l, size_t segments)
+    : fd(f), start(s), length(l), ring(segments) {
+    released = 0;
+    skip     = 0;
+    done     = false;
+    stopping = false;
+    thread   = std::thread(&ReadAheadSource::reader, this);
+}
+
+ReadAheadSource::~ReadAheadSource() {
+    stopping = true;
+    thread.join();
+}
+
+// fill buf from fd, waiting out short reads from a pipe, returns bytes read
+// (short only at the end of the input) or -1 if told to stop first
+int ReadAheadSource::fill(char* buf, int want) {
+    int n = 0;
+    while (n < want) {
+        // don't block in read() on a stalled pipe, so stopping is noticed
+        struct pollfd p = {fd, POLLIN, 0};
+        if (poll(&p, 1, PIPELINE_PARK_MS) == 0) {
+            if (stopping.load(std::memory_order_relaxed)) return -1;
+            continue;
+        }
+        ssize_t rc = read(fd, buf + n, want - n);
+        if (rc < 0 && errno == EINTR) continue;
+        err(rc, "Reading input");
+        if (rc == 0) break;
+        n += rc;
+    }
+    return n;
+}
+
+void ReadAheadSource::reader() {
+    leave_pinned_cpu();
+    // a pipe can't seek, but then it starts at 0 anyway
+    if (start > 0) err(lseek(fd, start, SEEK_SET), "Seeking input");
+
+    uint64_t offset = 0;
+    int spins       = 0;
+    while (offset < length && !stopping.load(std::memory_order_relaxed)) {
+        // every segment so far ends before the skip, so the ones past it
+        // still follow each other without a gap
+        uint64_t target = std::min(skip.load(std::memory_order_relaxed), length);
+        if (target > offset && lseek(fd, start + target, SEEK_SET) >= 0) offset = target;
+
+        Segment* seg = ring.reserve();
+        if (seg == NULL) {
+            pipeline_backoff(spins);
+            continue;
+        }
+        spins = 0;
+
+        int want = std::min(length - offset, (uint64_t)SPEC_MAX_PAYLOAD_SIZE);
+        int n    = fill(seg->data, want);
+        if (n > 0) {
+            seg->offset = offset;
+            seg->len    = n;
+            ring.commit();
+            offset += n;
+        }
+        if (n < want) break;
+    }
+    done.store(true, std::memory_order_release);
+}
+
+int ReadAheadSource::read_at(uint64_t offset, char* buf, int len) {
+    int n     = 0;
+    int spins = 0;
+    while (n < len) {
+        // done has to be read first, so a segment committed just before it
+        // was set is still seen below
+        bool finished = done.load(std::memory_order_acquire);
+
+        // every segment but the last is full, so the one holding pos is
+        // found by division; a read can span two of them
+        uint64_t pos   = offset + n;
+        Segment* front = ring.peek();
+        // segments read before a skip was seen can still turn up
+        while (front != NULL && front->offset + front->len <= released) {
+            ring.pop();
+            front = ring.peek();
+        }
+        Segment* seg = NULL;
+        if (front != NULL) {
+            if (pos < front->offset) _exit("Read-ahead: offset already released");
+            seg = ring.peek((pos - front->offset) / SPEC_MAX_PAYLOAD_SIZE);
+        }
+        if (seg != NULL) {
+            uint64_t skip = pos - seg->offset;
+            if (skip >= (uint64_t)seg->len) break;
+            int take = std::min((uint64_t)(len - n), seg->len - skip);
+            memcpy(buf + n, seg->data + skip, take);
+            n += take;
+            continue;
+        }
+        if (finished) break;
+        // the file is usually there after a moment, a pipe may take a while
+        if (spins >= PIPELINE_SPINS) return n > 0 ? n : SOURCE_PENDING;
+        pipeline_backoff(spins);
+    }
+    return n;
+}
+
+void ReadAheadSource::skip_to(uint64_t offset) {
+    skip.store(offset, std::memory_order_relaxed);
+    release(offset);
+}
+
+void ReadAheadSource::release(uint64_t offset) {
+    released = std::max(released, offset);
+    Segment* front;
+    while ((front = ring.peek()) != NULL && front->offset + front->len <= offset) ring.pop();
+}
+
+// ========================================================================== //
+// STAGED STREAMS
+// ========================================================================== //
+
+StagedSource::StagedSource(bool t, size_t blocks) : threaded(t), ring(blocks) {
+    next_offset = 0;
+    done        = false;
+    stopping    = false;
+}
+
+void StagedSource::stop() {
+    stopping = true;
+    if (thread.joinable()) thread.join();
+}
+
+// make one more block into the ring, returns its length or a STAGE_ code
+int StagedSource::stage_next() {
+    StagedBlock* block = ring.reserve();
+    if (block == NULL) return STAGE_FULL;
+    int rc = stage(block->data);
+    if (rc <= 0) return rc;
+    block->offset = next_offset;
+    block->len    = rc;
+    ring.commit();
+    next_offset += rc;
+    return rc;
+}
+
+void StagedSource::worker() {
+    leave_pinned_cpu();
+    int spins = 0;
+    while (!stopping.load(std::memory_order_relaxed)) {
+        int rc = stage_next();
+        if (rc == STAGE_DONE) break;
+        if (rc == STAGE_FULL || rc == STAGE_WAIT) {
+            pipeline_backoff(spins);
+            continue;
+        }
+        spins = 0;
+    }
+    done.store(true, std::memory_order_release);
+}
+
+int StagedSource::read_at(uint64_t offset, char* buf, int len) {
+    if (threaded && !thread.joinable()) thread = std::thread(&StagedSource::worker, this);
+
+    int n     = 0;
+    int spins = 0;
+    while (n < len) {
+        bool finished = done.load(std::memory_order_acquire);
+
+        // blocks vary in length, so look through the few in the ring
+        uint64_t pos       = offset + n;
+        StagedBlock* block = NULL;
+        for (size_t i = 0; (block = ring.peek(i)) != NULL; i++) {
+            if (pos < block->offset) _exit("Staged stream: offset already released");
+            if (pos < block->offset + block->len) break;
+        }
+        if (block != NULL) {
+            int skip_bytes = pos - block->offset;
+            int take       = std::min(len - n, block->len - skip_bytes);
+            memcpy(buf + n, block->data + skip_bytes, take);
+            n += take;
+            continue;
+        }
+
+        if (!threaded) {
+            int rc = stage_next();
+            if (rc > 0) continue;
+            if (rc == STAGE_DONE) break;
+            // a full ring frees up as the window is ACKed
+            return n > 0 ? n : SOURCE_PENDING;
+        }
+        if (finished) break;
+        if (spins >= PIPELINE_SPINS) return n > 0 ? n : SOURCE_PENDING;
+        pipeline_backoff(spins);
+    }
+    return n;
+}
+
+void StagedSource::release(uint64_t offset) {
+    StagedBlock* front;
+    while ((front = ring.peek()) != NULL && front->offset + front->len <= offset) ring.pop();
+}
+
+// ========================================================================== //
+// COMPRESSION
+// ========================================================================== //
+
+CompressSource::CompressSource(DataSource* r, bool threaded, size_t blocks)
+    : StagedSource(threaded, blocks), raw(r), scratch(COMPRESS_BLOCK_SIZE) {
+    raw_bytes       = 0;
+    packed_bytes    = 0;
+    deflated_blocks = 0;
+    skipped_blocks  = 0;
+    raw_offset      = 0;
+    skip            = 0;
+    backoff         = 1;
+}
+
+CompressSource::~CompressSource() {
+    stop();
+}
+
+int CompressSource::stage(char* out) {
+    // a short block is fine if the source has to be waited on, so a slow
+    // pipe isn't held back until a whole block has trickled in
+    int n = 0;
+    while (n < COMPRESS_BLOCK_SIZE) {
+        int rc = raw->read_at(raw_offset + n, scratch.data() + n, COMPRESS_BLOCK_SIZE - n);
+        if (rc == SOURCE_PENDING && n == 0) return STAGE_WAIT;
+        if (rc <= 0) break;
+        n += rc;
+    }
+    if (n == 0) return STAGE_DONE;
+
+    int len;
+    if (skip == 0) {
+        len = pack_block(scratch.data(), n, out, true);
+        if (len < COMPRESS_FRAME_SIZE + n) {
+            deflated_blocks++;
+            backoff = 1;
+        } else {
+            skip    = backoff;
+            backoff = std::min(backoff * 2, PIPELINE_MAX_SKIP);
+        }
+    } else {
+        len = pack_block(scratch.data(), n, out, false);
+        skipped_blocks++;
+        skip--;
+    }
+
+    raw_offset += n;
+    raw->release(raw_offset);
+    raw_bytes += n;
+    packed_bytes += len;
+    return len;
+}
+
+void CompressSource::skip_to(uint64_t offset) {
+    raw_offset = offset;
+    raw->skip_to(offset);
+}
+
+// ========================================================================== //
+// DELTA
+// ========================================================================== //
+
+DeltaSource::DeltaSource(DataSource* r, const BlockSums* s, bool threaded, size_t blocks)
+    : StagedSource(threaded, blocks), raw(r), sums(s) {
+    raw_bytes     = 0;
+    literal_bytes = 0;
+    copied_blocks = 0;
+    indexed       = false;
+    shift         = 32;
+    buf_start     = 0;
+    buf_end       = 0;
+    literal       = 0;
+    pos           = 0;
+    rolling       = false;
+    a             = 0;
+    b             = 0;
+    copy_first    = 0;
+    copy_count    = 0;
+    eof           = false;
+    ended         = false;
+    file_crc      = 0;
+}
+
+DeltaSource::~DeltaSource() {
+    stop();
+}
+
+int DeltaSource::read_at(uint64_t offset, char* buf, int len) {
+    if (sums->block_size == 0) return raw->read_at(offset, buf, len);
+    return StagedSource::read_at(offset, buf, len);
+}
+
+void DeltaSource::release(uint64_t offset) {
+    if (sums->block_size == 0) return raw->release(offset);
+    StagedSource::release(offset);
+}
+
+// chain the blocks by weak sum, lowest block first in each chain
+void DeltaSource::index_sums() {
+    size_t blocks = sums->weak.size();
+    int bits      = 10;
+    while (bits < 31 && ((size_t)1 << bits) < 2 * blocks) bits++;
+    shift = 32 - bits;
+    heads.assign((size_t)1 << bits, UINT32_MAX);
+    next.assign(blocks, UINT32_MAX);
+    for (size_t i = blocks; i-- > 0;) {
+        uint32_t h = bucket(sums->weak[i]);
+        next[i]    = heads[h];
+        heads[h]   = i;
+    }
+    buf.resize(DELTA_MAX_LITERAL + sums->block_size + COMPRESS_BLOCK_SIZE);
+    indexed = true;
+}
+
+// the basis block the window at pos is a copy of, or -1; the block after the
+// copy being built is tried first, so runs of blocks stay one op
+int64_t DeltaSource::match() const {
+    uint32_t weak   = weak_sum_value(a, b);
+    uint32_t strong = 0;
+    bool summed     = false;
+    uint64_t want   = copy_first + copy_count;
+    if (copy_count > 0 && want < sums->weak.size() && sums->weak[want] == weak) {
+        strong = crc32c(0, at(pos), sums->block_size);
+        summed = true;
+        if (sums->strong[want] == strong) return want;
+    }
+    for (uint32_t i = heads[bucket(weak)]; i != UINT32_MAX; i = next[i]) {
+        if (sums->weak[i] != weak) continue;
+        if (!summed) {
+            strong = crc32c(0, at(pos), sums->block_size);
+            summed = true;
+        }
+        if (sums->strong[i] == strong) return i;
+    }
+    return -1;
+}
+
+// read more of the other source after what the buffer holds, first dropping
+// whatever has gone out in ops; returns what read_at did
+int DeltaSource::fill() {
+    if (literal > buf_start) {
+        memmove(buf.data(), at(literal), buf_end - literal);
+        buf_start = literal;
+    }
+    size_t have = buf_end - buf_start;
+    int rc      = raw->read_at(buf_end, buf.data() + have, buf.size() - have);
+    if (rc <= 0) return rc;
+    file_crc = crc32c(file_crc, buf.data() + have, rc);
+    buf_end += rc;
+    raw_bytes += rc;
+    raw->release(buf_end);
+    return rc;
+}
+
+int DeltaSource::put_pending_copy(char* out) {
+    if (copy_count == 0) return 0;
+    int n      = put_copy(out, copy_first, copy_count);
+    copy_count = 0;
+    return n;
+}
+
+// the bytes from literal up to end, after the copy before them
+int DeltaSource::put_pending_literal(char* out, uint64_t end) {
+    if (end <= literal) return 0;
+    int n = put_pending_copy(out);
+    n += put_literal(out + n, at(literal), end - literal);
+    literal_bytes += end - literal;
+    literal = end;
+    return n;
+}
+
+int DeltaSource::stage(char* out) {
+    if (ended) return STAGE_DONE;
+    if (!indexed) index_sums();
+    uint32_t block_size = sums->block_size;
+
+    // each pass puts out at most a copy and a whole literal
+    int len = 0;
+    while (!ended && len + DELTA_COPY_SIZE + DELTA_LITERAL_HEAD + DELTA_MAX_LITERAL <= COMPRESS_MAX_FRAME) {
+        if (!eof && buf_end < pos + block_size) {
+            int rc = fill();
+            if (rc == SOURCE_PENDING) {
+                // a slow pipe shouldn't hold back what is already here
+                if (len == 0) len = put_pending_literal(out, pos);
+                return len > 0 ? len : STAGE_WAIT;
+            }
+            if (rc == 0) eof = true;
+            continue;
+        }
+
+        // too little left for a block: the rest goes as it is, then the end
+        if (buf_end < pos + block_size) {
+            if (literal < buf_end) {
+                len += put_pending_literal(out + len, std::min(buf_end, literal + DELTA_MAX_LITERAL));
+                continue;
+            }
+            len += put_pending_copy(out + len);
+            len += put_end(out + len, file_crc);
+            ended = true;
+            break;
+        }
+
+        if (!rolling) {
+            weak_sum(at(pos), block_size, &a, &b);
+            rolling = true;
+        }
+        int64_t block = match();
+        if (block >= 0) {
+            len += put_pending_literal(out + len, pos);
+            if (copy_count == 0 || block != copy_first + copy_count) {
+                len += put_pending_copy(out + len);
+                copy_first = block;
+            }
+            copy_count++;
+            copied_blocks++;
+            pos += block_size;
+            literal = pos;
+            rolling = false;
+            continue;
+        }
+
+        // no match, slide the window a byte; a literal can't outgrow one op
+        if (pos + 1 - literal >= DELTA_MAX_LITERAL) len += put_pending_literal(out + len, pos + 1);
+        if (pos + block_size < buf_end) {
+            uint32_t x_out = (unsigned char)*at(pos);
+            uint32_t x_in  = (unsigned char)*at(pos + block_size);
+            a += x_in - x_out;
+            b += a - block_size * x_out;
+        } else {
+            rolling = false;
+        }
+        pos++;
+    }
+    return len;
+}
+
+// ========================================================================== //
+// SENDER
+// ========================================================================== //
+
+SendStage::SendStage(int fd, const Peer& t, const Peer& l, PcapWriter* cap, uint64_t spin, size_t slots)
+    : socket_fd(fd), to(t), local(l), capture(cap), spin_us(spin), ring(slots) {
+    stopping = false;
+    parked   = false;
+    thread   = std::thread(&SendStage::sender, this);
+}
+
+SendStage::~SendStage() {
+    close();
+}
+
+void SendStage::send(const packet* pack, int len) {
+    TxDatagram* slot;
+    int spins = 0;
+    while ((slot = ring.reserve()) == NULL) pipeline_backoff(spins);
+    slot->len = len;
+    memcpy(&slot->pack, pack, len);
+    ring.commit();
+
+    if (parked.load()) {
+        std::lock_guard<std::mutex> guard(lock);
+        wake.notify_one();
+    }
+}
+
+void SendStage::sender() {
+    int spins           = 0;
+    uint64_t idle_since = 0;
+    while (true) {
+        // checked before the ring so nothing queued before close() is lost
+        bool last = stopping.load(std::memory_order_acquire);
+
+        TxDatagram* slot = ring.peek();
+        if (slot == NULL) {
+            if (last) break;
+            if (spins < PIPELINE_SPINS) {
+                pipeline_backoff(spins);
+                if (spins == 1) idle_since = time_now_us();
+                continue;
+            }
+            // in low-latency mode a wake-up costs more than the core
+            if (spin_us > 0 && time_now_us() - idle_since < spin_us) {
+                std::this_thread::yield();
+                continue;
+            }
+            // announce the nap before the last look at the ring, so a send()
+            // that lands in between either is seen here or sees parked
+            std::unique_lock<std::mutex> guard(lock);
+            parked.store(true);
+            if (ring.peek() == NULL && !stopping.load())
+                wake.wait_for(guard, std::chrono::milliseconds(PIPELINE_PARK_MS));
+            parked.store(false);
+            spins = 0;
+            continue;
+        }
+        spins = 0;
+
+        int numbytes = sendto(socket_fd, &slot->pack, slot->len, 0, (struct sockaddr*)&to.addr, to.len);
+        if (send_dropped(numbytes)) _log("SEND: socket buffer full, datagram dropped");
+        else err(numbytes, "Sending packet");
+        if (capture && numbytes >= 0) capture->record(&slot->pack, numbytes, local, to);
+        ring.pop();
+    }
+}
+
+void SendStage::close() {
+    if (!thread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping.store(true, std::memory_order_release);
+    }
+    wake.notify_one();
+    thread.join();
+}
@@ -0,0 +1,304 @@
+#ifndef PIPELINE
+#define PIPELINE
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "busypoll.h"
+#include "common.h"
+#include "compress.h"
+#include "delta.h"
+#include "pcap.h"
+#include "protocol.h"
+
+// Stages of the client pipeline. A reader thread keeps a ring of file
+// segments ahead of the window, the protocol thread turns ACKs and timers into
+// datagrams, and a sender thread does the sendto calls, so neither disk reads
+// nor socket writes hold up ACK processing. Stages hand work over through
+// single-producer single-consumer rings; no lock is taken on the data path.
+// Reader and staging threads keep off a cpu the protocol thread is pinned to.
+
+#define PIPELINE_READ_AHEAD 1024 // segments, must cover the whole window
+#define PIPELINE_TX_SLOTS 256
+#define PIPELINE_SPINS 64        // busy tries before a waiting stage naps
+#define PIPELINE_NAP_US 50
+#define PIPELINE_PARK_MS 10      // longest an idle sender sleeps between checks
+#define PIPELINE_PACK_AHEAD 16   // compressed or delta blocks
+#define PIPELINE_MAX_SKIP 64     // most blocks sent raw without trying after a miss
+
+// wait a little for another stage, spinning first and then sleeping
+inline void pipeline_backoff(int& spins) {
+    if (spins++ < PIPELINE_SPINS) {
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(PIPELINE_NAP_US));
+    }
+}
+
+// Bounded ring with one producer and one consumer thread. Each side caches
+// the other's index and only rereads it when the ring looks full or empty.
+template <typename T>
+class SpscRing {
+    public:
+        // capacity is rounded up to a power of two
+        SpscRing(size_t capacity) {
+            size_t n = 1;
+            while (n < capacity) n <<= 1;
+            slots.resize(n);
+            mask        = n - 1;
+            head        = 0;
+            tail        = 0;
+            head_cached = 0;
+            tail_cached = 0;
+        }
+
+        size_t capacity() const { return mask + 1; }
+
+        // producer: the next free slot to fill, or NULL when full
+        T* reserve() {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h - tail_cached > mask) {
+                tail_cached = tail.load(std::memory_order_acquire);
+                if (h - tail_cached > mask) return NULL;
+            }
+            return &slots[h & mask];
+        }
+
+        // producer: publish the slot reserve() returned
+        void commit() {
+            head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        // consumer: entries ready to read
+        size_t size() {
+            head_cached = head.load(std::memory_order_acquire);
+            return head_cached - tail.load(std::memory_order_relaxed);
+        }
+
+        // consumer: the i-th ready entry from the front, or NULL
+        T* peek(size_t i = 0) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if (head_cached - t <= i && size() <= i) return NULL;
+            return &slots[(t + i) & mask];
+        }
+
+        // consumer: hand the front entry back to the producer
+        void pop() {
+            tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+    private:
+        std::vector<T> slots;
+        size_t mask;
+        alignas(64) std::atomic<size_t> head; // written by the producer
+        size_t tail_cached;                   // producer's view of tail
+        alignas(64) std::atomic<size_t> tail; // written by the consumer
+        size_t head_cached;                   // consumer's view of head
+};
+
+// one payload's worth of the file, read ahead of the window
+struct Segment {
+    uint64_t offset;
+    int len;
+    char data[SPEC_MAX_PAYLOAD_SIZE];
+};
+
+// Serves read_at() from segments a background thread reads from a file or
+// pipe. Segments stay in the ring until release() says they were ACKed, so a
+// go-back-N resend never touches the disk, the input never has to be seekable,
+// and memory stays at one ring however long the input is.
+class ReadAheadSource : public DataSource {
+    public:
+        // serves length bytes of fd from start on, as offsets from 0; fd
+        // only has to be seekable if start isn't 0
+        ReadAheadSource(int fd, uint64_t start = 0, uint64_t length = UINT64_MAX,
+                        size_t segments = PIPELINE_READ_AHEAD);
+        ~ReadAheadSource();
+        // waits briefly for the reader, then returns SOURCE_PENDING
+        int read_at(uint64_t offset, char* buf, int len) override;
+        void release(uint64_t offset) override;
+        // a seekable fd jumps straight there, a pipe is read through
+        void skip_to(uint64_t offset) override;
+
+    private:
+        void reader();
+        int fill(char* buf, int want);
+
+        int fd;
+        uint64_t start;
+        uint64_t length;
+        uint64_t released; // everything before it can go
+        std::atomic<uint64_t> skip; // where the reader should jump ahead to
+        SpscRing<Segment> ring;
+        std::atomic<bool> done; // every segment of the file is in the ring
+        std::atomic<bool> stopping;
+        std::thread thread;
+};
+
+// one block of a stream made from another source's bytes
+struct StagedBlock {
+    uint64_t offset; // in the stream made
+    int len;
+    char data[COMPRESS_MAX_FRAME];
+};
+
+#define STAGE_FULL 0    // the ring has no room
+#define STAGE_DONE -1   // the raw source has ended
+#define STAGE_WAIT -2   // the raw source has nothing yet
+
+// Serves a stream made from another source a block at a time, with offsets
+// into the stream made. Blocks are made ahead of the window on a worker
+// thread, started on the first read, and kept until released, so the other
+// source can let go of its bytes as soon as a block is made from them.
+//
+// Without a thread, blocks are made on demand in read_at, which keeps the
+// simulator deterministic.
+class StagedSource : public DataSource {
+    public:
+        StagedSource(bool threaded, size_t blocks);
+        int read_at(uint64_t offset, char* buf, int len) override;
+        void release(uint64_t offset) override;
+
+    protected:
+        // make the next block into out, which has room for COMPRESS_MAX_FRAME
+        // bytes; returns its length or STAGE_DONE or STAGE_WAIT
+        virtual int stage(char* out) = 0;
+        // join the worker; derived classes call it first in their destructor,
+        // before anything stage() uses goes away
+        void stop();
+
+    private:
+        void worker();
+        int stage_next();
+
+        bool threaded;
+        uint64_t next_offset; // where the next block goes in the stream
+        SpscRing<StagedBlock> ring;
+        std::atomic<bool> done; // every block is in the ring
+        std::atomic<bool> stopping;
+        std::thread thread;
+};
+
+// The compressed stream of another source: its bytes cut into blocks, each
+// framed and deflated where that pays (see compress.h).
+//
+// A block that doesn't shrink is sent raw, and then the next few blocks are
+// sent raw without trying, twice as many after each miss up to
+// PIPELINE_MAX_SKIP, so input that won't compress costs little CPU.
+class CompressSource : public StagedSource {
+    public:
+        CompressSource(DataSource* raw, bool threaded = true, size_t blocks = PIPELINE_PACK_AHEAD);
+        ~CompressSource();
+        // packing starts at offset of the other source, but offsets into
+        // the compressed stream still start at 0
+        void skip_to(uint64_t offset) override;
+
+        // packing stats, only to be read once the stream is done
+        uint64_t raw_bytes;
+        uint64_t packed_bytes;
+        uint64_t deflated_blocks;
+        uint64_t skipped_blocks; // sent raw without trying
+
+    private:
+        int stage(char* out) override;
+
+        DataSource* raw;
+        uint64_t raw_offset; // next byte of raw to pack
+        int skip;            // blocks still to send raw without trying
+        int backoff;         // blocks to skip after the next miss
+        std::vector<char> scratch;
+};
+
+// The delta of another source against the server's basis file, as the ops
+// delta.h describes, once sums holds the basis block sums. If it never does
+// (no delta was agreed), reads go straight through to the other source.
+//
+// Matching needs the sums, so read_at must not be called before they are in;
+// the connection only reads once it has fetched them.
+class DeltaSource : public StagedSource {
+    public:
+        DeltaSource(DataSource* raw, const BlockSums* sums, bool threaded = true,
+                    size_t blocks = PIPELINE_PACK_AHEAD);
+        ~DeltaSource();
+        int read_at(uint64_t offset, char* buf, int len) override;
+        void release(uint64_t offset) override;
+
+        // delta stats, only to be read once the stream is done
+        uint64_t raw_bytes;
+        uint64_t literal_bytes;
+        uint64_t copied_blocks;
+
+    private:
+        int stage(char* out) override;
+        void index_sums();
+        uint32_t bucket(uint32_t weak) const { return (weak * 2654435761u) >> shift; }
+        int64_t match() const;
+        int fill();
+        int put_pending_literal(char* out, uint64_t end);
+        int put_pending_copy(char* out);
+        const char* at(uint64_t offset) const { return buf.data() + (offset - buf_start); }
+
+        DataSource* raw;
+        const BlockSums* sums;
+        bool indexed;
+        // weak sum buckets, each the first of a chain of blocks through next
+        std::vector<uint32_t> heads;
+        std::vector<uint32_t> next;
+        int shift;
+        // raw bytes from buf_start on; the window starts at pos, and the
+        // bytes from literal on before it haven't gone out in an op yet
+        std::vector<char> buf;
+        uint64_t buf_start;
+        uint64_t buf_end;
+        uint64_t literal;
+        uint64_t pos;
+        bool rolling;     // a and b hold the window's sum
+        uint32_t a, b;
+        uint32_t copy_first, copy_count; // copy op still growing
+        bool eof;
+        bool ended;       // the end op is out
+        uint32_t file_crc;
+};
+
+struct TxDatagram {
+    int len;
+    packet pack;
+};
+
+// Sends datagrams queued by the protocol thread from a thread of its own, and
+// records them to the capture if there is one. Once the queue has been empty
+// for a while the sender parks until send() wakes it, so an idle client
+// doesn't keep a core busy; with spin_us it first spins that long, as in
+// low-latency mode.
+class SendStage {
+    public:
+        SendStage(int socket_fd, const Peer& to, const Peer& local, PcapWriter* capture, uint64_t spin_us = 0,
+                  size_t slots = PIPELINE_TX_SLOTS);
+        ~SendStage();
+
+        // queue a datagram, waiting if the sender is a full ring behind
+        void send(const packet* pack, int len);
+        // send everything queued and stop the thread
+        void close();
+
+    private:
+        void sender();
+
+        int socket_fd;
+        Peer to;
+        Peer local;
+        PcapWriter* capture;
+        uint64_t spin_us;
+        SpscRing<TxDatagram> ring;
+        std::atomic<bool> stopping;
+        std::atomic<bool> parked;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::thread thread;
+};
+
+#endif
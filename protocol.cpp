@@ -0,0 +1,1525 @@
+#include "protocol.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compress.h"
+
+// ========================================================================== //
+// DATA SOURCES
+// ========================================================================== //
+
+FileSource::FileSource(std::ifstream& f) : file(f) {}
+
+int FileSource::read_at(uint64_t offset, char* buf, int len) {
+    // a short read at the end of the file leaves failbit set, which would make
+    // every later seekg fail and break retransmission of the last segment
+    file.clear();
+    file.seekg(offset);
+    file.read(buf, len);
+    return file.gcount();
+}
+
+MemorySource::MemorySource(const std::string& d) : data(d) {}
+
+int MemorySource::read_at(uint64_t offset, char* buf, int len) {
+    if (offset >= data.size()) return 0;
+    int n = std::min((size_t)len, data.size() - offset);
+    memcpy(buf, data.data() + offset, n);
+    return n;
+}
+
+// ========================================================================== //
+// CLIENT
+// ========================================================================== //
+
+ClientConn::ClientConn(DataSource* src, send_fn snd, std::ostream* tr)
+    : source(src), send(snd), trace(tr) {
+    state    = 0;
+    cid      = 0;
+    cwnd     = SPEC_INIT_CWND;
+    ssthresh = SPEC_INIT_SS_THRESH;
+    snd_una  = 0;
+    snd_nxt  = 0;
+    snd_max  = 0;
+    retransmits = 0;
+    rack_losses = 0;
+
+    lost_bytes    = 0;
+    held_bytes    = 0;
+    rack_xmit     = 0;
+    rack_end      = 0;
+    rack_rtt      = 0;
+    min_rtt       = UINT64_MAX;
+    rack_deadline = NO_DEADLINE;
+    reo_mult      = 1;
+    reo_persist   = 0;
+    una_moved     = 0;
+    in_recovery   = false;
+    recovery_end  = 0;
+
+    data_isn = 0;
+    ack_num  = 0;
+    fin_seq  = 0;
+    eof      = false;
+    last_active_time     = 0;
+    retransmit_last_time = 0;
+    time_wait_start      = 0;
+    integrity            = false;
+    crc                  = false;
+    verified             = false;
+    packed               = NULL;
+    compressed           = false;
+    token                = 0;
+    resumed_from         = 0;
+    basis                = -1;
+    sums                 = NULL;
+    mismatch             = false;
+    digest               = 0;
+    starved              = false;
+    starved_time         = 0;
+    sums_block           = 0;
+    sums_missing         = 0;
+    sums_next            = 0;
+    nonce                = 0;
+    zero_rtt             = false;
+    syn_len              = 0;
+    syn_backoff          = 1;
+    early_at             = 0;
+    early_len            = 0;
+    parity               = false;
+    fec                  = false;
+    parity_sent          = 0;
+    fec_start            = 0;
+    fec_segments         = 0;
+    fec_group            = FEC_START_GROUP;
+    fec_loss             = 0;
+    parity_in_flight     = 0;
+}
+
+void ClientConn::update_cwnd_ssthresh() {
+    if (cwnd < ssthresh) {
+        cwnd += SPEC_INIT_CWND;
+    } else {
+        cwnd += SPEC_INIT_CWND * SPEC_INIT_CWND / cwnd;
+    }
+    if (cwnd > SPEC_MAX_CWND) {
+        cwnd = SPEC_MAX_CWND;
+    }
+}
+
+void ClientConn::on_timeout() {
+    ssthresh = cwnd / 2;
+    cwnd     = SPEC_INIT_CWND;
+}
+
+uint32_t ClientConn::wire_seq(uint64_t offset) const {
+    return (data_isn + offset) % (SPEC_MAX_SEQ + 1);
+}
+
+void ClientConn::emit(packet* pack, int len, int type) {
+    send(pack, len);
+    _log("SENT ", len, " bytes");
+    printpacket(pack);
+    if (trace) output_packet(pack, cwnd, ssthresh, type, *trace);
+}
+
+void ClientConn::start(uint64_t now) {
+    state            = CLIENT_SYN_SENT;
+    last_active_time = now;
+
+    bool delta = basis >= 0 && sums;
+    int head   = (token ? RESUME_TOKEN_SIZE : 0) + (delta ? DELTA_BASIS_SIZE : 0);
+    int extra  = std::min(syn_payload.size(), (size_t)SPEC_MAX_PAYLOAD_SIZE - CRC_TRAILER_SIZE - EARLY_LENGTH_SIZE - head);
+
+    // whatever of the data is ready and fits goes along, the rest after it
+    early_len = 0;
+    early_at  = EARLY_LENGTH_SIZE + head + extra;
+    if (zero_rtt && !packed && !delta) {
+        int room  = SPEC_MAX_PAYLOAD_SIZE - (integrity ? CRC_TRAILER_SIZE : 0) - early_at;
+        early_len = std::max(source->read_at(0, syn.payload + early_at, room), 0);
+    }
+    bool early = early_len > 0;
+    if (!early) early_at -= EARLY_LENGTH_SIZE;
+
+    uint8_t ext = (integrity ? EXT_CRC : 0) | (packed ? EXT_COMPRESS : 0) | (token ? EXT_RESUME : 0) |
+                  (delta ? EXT_DELTA : 0) | (early ? EXT_EARLY : 0) | (parity ? EXT_FEC : 0);
+    encode_header(&syn.packet_head, 12345, 0, nonce, SYN, ext);
+    int at = 0;
+    if (early) {
+        uint16_t n = htons(early_len);
+        memcpy(syn.payload, &n, EARLY_LENGTH_SIZE);
+        at += EARLY_LENGTH_SIZE;
+    }
+    if (token) at += encode_u64(syn.payload + at, token);
+    if (delta) {
+        uint16_t id = htons(basis);
+        memcpy(syn.payload + at, &id, DELTA_BASIS_SIZE);
+        at += DELTA_BASIS_SIZE;
+    }
+    memcpy(syn.payload + at, syn_payload.data(), extra);
+    at += extra + early_len;
+    syn_len = integrity ? seal_crc(&syn, 12 + at) : 12 + at;
+
+    syn_backoff          = 1;
+    retransmit_last_time = now;
+    emit(&syn, syn_len, TYPE_SEND);
+}
+
+void ClientConn::on_ack(uint32_t ack_number, uint64_t now, bool data_ack) {
+    int32_t delta = seq_diff(ack_number, wire_seq(snd_una));
+    if (delta == 0 && data_ack && !scoreboard.empty()) {
+        // the server is holding something sent after the gap; with ACKs
+        // only cumulative, each of these is taken to be for the next segment
+        // after the first unACKed one not yet known to be there, unless that
+        // went out too recently to have made it
+        size_t i = 1;
+        while (i < scoreboard.size() && (scoreboard.at(i).held || scoreboard.at(i).lost)) i++;
+        if (i < scoreboard.size() && min_rtt != UINT64_MAX && now >= scoreboard.at(i).sent_us + min_rtt) {
+            SentSegment& seg = scoreboard.at(i);
+            seg.held         = true;
+            held_bytes += seg.len;
+            rack_delivered(seg, now);
+        }
+        detect_losses(now);
+        return;
+    }
+    // only ACKs for data we have actually sent move the window
+    if (delta <= 0 || (uint64_t)delta > snd_max - snd_una) return;
+
+    snd_una += delta;
+    if (snd_nxt < snd_una) snd_nxt = snd_una;
+    while (!scoreboard.empty() && scoreboard.front().offset + scoreboard.front().len <= snd_una) {
+        SentSegment& seg = scoreboard.front();
+        rack_delivered(seg, now);
+        if (seg.lost) lost_bytes -= seg.len;
+        if (seg.held) held_bytes -= seg.len;
+        scoreboard.pop();
+    }
+    // a segment rebuilt from parity can end partway through one sent
+    if (!scoreboard.empty() && scoreboard.front().offset < snd_una) {
+        SentSegment& seg = scoreboard.front();
+        int acked        = snd_una - seg.offset;
+        if (seg.lost) lost_bytes -= acked;
+        if (seg.held) held_bytes -= acked;
+        seg.offset = snd_una;
+        seg.len -= acked;
+    }
+    while (!parity_q.empty() && parity_q.front() <= snd_una) {
+        parity_in_flight -= parity_size_q.front();
+        parity_q.pop();
+        parity_size_q.pop();
+    }
+    source->release(snd_una);
+    _log("ACKED TO ", snd_una, " in flight ", snd_nxt - snd_una);
+    una_moved = now;
+    if (in_recovery && snd_una >= recovery_end) {
+        in_recovery = false;
+        if (reo_persist > 0 && --reo_persist == 0) reo_mult = 1;
+    }
+    if (!in_recovery) update_cwnd_ssthresh();
+    retransmit_last_time = now;
+    detect_losses(now);
+}
+
+// seg has reached the server, so everything sent before it should have too
+void ClientConn::rack_delivered(const SentSegment& seg, uint64_t now) {
+    if (seg.sends > 1 && min_rtt != UINT64_MAX && now < seg.sent_us + min_rtt) {
+        // too soon to be for the resend: the first copy was only late, so
+        // allow more reordering before calling a loss
+        if (min_rtt / RACK_REO_WND_DIV * (reo_mult + 1) <= rack_rtt) reo_mult++;
+        reo_persist = RACK_REO_WND_PERSIST;
+        return;
+    }
+    uint64_t rtt = now - seg.sent_us;
+    if (seg.sends == 1) min_rtt = std::min(min_rtt, rtt);
+    uint64_t end = seg.offset + seg.len;
+    if (seg.sent_us > rack_xmit || (seg.sent_us == rack_xmit && end > rack_end)) {
+        rack_xmit = seg.sent_us;
+        rack_end  = end;
+        rack_rtt  = rtt;
+    }
+}
+
+// declare lost whatever went out an RTT and a reordering window before a
+// segment that has since been delivered, and time the next one due
+void ClientConn::detect_losses(uint64_t now) {
+    rack_deadline = NO_DEADLINE;
+    if (rack_end == 0 || min_rtt == UINT64_MAX) return;
+
+    uint64_t reo_wnd = std::min(min_rtt / RACK_REO_WND_DIV * reo_mult, rack_rtt);
+    bool lost        = false;
+    for (size_t i = 0; i < scoreboard.size(); i++) {
+        SentSegment& seg = scoreboard.at(i);
+        if (seg.lost) continue;
+        // the server ACKs what it was holding one at a time once a gap
+        // fills, so a held segment is only doubted once it has been first
+        // in line for a reordering window with no ACK for it
+        if (seg.held && i > 0) continue;
+        if (seg.held && now < una_moved + reo_wnd) {
+            rack_deadline = std::min(rack_deadline, una_moved + reo_wnd);
+            continue;
+        }
+        bool before = seg.sent_us < rack_xmit || (seg.sent_us == rack_xmit && seg.offset + seg.len < rack_end);
+        if (!before) continue;
+        uint64_t due = seg.sent_us + rack_rtt + reo_wnd;
+        if (now < due) {
+            rack_deadline = std::min(rack_deadline, due);
+            continue;
+        }
+        _log("RACK LOST ", seg.offset);
+        if (seg.held) held_bytes -= seg.len;
+        seg.lost = true;
+        seg.held = false;
+        lost_bytes += seg.len;
+        rack_losses++;
+        lost = true;
+    }
+    if (lost && !in_recovery) {
+        // once per window of data, however many segments it lost
+        in_recovery  = true;
+        recovery_end = snd_max;
+        ssthresh     = std::max(cwnd / 2, SPEC_INIT_CWND);
+        cwnd         = ssthresh;
+    }
+}
+
+void ClientConn::send_data(packet* pack, uint64_t offset, int len, int type) {
+    encode_header(&pack->packet_head, wire_seq(offset), ack_num, cid, ACK, crc ? EXT_CRC : 0);
+    len += 12;
+    if (crc) len = seal_crc(pack, len);
+    emit(pack, len, type);
+}
+
+// send the first segment declared lost again; false if the source can't
+// give its bytes back yet
+bool ClientConn::resend_lost(uint64_t now) {
+    size_t i = 0;
+    while (!scoreboard.at(i).lost) i++;
+    SentSegment& seg = scoreboard.at(i);
+
+    packet pack;
+    if (source->read_at(seg.offset, pack.payload, seg.len) != seg.len) {
+        starved      = true;
+        starved_time = now;
+        return false;
+    }
+    retransmits++;
+    send_data(&pack, seg.offset, seg.len, TYPE_DUP);
+    seg.lost    = false;
+    seg.sent_us = now;
+    seg.sends++;
+    lost_bytes -= seg.len;
+    return true;
+}
+
+void ClientConn::pump(uint64_t now) {
+    while (state == CLIENT_ESTABLISHED) {
+        // bytes declared lost or held by the server have left the network;
+        // parity takes its share of the congestion window but not of the
+        // server's, which only ever holds data
+        uint64_t in_flight = snd_nxt - snd_una - lost_bytes - held_bytes;
+        if (in_flight + parity_in_flight + SPEC_MAX_PAYLOAD_SIZE > (uint64_t)cwnd) break;
+        if (lost_bytes > 0) {
+            if (!resend_lost(now)) break;
+            continue;
+        }
+        if (snd_nxt - snd_una + SPEC_MAX_PAYLOAD_SIZE > SPEC_RWND) break;
+
+        packet curr_pack;
+        int room    = fec ? fec_parity.size() : SPEC_MAX_PAYLOAD_SIZE - (crc ? CRC_TRAILER_SIZE : 0);
+        int readLen = source->read_at(snd_nxt, curr_pack.payload, room);
+        starved = readLen == SOURCE_PENDING;
+        if (starved) {
+            starved_time = now;
+            break;
+        }
+        if (readLen <= 0) {
+            // the last group gets its parity however short it is
+            if (fec && fec_segments > 0) send_parity();
+            eof = true;
+            break;
+        }
+        eof = false;
+
+        // only lost segments are sent again, so new bytes always go out in order
+        if (crc) digest = crc32c(digest, curr_pack.payload, readLen);
+        if (fec) fec_fold(fec_parity.data(), fec_parity.size(), snd_max - fec_start, curr_pack.payload, readLen);
+
+        if (scoreboard.empty()) retransmit_last_time = now;
+        send_data(&curr_pack, snd_nxt, readLen, TYPE_SEND);
+
+        scoreboard.push({snd_nxt, readLen, 1, false, false, now});
+        snd_nxt += readLen;
+        snd_max = snd_nxt;
+        if (fec && ++fec_segments >= fec_group) send_parity();
+    }
+
+    if (state == CLIENT_ESTABLISHED && eof && snd_una == snd_nxt) {
+        state                = CLIENT_FIN_SENT;
+        fin_seq              = wire_seq(snd_nxt);
+        retransmit_last_time = now;
+        send_fin(TYPE_SEND);
+    }
+}
+
+void ClientConn::send_fin(int type) {
+    packet finpack;
+    encode_header(&finpack.packet_head, fin_seq, 0, cid, FIN, crc ? EXT_DIGEST | EXT_CRC : 0);
+    if (!crc) {
+        emit(&finpack, 12, type);
+        return;
+    }
+    uint32_t sum = htonl(digest);
+    memcpy(finpack.payload, &sum, sizeof(sum));
+    emit(&finpack, seal_crc(&finpack, 12 + sizeof(sum)), type);
+}
+
+// the parity of the group sent since the last one, which starts the next
+void ClientConn::send_parity() {
+    packet pack;
+    uint64_t group = snd_max - fec_start;
+    int width      = std::min<uint64_t>(fec_parity.size(), group);
+    encode_header(&pack.packet_head, wire_seq(fec_start), ack_num, cid, ACK, EXT_FEC | EXT_CRC);
+    uint16_t n = htons(group);
+    memcpy(pack.payload, &n, FEC_HEAD_SIZE);
+    memcpy(pack.payload + FEC_HEAD_SIZE, fec_parity.data(), width);
+    emit(&pack, seal_crc(&pack, 12 + FEC_HEAD_SIZE + width), TYPE_SEND);
+
+    parity_sent++;
+    parity_q.push(snd_max);
+    parity_size_q.push(FEC_HEAD_SIZE + width);
+    parity_in_flight += FEC_HEAD_SIZE + width;
+
+    fec_start    = snd_max;
+    fec_segments = 0;
+    fec_group    = fec_group_size(fec_loss);
+    memset(fec_parity.data(), 0, fec_parity.size());
+}
+
+// the server's count of what it was missing of a group when the parity came
+void ClientConn::on_parity_reply(const packet* pack, int len) {
+    uint16_t group, missing;
+    memcpy(&group, pack->payload, FEC_HEAD_SIZE);
+    memcpy(&missing, pack->payload + FEC_HEAD_SIZE, FEC_HEAD_SIZE);
+    group   = ntohs(group);
+    missing = ntohs(missing);
+    if (group == 0 || missing > group) return;
+    fec_loss += ((double)missing / group - fec_loss) / FEC_LOSS_GAIN;
+}
+
+// keep up to CLIENT_SUMS_WINDOW chunks of block sums asked for
+void ClientConn::ask_sums(uint64_t now) {
+    while (sums_asked.size() < CLIENT_SUMS_WINDOW && sums_next < sums_got.size()) {
+        if (!sums_got[sums_next]) {
+            send_sums_request(sums_next, TYPE_SEND);
+            sums_asked[sums_next] = now;
+        }
+        sums_next++;
+    }
+}
+
+void ClientConn::send_sums_request(uint32_t chunk, int type) {
+    packet request;
+    encode_header(&request.packet_head, wire_seq(snd_nxt), ack_num, cid, ACK, EXT_DELTA | (crc ? EXT_CRC : 0));
+    int len = 12 + encode_u32(request.payload, chunk);
+    emit(&request, crc ? seal_crc(&request, len) : len, type);
+}
+
+void ClientConn::on_sums(const packet* pack, int len, uint64_t now) {
+    fields in = decode_header(&pack->packet_head);
+    if (!(in.ext & EXT_DELTA) || len < 12 + 4) {
+        if (trace) output_packet(pack, cwnd, ssthresh, TYPE_DROP, *trace);
+        return;
+    }
+    if (trace) output_packet(pack, cwnd, ssthresh, TYPE_RECV, *trace);
+
+    uint32_t chunk = decode_u32(pack->payload);
+    if (chunk >= sums_got.size() || sums_got[chunk]) return;
+    uint64_t first = (uint64_t)chunk * DELTA_SUMS_PER_REPLY;
+    uint64_t count = std::min<uint64_t>(DELTA_SUMS_PER_REPLY, sums->weak.size() - first);
+    if ((uint64_t)len < 12 + 4 + count * DELTA_SUM_SIZE) return;
+    const char* p = pack->payload + 4;
+    for (uint64_t i = first; i < first + count; i++, p += DELTA_SUM_SIZE) {
+        sums->weak[i]   = decode_u32(p);
+        sums->strong[i] = decode_u32(p + 4);
+    }
+    sums_got[chunk] = true;
+    sums_asked.erase(chunk);
+    if (--sums_missing > 0) {
+        ask_sums(now);
+        return;
+    }
+
+    _log("GOT ", sums->weak.size(), " BLOCK SUMS");
+    sums->block_size     = sums_block;
+    state                = CLIENT_ESTABLISHED;
+    retransmit_last_time = now;
+    pump(now);
+}
+
+void ClientConn::on_packet(const packet* pack, int len, uint64_t now) {
+    if (finished() || len < 12) return;
+    last_active_time = now;
+
+    fields in = decode_header(&pack->packet_head);
+    printpacket(pack);
+
+    if (state == CLIENT_SYN_SENT) {
+        if (in.flags != SYNACK) {
+            if (trace) output_packet(pack, cwnd, ssthresh, TYPE_DROP, *trace);
+            return;
+        }
+        // having asked for checks, a SYNACK without them or failing them
+        // was damaged on the way, and the SYN going again brings another
+        if (integrity && (!(in.ext & EXT_CRC) || !check_crc(pack, len))) {
+            if (trace) output_packet(pack, cwnd, ssthresh, TYPE_DROP, *trace);
+            return;
+        }
+        if (integrity) len -= CRC_TRAILER_SIZE;
+        if (trace) output_packet(pack, cwnd, ssthresh, TYPE_RECV, *trace);
+        cid        = in.cid;
+        ack_num    = in.seq + 1;
+        crc        = integrity;
+        compressed = packed && (in.ext & EXT_COMPRESS);
+        state      = CLIENT_ESTABLISHED;
+        if (compressed) source = packed;
+
+        const char* info = pack->payload;
+        int info_len     = len - 12;
+        if ((in.ext & EXT_RESUME) && info_len >= RESUME_TOKEN_SIZE) {
+            if (token) resumed_from = decode_u64(info);
+            info += RESUME_TOKEN_SIZE;
+            info_len -= RESUME_TOKEN_SIZE;
+        }
+        if (resumed_from > 0) {
+            _log("RESUMING AT ", resumed_from);
+            // a compressed stream starts over from the resume point, but
+            // offsets into the file just carry on from it
+            source->skip_to(resumed_from);
+            if (!compressed) {
+                snd_una = resumed_from;
+                snd_nxt = resumed_from;
+                snd_max = resumed_from;
+            }
+        } else if (early_len > 0 && seq_diff(in.ack, 12345 + 1) == early_len) {
+            // the server kept what came with the SYN
+            _log("EARLY DATA TAKEN ", early_len);
+            snd_una = early_len;
+            snd_nxt = early_len;
+            snd_max = early_len;
+            if (crc) digest = crc32c(digest, syn.payload + early_at, early_len);
+            source->release(early_len);
+        }
+        // the server expects the first byte sent next whatever offset it is
+        data_isn = (in.ack + SPEC_MAX_SEQ + 1 - snd_una % (SPEC_MAX_SEQ + 1)) % (SPEC_MAX_SEQ + 1);
+
+        fec = parity && (in.ext & EXT_FEC);
+        if (fec) {
+            // a parity segment is as wide as the widest data segment, and
+            // always checked, as a bad one would rebuild bad data
+            fec_parity.assign(SPEC_MAX_PAYLOAD_SIZE - CRC_TRAILER_SIZE - FEC_HEAD_SIZE, 0);
+            fec_start = snd_max;
+        }
+
+        // a delta needs every basis block sum before the first byte
+        if (basis >= 0 && sums && (in.ext & EXT_DELTA) && info_len >= DELTA_INFO_SIZE) {
+            uint64_t basis_size = decode_u64(info);
+            uint32_t block      = decode_u32(info + 8);
+            uint32_t blocks     = decode_u32(info + 12);
+            if (block >= DELTA_MIN_BLOCK && block <= DELTA_MAX_BLOCK && blocks > 0 &&
+                (uint64_t)block * blocks <= basis_size) {
+                sums->basis_size = basis_size;
+                sums->weak.assign(blocks, 0);
+                sums->strong.assign(blocks, 0);
+                sums_block   = block;
+                sums_missing = (blocks + DELTA_SUMS_PER_REPLY - 1) / DELTA_SUMS_PER_REPLY;
+                sums_got.assign(sums_missing, false);
+                state = CLIENT_SUMS;
+                ask_sums(now);
+                return;
+            }
+        }
+        pump(now);
+    } else if (in.flags & SYN) {
+        // the answer to a SYN sent again, which we already have
+        if (trace) output_packet(pack, cwnd, ssthresh, TYPE_DROP, *trace);
+    } else if (state == CLIENT_SUMS) {
+        on_sums(pack, len, now);
+    } else if (state == CLIENT_ESTABLISHED) {
+        if (trace) output_packet(pack, cwnd, ssthresh, TYPE_RECV, *trace);
+        if (fec && (in.ext & EXT_FEC) && len >= 12 + 2 * FEC_HEAD_SIZE) on_parity_reply(pack, len);
+        if (in.flags & ACK) on_ack(in.ack, now, !(in.ext & EXT_FEC));
+        pump(now);
+    } else if (state == CLIENT_FIN_SENT) {
+        if (trace) output_packet(pack, cwnd, ssthresh, TYPE_RECV, *trace);
+        if (in.flags != FINACK || in.ack != fin_seq + 1) return;
+        verified = crc && (in.ext & EXT_DIGEST);
+        mismatch = in.ext & EXT_DIGEST_BAD;
+
+        packet finalack;
+        encode_header(&finalack.packet_head, in.ack, in.seq + 1, in.cid, ACK);
+        emit(&finalack, 12, TYPE_SEND);
+
+        state           = CLIENT_TIME_WAIT;
+        time_wait_start = now;
+    } else if (state == CLIENT_TIME_WAIT) {
+        if (!(in.flags & FIN)) {
+            if (trace) output_packet(pack, cwnd, ssthresh, TYPE_DROP, *trace);
+            return;
+        }
+        if (trace) output_packet(pack, cwnd, ssthresh, TYPE_RECV, *trace);
+
+        packet newack;
+        encode_header(&newack.packet_head, fin_seq + 1, in.seq + 1, cid, ACK);
+        emit(&newack, 12, TYPE_SEND);
+    }
+}
+
+void ClientConn::on_tick(uint64_t now) {
+    if (finished()) return;
+
+    if (state == CLIENT_TIME_WAIT) {
+        if (now >= time_wait_start + SPEC_TIME_WAIT_US) state = CLIENT_DONE;
+        return;
+    }
+    if (now > last_active_time + SPEC_IDLE_TIMEOUT_US) {
+        _log("10 second timeout");
+        state = CLIENT_FAILED;
+        return;
+    }
+
+    if (state == CLIENT_SYN_SENT && now >= retransmit_last_time + SPEC_RTO_US * syn_backoff) {
+        _log("SYN again");
+        retransmits++;
+        retransmit_last_time = now;
+        syn_backoff          = std::min(syn_backoff * 2, CLIENT_SYN_MAX_BACKOFF);
+        emit(&syn, syn_len, TYPE_DUP);
+    }
+
+    if (state == CLIENT_ESTABLISHED && starved && now >= starved_time + CLIENT_STARVED_POLL_US) pump(now);
+
+    if (state == CLIENT_SUMS) {
+        for (auto& [chunk, asked] : sums_asked) {
+            if (now < asked + SPEC_RTO_US) continue;
+            retransmits++;
+            asked = now;
+            send_sums_request(chunk, TYPE_DUP);
+        }
+    }
+
+    if (state == CLIENT_ESTABLISHED && now >= rack_deadline) {
+        detect_losses(now);
+        pump(now);
+    }
+
+    if (state == CLIENT_ESTABLISHED && !scoreboard.empty() && now >= retransmit_last_time + SPEC_RTO_US) {
+        // nothing has been ACKed for an RTO: everything still out is lost,
+        // and goes again from the first unACKed byte
+        _log("RTO at ", snd_una);
+        for (size_t i = 0; i < scoreboard.size(); i++) {
+            SentSegment& seg = scoreboard.at(i);
+            if (!seg.lost) lost_bytes += seg.len;
+            if (seg.held) held_bytes -= seg.len;
+            seg.lost = true;
+            seg.held = false;
+        }
+        rack_deadline = NO_DEADLINE;
+        // parity sent before the timeout is given up on along with the data
+        while (!parity_q.empty()) {
+            parity_q.pop();
+            parity_size_q.pop();
+        }
+        parity_in_flight = 0;
+        on_timeout();
+        in_recovery          = false;
+        retransmit_last_time = now;
+        pump(now);
+    } else if (state == CLIENT_FIN_SENT && now >= retransmit_last_time + SPEC_RTO_US) {
+        retransmits++;
+        retransmit_last_time = now;
+        send_fin(TYPE_DUP);
+    }
+}
+
+uint64_t ClientConn::next_deadline() const {
+    if (finished()) return NO_DEADLINE;
+    if (state == CLIENT_TIME_WAIT) return time_wait_start + SPEC_TIME_WAIT_US;
+
+    uint64_t deadline = last_active_time + SPEC_IDLE_TIMEOUT_US + 1;
+    if (state == CLIENT_SYN_SENT) deadline = std::min(deadline, retransmit_last_time + SPEC_RTO_US * syn_backoff);
+    if ((state == CLIENT_ESTABLISHED && !scoreboard.empty()) || state == CLIENT_FIN_SENT)
+        deadline = std::min(deadline, retransmit_last_time + SPEC_RTO_US);
+    if (state == CLIENT_ESTABLISHED) deadline = std::min(deadline, rack_deadline);
+    if (state == CLIENT_ESTABLISHED && starved)
+        deadline = std::min(deadline, starved_time + CLIENT_STARVED_POLL_US);
+    for (auto const& [chunk, asked] : sums_asked) deadline = std::min(deadline, asked + SPEC_RTO_US);
+    return deadline;
+}
+
+// ========================================================================== //
+// SERVER
+// ========================================================================== //
+
+ServerCore::ServerCore(open_fn open, reply_fn snd, std::ostream* tr)
+    : open_file(open), send(snd), trace(tr), unpacked(COMPRESS_BLOCK_SIZE), basis_block(DELTA_MAX_BLOCK) {
+    num_connections   = 0;
+    total_written     = 0;
+    crc_failures      = 0;
+    digest_mismatches = 0;
+    journal           = NULL;
+    resumed           = 0;
+    fec_recovered     = 0;
+    durable           = NULL;
+    ingest_rate       = 0;
+    ingest_drops      = false;
+    paced_drops       = 0;
+    last_sync         = 0;
+    spare             = pool.acquire();
+}
+
+packet* ServerCore::rx_buffer() {
+    return pool.get(spare);
+}
+
+void ServerCore::drop_buffered(uint16_t cid) {
+    auto held = out_of_order.find(cid);
+    if (held == out_of_order.end()) return;
+    for (auto const& [seq, handle] : held->second) pool.release(handle);
+    out_of_order.erase(held);
+}
+
+void ServerCore::reply(const Peer& to, uint32_t seq, uint32_t ack, uint16_t cid, uint8_t flags, int type, uint8_t ext,
+                       const char* payload, int payload_len) {
+    packet reply;
+    encode_header(&reply.packet_head, seq, ack, cid, flags, ext);
+    memcpy(reply.payload, payload, payload_len);
+    int len = 12 + payload_len;
+    // a SYNACK agreeing to checks is checked itself, so a flipped bit
+    // can't turn them off on the client's side
+    if (flags == SYNACK && (ext & EXT_CRC)) len = seal_crc(&reply, len);
+
+    send(to, &reply, len);
+    _log("SENT PACKET:");
+    if (trace) output_packet_server(&reply, type, *trace);
+}
+
+// pick the id for a new connection, skipping ids still in use, ids whose
+// file is still being written (a stripe writes into its first stripe's file,
+// which outlives that stripe's connection) or read as a basis (or about to
+// be, avoid), and then ids whose file an unfinished upload may still resume
+// into unless there is no other; false if every id is in use
+bool ServerCore::claim_id(int avoid) {
+    auto taken = [&](uint16_t id) {
+        if (id == avoid) return true;
+        for (auto const& [key, conn] : database)
+            if ((conn.basis != NULL && conn.basis_id == id) || conn.file_id == id) return true;
+        for (auto const& [key, out] : striped)
+            if (out.file_id == id) return true;
+        return false;
+    };
+    for (int pass = 0; pass < 2; pass++) {
+        for (int tries = 0; tries < 11; tries++) {
+            num_connections++;
+            num_connections %= 11;
+            if (database.count(num_connections) > 0 || taken(num_connections)) continue;
+            if (pass == 0 && journal && journal->holds(num_connections)) continue;
+            return true;
+        }
+    }
+    return false;
+}
+
+// close whatever connection was still uploading the same thing, so the new
+// one carries on from where it got to
+void ServerCore::take_over(uint64_t token, uint16_t index, uint64_t now) {
+    for (auto it = database.begin(); it != database.end();) {
+        Store& old = it->second;
+        if (old.token != token || old.index != index || old.state != STATE_ACTIVE) {
+            ++it;
+            continue;
+        }
+        journal_progress(old);
+        close_output(old, false, now);
+        drop_buffered(it->first);
+        it = database.erase(it);
+    }
+}
+
+void ServerCore::journal_progress(Store& conn) {
+    if (conn.token == 0 || conn.committed == conn.journaled) return;
+    journal->record(conn.token, conn.index, {conn.file_id, conn.committed});
+    conn.journaled = conn.committed;
+}
+
+int ServerCore::write_at(Store& conn, const char* data, int len) {
+    // stripes share the file, so each write goes where its stripe left off
+    if (conn.transfer != 0) fseeko(conn.writefd, conn.file_pos, SEEK_SET);
+    int written = fwrite(data, sizeof(char), len, conn.writefd);
+    fflush(conn.writefd);
+    conn.file_pos += written;
+    return written;
+}
+
+// open N.file as the basis of a delta and sum its blocks; false if there is
+// nothing to diff against, and the upload goes as it is
+bool ServerCore::open_basis(Store& conn, uint16_t basis) {
+    if (basis >= 11) return false;
+    // a file still being written would change under the copies
+    for (auto const& [key, other] : database)
+        if (other.writefd != NULL && other.file_id == basis) return false;
+    for (auto const& [key, out] : striped)
+        if (out.file_id == basis) return false;
+
+    FILE* file = open_file(basis, OPEN_BASIS);
+    if (file == NULL) return false;
+    struct stat st;
+    auto sums = std::make_shared<BlockSums>();
+    if (fstat(fileno(file), &st) == 0) {
+        uint32_t block = delta_block_size(st.st_size);
+        if ((uint64_t)st.st_size >= block && compute_block_sums(fileno(file), st.st_size, block, sums.get())) {
+            conn.basis    = file;
+            conn.basis_id = basis;
+            conn.sums     = sums;
+            return true;
+        }
+    }
+    fclose(file);
+    return false;
+}
+
+// the file's own bytes, or the ops to rebuild it from its basis
+int ServerCore::deliver(Store& conn, const char* data, int len) {
+    return conn.basis ? apply_delta(conn, data, len) : write_at(conn, data, len);
+}
+
+// carry out every whole op the data completes, returns bytes written
+int ServerCore::apply_delta(Store& conn, const char* data, int len) {
+    if (conn.delta_failed) return 0;
+    conn.ops.append(data, len);
+
+    const BlockSums& sums = *conn.sums;
+    const char* failure   = NULL;
+    int written           = 0;
+    size_t used           = 0;
+    while (failure == NULL && used < conn.ops.size()) {
+        const char* op = conn.ops.data() + used;
+        size_t have    = conn.ops.size() - used;
+        if (conn.delta_ended) {
+            failure = "has data after the end of its delta";
+        } else if (op[0] == DELTA_OP_COPY) {
+            if (have < DELTA_COPY_SIZE) break;
+            uint64_t first = decode_u32(op + 1);
+            uint64_t count = decode_u32(op + 5);
+            if (count == 0 || first + count > sums.weak.size()) {
+                failure = "has a delta copying blocks its basis doesn't have";
+                break;
+            }
+            for (uint64_t i = first; i < first + count; i++) {
+                ssize_t n = pread(fileno(conn.basis), basis_block.data(), sums.block_size, i * sums.block_size);
+                if (n != (ssize_t)sums.block_size) {
+                    failure = "could not read its basis";
+                    break;
+                }
+                conn.rebuilt = crc32c(conn.rebuilt, basis_block.data(), n);
+                written += write_at(conn, basis_block.data(), n);
+            }
+            used += DELTA_COPY_SIZE;
+        } else if (op[0] == DELTA_OP_LITERAL) {
+            if (have < DELTA_LITERAL_HEAD) break;
+            uint32_t n = decode_u32(op + 1);
+            if (n == 0 || n > DELTA_MAX_LITERAL) {
+                failure = "has a bad delta";
+                break;
+            }
+            if (have < DELTA_LITERAL_HEAD + n) break;
+            conn.rebuilt = crc32c(conn.rebuilt, op + DELTA_LITERAL_HEAD, n);
+            written += write_at(conn, op + DELTA_LITERAL_HEAD, n);
+            used += DELTA_LITERAL_HEAD + n;
+        } else if (op[0] == DELTA_OP_END) {
+            if (have < DELTA_END_SIZE) break;
+            if (decode_u32(op + 1) != conn.rebuilt) {
+                digest_mismatches++;
+                failure = "does not match the client's file after the delta";
+                break;
+            }
+            conn.delta_ended = true;
+            used += DELTA_END_SIZE;
+        } else {
+            failure = "has a bad delta";
+        }
+    }
+    if (failure != NULL) {
+        fprintf(stderr, "ERROR: %d.file %s.\n", conn.file_id, failure);
+        conn.delta_failed = true;
+        conn.ops.clear();
+        return written;
+    }
+    conn.ops.erase(0, used);
+    return written;
+}
+
+// write out every whole frame the data completes, returns bytes written
+int ServerCore::unpack(Store& conn, const char* data, int len) {
+    if (conn.unpack_failed) return 0;
+    conn.frames.append(data, len);
+
+    int written = 0;
+    size_t used = 0;
+    while (conn.frames.size() - used >= COMPRESS_FRAME_SIZE) {
+        const char* frame = conn.frames.data() + used;
+        uint32_t raw_len, stored_len;
+        int n = -1;
+        if (unpack_header(frame, &raw_len, &stored_len)) {
+            if (conn.frames.size() - used < COMPRESS_FRAME_SIZE + stored_len) break;
+            n = unpack_block(frame, unpacked.data());
+        }
+        if (n < 0) {
+            fprintf(stderr, "ERROR: %d.file has a bad compressed block.\n", conn.file_id);
+            conn.unpack_failed = true;
+            conn.frames.clear();
+            return written;
+        }
+        written += deliver(conn, unpacked.data(), n);
+        used += COMPRESS_FRAME_SIZE + stored_len;
+    }
+    conn.frames.erase(0, used);
+    return written;
+}
+
+void ServerCore::write_payload(uint16_t cid, const char* data, int len) {
+    Store& conn = database.at(cid);
+    // with no ACK held back, everything before this has been ACKed
+    if (conn.paced.empty()) conn.acked = conn.seq;
+    conn.seq    = (conn.seq + len) % (SPEC_MAX_SEQ + 1);
+    int written = conn.compress ? unpack(conn, data, len) : deliver(conn, data, len);
+    conn.unpaced += std::max(len, written);
+    if (conn.crc) conn.digest = crc32c(conn.digest, data, len);
+    for (int done = 0; conn.fec && done < len;) {
+        // kept for parity to rebuild a later gap with
+        size_t at = (conn.stream_pos + done) & (FEC_HISTORY - 1);
+        int n     = std::min<size_t>(len - done, FEC_HISTORY - at);
+        memcpy(conn.history.data() + at, data + done, n);
+        done += n;
+    }
+    conn.stream_pos += len;
+    total_written += written;
+    conn.committed += written;
+    if (conn.committed - conn.journaled >= SERVER_JOURNAL_BYTES) journal_progress(conn);
+    _log("write = ", written);
+}
+
+void ServerCore::close_output(Store& conn, bool complete, uint64_t now) {
+    if (conn.basis != NULL) {
+        fclose(conn.basis);
+        conn.basis = NULL;
+    }
+    if (conn.writefd == NULL) return;
+    if (conn.transfer == 0) {
+        fflush(conn.writefd);
+        fclose(conn.writefd);
+    } else {
+        auto shared       = striped.find(conn.transfer);
+        SharedOutput& out = shared->second;
+        out.open--;
+        if (complete) out.done++;
+        out.last_time = now;
+        if (out.done >= out.stripes) {
+            // kept until now so finished stripes needn't be sent again
+            for (uint16_t i = 0; out.token != 0 && i < out.stripes; i++) journal->forget(out.token, i);
+            fclose(out.file);
+            striped.erase(shared);
+        }
+    }
+    conn.writefd = NULL;
+}
+
+void ServerCore::on_packet(const packet* pack, int len, const Peer& from, uint64_t now) {
+    fields in             = decode_header(&pack->packet_head);
+    uint32_t incoming_seq = in.seq;
+    uint16_t cid          = in.cid;
+    uint8_t incoming_flag = in.flags;
+
+    printpacket(pack);
+    if (len < 12 || incoming_flag > 7) {
+        if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+        return;
+    }
+
+    // new connection (incoming SYN)
+    if (incoming_flag == SYN) {
+        if (in.ext & EXT_CRC) {
+            if (!check_crc(pack, len)) {
+                crc_failures++;
+                if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+                return;
+            }
+            len -= CRC_TRAILER_SIZE;
+        } else if (len >= 12 + CRC_TRAILER_SIZE) {
+            // a flipped bit that cleared EXT_CRC would have the upload run
+            // unchecked; such a SYN's trailer still matches with the bit back
+            packet asked;
+            memcpy(&asked, pack, len);
+            asked.packet_head.empty |= EXT_CRC;
+            if (check_crc(&asked, len)) {
+                crc_failures++;
+                if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+                return;
+            }
+        }
+
+        // a SYN sent again because its SYNACK was slow or lost gets the
+        // same SYNACK again, rather than a second connection
+        for (auto const& [id, conn] : database) {
+            if (in.cid == 0 || conn.syn_nonce != in.cid || conn.syn_seq != incoming_seq || !same_peer(conn.peer, from))
+                continue;
+            if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+            reply(from, 4321, conn.synack_ack, id, SYNACK, TYPE_DUP, conn.synack_ext, conn.synack.data(),
+                  conn.synack.size());
+            return;
+        }
+
+        // the length of the early data, a resume token, a basis, then maybe
+        // a stripe, and the early data last
+        const char* options = pack->payload;
+        int options_len     = len - 12;
+        int early_len       = 0;
+        if (in.ext & EXT_EARLY) {
+            uint16_t n = 0;
+            if (options_len >= EARLY_LENGTH_SIZE) memcpy(&n, options, EARLY_LENGTH_SIZE);
+            early_len = ntohs(n);
+            if (options_len < EARLY_LENGTH_SIZE + early_len) {
+                if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+                return;
+            }
+            options += EARLY_LENGTH_SIZE;
+            options_len -= EARLY_LENGTH_SIZE + early_len;
+        }
+        const char* early = options + options_len;
+        uint64_t token    = 0;
+        if (in.ext & EXT_RESUME) {
+            if (options_len < RESUME_TOKEN_SIZE) {
+                if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+                return;
+            }
+            token = decode_u64(options);
+            options += RESUME_TOKEN_SIZE;
+            options_len -= RESUME_TOKEN_SIZE;
+        }
+        int basis = -1;
+        if (in.ext & EXT_DELTA) {
+            if (options_len < DELTA_BASIS_SIZE) {
+                if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+                return;
+            }
+            uint16_t id;
+            memcpy(&id, options, DELTA_BASIS_SIZE);
+            basis = ntohs(id);
+            options += DELTA_BASIS_SIZE;
+            options_len -= DELTA_BASIS_SIZE;
+        }
+        stripe info;
+        bool is_stripe = decode_stripe(options, options_len, &info);
+        uint16_t index = is_stripe ? info.index : 0;
+        // a delta's ops aren't offsets into the file, so it can't resume,
+        // and a stripe's slice of the file has no basis to match
+        if (journal == NULL || basis >= 0) token = 0;
+        if (is_stripe) basis = -1;
+
+        // a client retrying an upload replaces its last connection
+        if (token != 0) take_over(token, index, now);
+
+        if (!claim_id(basis)) {
+            if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+            return;
+        }
+
+        drop_buffered(num_connections);
+
+        // how far this upload got before, and which file it was going into;
+        // a stripe that never connected goes where its siblings went
+        ResumePoint point = {num_connections, 0};
+        bool reopen       = token != 0 && journal->find(token, index, &point);
+        for (uint16_t i = 0; token != 0 && !reopen && is_stripe && i < info.count; i++) {
+            ResumePoint sibling;
+            if (journal->find(token, i, &sibling)) {
+                point.file_id = sibling.file_id;
+                reopen        = true;
+            }
+        }
+
+        // the first stripe of a striped upload to connect names its file
+        auto shared    = is_stripe ? striped.find(info.transfer_id) : striped.end();
+        FILE* write_fd = NULL;
+        if (shared != striped.end()) {
+            write_fd      = shared->second.file;
+            point.file_id = shared->second.file_id;
+        } else if (reopen) {
+            write_fd = open_file(point.file_id, OPEN_RESUME);
+            // the file has gone, so the upload has to start over
+            if (write_fd == NULL) point = {num_connections, 0};
+        }
+        if (write_fd == NULL) {
+            if (journal) journal->forget_file(num_connections);
+            write_fd = open_file(num_connections, OPEN_NEW);
+        }
+        _log("WRITEFD = ", write_fd);
+        if (write_fd == NULL) {
+            if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+            return;
+        }
+        if (trace) output_packet_server(pack, TYPE_RECV, *trace);
+
+        Store temp(incoming_seq + 1, 0, now, write_fd, STATE_ACTIVE);
+        temp.peer      = from;
+        temp.crc       = in.ext & EXT_CRC;
+        temp.compress  = in.ext & EXT_COMPRESS;
+        temp.file_id   = point.file_id;
+        temp.token     = token;
+        temp.index     = index;
+        temp.committed = point.committed;
+        temp.journaled = point.committed;
+        temp.file_pos  = point.committed;
+        if (is_stripe) {
+            if (shared == striped.end()) {
+                SharedOutput out = {write_fd, point.file_id, info.count, 0, 0, now, token};
+                shared           = striped.emplace(info.transfer_id, out).first;
+            }
+            shared->second.open++;
+            temp.transfer = info.transfer_id;
+            temp.file_pos += info.offset;
+        } else if (point.committed > 0) {
+            fseeko(write_fd, point.committed, SEEK_SET);
+        }
+        if (basis >= 0) open_basis(temp, basis);
+        temp.fec                  = in.ext & EXT_FEC;
+        temp.syn_nonce            = in.cid;
+        temp.syn_seq              = incoming_seq;
+        database[num_connections] = temp;
+        Store& conn               = database[num_connections];
+        if (conn.fec) conn.history.assign(FEC_HISTORY, 0);
+
+        // early data counts if it is where the upload starts and the bytes
+        // are the file's own; otherwise the client sends it again
+        if (early_len > 0 && point.committed == 0 && !conn.compress && conn.basis == NULL)
+            write_payload(num_connections, early, early_len);
+
+        uint8_t agreed = (conn.crc ? EXT_CRC : 0) | (conn.compress ? EXT_COMPRESS : 0) | (conn.fec ? EXT_FEC : 0);
+        char synack[RESUME_TOKEN_SIZE + DELTA_INFO_SIZE];
+        int synack_len = 0;
+        if (token != 0) {
+            agreed |= EXT_RESUME;
+            synack_len += encode_u64(synack, point.committed);
+            journal->record(token, index, point);
+            if (point.committed > 0) resumed++;
+        }
+        if (conn.basis != NULL) {
+            agreed |= EXT_DELTA;
+            synack_len += encode_u64(synack + synack_len, conn.sums->basis_size);
+            synack_len += encode_u32(synack + synack_len, conn.sums->block_size);
+            synack_len += encode_u32(synack + synack_len, conn.sums->weak.size());
+        }
+        conn.synack_ext = agreed;
+        conn.synack_ack = conn.seq;
+        conn.synack.assign(synack, synack_len);
+        reply(from, 4321, conn.seq, num_connections, SYNACK, TYPE_SEND, agreed, synack, synack_len);
+        return;
+    }
+
+    auto found = database.find(cid);
+    if (found == database.end()) {
+        if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+        return;
+    }
+    Store& conn = found->second;
+
+    // on a checked connection every payload, and the FIN with its digest, has
+    // to come with a good trailer, which is then left off everything below
+    if (conn.crc && (len > 12 || incoming_flag == FIN)) {
+        if (!(in.ext & EXT_CRC) || !check_crc(pack, len)) {
+            crc_failures++;
+            if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+            return;
+        }
+        len -= CRC_TRAILER_SIZE;
+    }
+    conn.peer = from;
+
+    // a request for a chunk of the basis block sums, outside the data
+    if (in.ext & EXT_DELTA) {
+        uint32_t chunk = len >= 12 + 4 ? decode_u32(pack->payload) : UINT32_MAX;
+        uint64_t first = (uint64_t)chunk * DELTA_SUMS_PER_REPLY;
+        if (!conn.sums || first >= conn.sums->weak.size()) {
+            if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+            return;
+        }
+        if (trace) output_packet_server(pack, TYPE_RECV, *trace);
+        conn.last_time = now;
+
+        char sums[SPEC_MAX_PAYLOAD_SIZE];
+        int n         = encode_u32(sums, chunk);
+        uint64_t last = std::min<uint64_t>(first + DELTA_SUMS_PER_REPLY, conn.sums->weak.size());
+        for (uint64_t i = first; i < last; i++) {
+            n += encode_u32(sums + n, conn.sums->weak[i]);
+            n += encode_u32(sums + n, conn.sums->strong[i]);
+        }
+        reply(from, conn.ack, advertised(conn), cid, ACK, TYPE_SEND, EXT_DELTA, sums, n);
+        return;
+    }
+
+    if (in.ext & EXT_FEC) {
+        if (!conn.crc && (!(in.ext & EXT_CRC) || !check_crc(pack, len))) {
+            crc_failures++;
+            if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+            return;
+        }
+        if (!conn.crc) len -= CRC_TRAILER_SIZE;
+        if (!conn.fec || conn.state == STATE_FIN || len <= 12 + FEC_HEAD_SIZE) {
+            if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+            return;
+        }
+        if (trace) output_packet_server(pack, TYPE_RECV, *trace);
+        conn.last_time = now;
+        take_parity(cid, pack, len, from, now);
+        return;
+    }
+
+    if (seq_diff(incoming_seq, conn.seq) < 0) {
+        if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+        _log("current expected: ", conn.seq);
+        reply(from, conn.ack, advertised(conn), cid, ACK, TYPE_DUP);
+        return;
+    }
+
+    // with ingest_drops, a connection that has run this far over its share
+    // of the ingest budget loses a datagram, so its client halves its window. Only one
+    // goes for each longest delay, which is a loss signal the client gets
+    // over from without an RTO, and never one that fills a gap, which would
+    // leave it nothing but the RTO.
+    auto held = out_of_order.find(cid);
+    bool gap  = incoming_seq == conn.seq && held != out_of_order.end() && !held->second.empty();
+    if (ingest_rate > 0 && ingest_drops && len > 12 && incoming_flag != FIN && !gap && conn.pace_at > now + SERVER_MAX_ACK_DELAY_US &&
+        now >= conn.paced_drop + SERVER_MAX_ACK_DELAY_US) {
+        conn.paced_drop = now;
+        paced_drops++;
+        if (trace) output_packet_server(pack, TYPE_DROP, *trace);
+        return;
+    }
+
+    if (trace) output_packet_server(pack, TYPE_RECV, *trace);
+    conn.last_time = now;
+
+    if (incoming_flag == FIN) {
+        // a retransmitted FIN only needs the FINACK again
+        if (conn.state != STATE_FIN) {
+            conn.state = STATE_FIN;
+            if (conn.crc) {
+                uint32_t sum = 0;
+                if (len >= 12 + (int)sizeof(sum)) memcpy(&sum, pack->payload, sizeof(sum));
+                bool match   = (in.ext & EXT_DIGEST) && len >= 12 + (int)sizeof(sum) && ntohl(sum) == conn.digest;
+                conn.fin_ext = match ? EXT_DIGEST : EXT_DIGEST_BAD;
+                if (!match) {
+                    digest_mismatches++;
+                    fprintf(stderr, "ERROR: %d.file does not match the client's digest.\n", conn.file_id);
+                }
+            }
+            if (conn.compress && !conn.frames.empty() && !conn.unpack_failed)
+                fprintf(stderr, "ERROR: %d.file ends partway through a compressed block.\n", conn.file_id);
+            if (conn.basis != NULL && !conn.delta_ended) {
+                if (!conn.delta_failed) fprintf(stderr, "ERROR: %d.file ends partway through its delta.\n", conn.file_id);
+                conn.fin_ext = EXT_DIGEST_BAD;
+            }
+            if (durable && conn.writefd != NULL) {
+                // the FINACK waits until the file is on disk
+                fflush(conn.writefd);
+                conn.syncing = ++last_sync;
+                conn.fin_seq = incoming_seq;
+                durable->submit(fileno(conn.writefd), conn.syncing);
+            }
+            // a resumable upload isn't done until it is durable
+            if (conn.token != 0 && conn.transfer == 0 && conn.syncing == 0) journal->forget(conn.token, conn.index);
+            if (conn.token != 0 && conn.transfer != 0) journal_progress(conn);
+            close_output(conn, true, now);
+        }
+        if (conn.syncing == 0) reply(from, conn.ack, incoming_seq + 1, cid, FINACK, TYPE_SEND, conn.fin_ext);
+        return;
+    }
+
+    if (conn.state == STATE_FIN) {
+        // the client's ACK of our FINACK closes the connection
+        if (incoming_flag == ACK) {
+            database.erase(cid);
+            drop_buffered(cid);
+            _log("total written, ", total_written);
+            total_written = 0;
+        }
+        return;
+    }
+
+    if (incoming_flag == ACK) conn.ack = in.ack;
+
+    if (seq_diff(incoming_seq, conn.seq) > 0) {
+        _log("=STORED=========================================");
+        auto stored = out_of_order[cid].emplace(incoming_seq, 0);
+        if (stored.second) {
+            // keep the receive buffer itself when we can, rather than copying it
+            if (pack == pool.get(spare)) {
+                stored.first->second = spare;
+                spare                = pool.acquire();
+            } else {
+                stored.first->second = pool.acquire();
+                memcpy(pool.get(stored.first->second), pack, len);
+            }
+            pool.len(stored.first->second) = len;
+        }
+        // the duplicate ACK waits behind any held back, or it would reach
+        // the client first and make what they ACK look lost
+        if (conn.paced.empty()) reply(from, conn.ack, conn.seq, cid, ACK, TYPE_SEND);
+        else conn.paced.push_back(conn.paced.back());
+        // it may be what a parity was waiting on
+        if (!conn.parities.empty()) recover(cid, from, now);
+        return;
+    }
+
+    write_payload(cid, pack->payload, len - 12);
+    ack_data(cid, from, now);
+    drain(cid, from, now);
+}
+
+// ACK everything taken in order. With an ingest budget the connection is
+// charged for the bytes at an equal share of the rate among the connections
+// taking data, and the ACK is held back until the share has paid for what was
+// charged before, so a heavy upload's window opens only as fast as its share
+// while a connection that has just started is ACKed at once.
+//
+// Payloads held past a gap are charged the same, but ACKed along with the gap:
+// the client has been waiting on them since, and ACKs trickling through them
+// would look to it like they had been lost.
+void ServerCore::ack_data(uint16_t cid, const Peer& from, uint64_t now, bool held) {
+    Store& conn = database.at(cid);
+    if (ingest_rate == 0) {
+        reply(from, conn.ack, conn.seq, cid, ACK, TYPE_SEND);
+        return;
+    }
+
+    uint64_t active = 0;
+    for (auto const& [key, other] : database)
+        if (other.state == STATE_ACTIVE && other.last_time + SERVER_ACTIVE_US > now) active++;
+    uint64_t share = std::max<uint64_t>(ingest_rate / std::max<uint64_t>(active, 1), 1);
+    uint64_t due   = std::max(conn.pace_at, now);
+    conn.pace_at   = due + conn.unpaced * 1000000 / share;
+    conn.unpaced   = 0;
+    if (held) due = conn.paced.empty() ? now : conn.paced.back().first;
+
+    if (due <= now && conn.paced.empty()) {
+        reply(from, conn.ack, conn.seq, cid, ACK, TYPE_SEND);
+        return;
+    }
+    conn.paced.emplace_back(due, conn.seq);
+}
+
+// the gap before the held payloads may have closed, write out whatever now
+// follows in order
+void ServerCore::drain(uint16_t cid, const Peer& from, uint64_t now) {
+    Store& conn = database.at(cid);
+    auto held   = out_of_order.find(cid);
+    if (held == out_of_order.end()) return;
+
+    bool drained = false;
+    for (auto next = held->second.find(conn.seq); next != held->second.end(); next = held->second.find(conn.seq)) {
+        _log("=OUT=========================================");
+        uint32_t handle = next->second;
+        held->second.erase(next);
+        packet* b = pool.get(handle);
+        if (b->packet_head.flags == ACK) conn.ack = ntohl(b->packet_head.ack_number);
+        write_payload(cid, b->payload, pool.len(handle) - 12);
+        pool.release(handle);
+        ack_data(cid, from, now, true);
+        drained = true;
+    }
+    if (drained) {
+        for (auto it = held->second.begin(); it != held->second.end();) {
+            if (seq_diff(it->first, conn.seq) < 0) {
+                pool.release(it->second);
+                it = held->second.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+// hold on to a parity while its group has a gap, tell the client how much
+// of the group was missing, and rebuild what it can
+void ServerCore::take_parity(uint16_t cid, const packet* pack, int len, const Peer& from, uint64_t now) {
+    Store& conn = database.at(cid);
+    uint16_t group;
+    memcpy(&group, pack->payload, FEC_HEAD_SIZE);
+    group          = ntohs(group);
+    int32_t ahead  = seq_diff(decode_header(&pack->packet_head).seq, conn.seq);
+    if (ahead < 0 && (uint64_t)-ahead > conn.stream_pos) return;
+    uint64_t start = conn.stream_pos + ahead;
+    uint64_t end   = start + group;
+
+    // what has come of the group, in order or held
+    uint64_t have = conn.stream_pos > start ? std::min(conn.stream_pos, end) - start : 0;
+    auto held     = out_of_order.find(cid);
+    if (held != out_of_order.end()) {
+        for (auto const& [seq, handle] : held->second) {
+            int32_t past = seq_diff(seq, conn.seq);
+            if (past <= 0) continue;
+            uint64_t first = conn.stream_pos + past;
+            uint64_t last  = first + pool.len(handle) - 12;
+            if (first < end && last > start) have += std::min(last, end) - std::max(first, start);
+        }
+    }
+    uint16_t missing = group > have ? group - have : 0;
+
+    if (end > conn.stream_pos && conn.stream_pos - std::min(start, conn.stream_pos) <= FEC_HISTORY &&
+        conn.parities.size() < FEC_MAX_PARITIES)
+        conn.parities[start].assign(pack->payload, len - 12);
+    if (missing > 0) recover(cid, from, now);
+
+    char report[2 * FEC_HEAD_SIZE];
+    uint16_t n = htons(group);
+    memcpy(report, &n, FEC_HEAD_SIZE);
+    n = htons(missing);
+    memcpy(report + FEC_HEAD_SIZE, &n, FEC_HEAD_SIZE);
+    reply(from, conn.ack, advertised(conn), cid, ACK, TYPE_SEND, EXT_FEC, report, sizeof(report));
+}
+
+// rebuild the gap at the in-order point from the parity of the group it is
+// in, when the rest of the group is here and the gap is no wider than the
+// parity, then write it and whatever was held behind it
+void ServerCore::recover(uint16_t cid, const Peer& from, uint64_t now) {
+    Store& conn = database.at(cid);
+    auto held   = out_of_order.find(cid);
+    char rebuilt[SPEC_MAX_PAYLOAD_SIZE];
+
+    while (!conn.parities.empty()) {
+        auto it = conn.parities.begin();
+        const std::string& parity = it->second;
+        uint64_t start = it->first;
+        uint16_t group;
+        memcpy(&group, parity.data(), FEC_HEAD_SIZE);
+        uint64_t end = start + ntohs(group);
+        int width    = parity.size() - FEC_HEAD_SIZE;
+        if (end <= conn.stream_pos || (start < conn.stream_pos && conn.stream_pos - start > FEC_HISTORY)) {
+            conn.parities.erase(it);
+            continue;
+        }
+        // a group past the gap waits for the group with the gap
+        if (start > conn.stream_pos || held == out_of_order.end()) return;
+
+        // the gap ends at the first payload held, or the end of the group
+        uint64_t gap_end = end;
+        for (auto const& [seq, handle] : held->second) {
+            int32_t ahead = seq_diff(seq, conn.seq);
+            if (ahead > 0) gap_end = std::min(gap_end, conn.stream_pos + ahead);
+        }
+        int gap = gap_end - conn.stream_pos;
+        if (gap > width) return;
+
+        memcpy(rebuilt, parity.data() + FEC_HEAD_SIZE, width);
+        for (uint64_t at = start; at < conn.stream_pos;) {
+            size_t slot = at & (FEC_HISTORY - 1);
+            int n       = std::min<uint64_t>(conn.stream_pos - at, FEC_HISTORY - slot);
+            fec_fold(rebuilt, width, at - start, conn.history.data() + slot, n);
+            at += n;
+        }
+        // and the held payloads have to cover the rest of the group
+        for (uint64_t at = gap_end; at < end;) {
+            auto next = held->second.find((conn.seq + (at - conn.stream_pos)) % (SPEC_MAX_SEQ + 1));
+            if (next == held->second.end() || pool.len(next->second) <= 12) return;
+            int n = std::min<uint64_t>(pool.len(next->second) - 12, end - at);
+            fec_fold(rebuilt, width, at - start, pool.get(next->second)->payload, n);
+            at += pool.len(next->second) - 12;
+        }
+
+        // each byte of the gap is alone in its column
+        char bytes[SPEC_MAX_PAYLOAD_SIZE];
+        for (int i = 0; i < gap; i++) bytes[i] = rebuilt[(conn.stream_pos + i - start) % width];
+        conn.parities.erase(it);
+        fec_recovered++;
+        _log("REBUILT ", gap, " bytes from parity");
+        write_payload(cid, bytes, gap);
+        ack_data(cid, from, now);
+        drain(cid, from, now);
+    }
+}
+
+void ServerCore::on_tick(uint64_t now) {
+    // the ACKs the ingest budget has paid for by now; a later one due
+    // stands for an earlier, but a duplicate still goes, as it tells the
+    // client of a datagram held past a gap
+    for (auto& [cid, conn] : database) {
+        while (!conn.paced.empty() && conn.paced.front().first <= now) {
+            uint32_t seq = conn.paced.front().second;
+            conn.paced.pop_front();
+            if (!conn.paced.empty() && conn.paced.front().first <= now && conn.paced.front().second != seq) continue;
+            conn.acked = seq;
+            reply(conn.peer, conn.ack, seq, cid, ACK, TYPE_SEND);
+        }
+    }
+
+    for (auto it = database.begin(); it != database.end();) {
+        Store& conn = it->second;
+        if (now > conn.last_time && now - conn.last_time > SPEC_IDLE_TIMEOUT_US) {
+            if (conn.state == STATE_ACTIVE && conn.token != 0) {
+                // no marker, the upload may yet be resumed
+                journal_progress(conn);
+            } else if (conn.state == STATE_ACTIVE) {
+                char err_msg[50];
+                memset(err_msg, 0, sizeof(err_msg));
+                sprintf(err_msg, "ERROR");
+                int written = write_at(conn, err_msg, sizeof(err_msg));
+                _log("write rto= ", written);
+            }
+            close_output(conn, false, now);
+            drop_buffered(it->first);
+            it = database.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // give up on stripes that never arrived
+    for (auto it = striped.begin(); it != striped.end();) {
+        SharedOutput& out = it->second;
+        if (out.open == 0 && now > out.last_time && now - out.last_time > SPEC_IDLE_TIMEOUT_US) {
+            fclose(out.file);
+            it = striped.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void ServerCore::on_durable(uint64_t now) {
+    std::vector<Synced> synced = durable->take_done();
+    if (!synced.empty()) _log("GROUP COMMIT: ", synced.size(), " files durable");
+    for (auto const& s : synced) {
+        for (auto& [cid, conn] : database) {
+            if (conn.syncing != s.tag) continue;
+            conn.syncing = 0;
+            if (!s.ok) {
+                conn.fin_ext = EXT_DIGEST_BAD;
+                fprintf(stderr, "ERROR: %d.file could not be synced to disk.\n", conn.file_id);
+            }
+            if (conn.token != 0 && conn.transfer == 0) journal->forget(conn.token, conn.index);
+            conn.last_time = now;
+            reply(conn.peer, conn.ack, conn.fin_seq + 1, cid, FINACK, TYPE_SEND, conn.fin_ext);
+        }
+    }
+}
+
+uint64_t ServerCore::next_deadline() const {
+    uint64_t deadline = NO_DEADLINE;
+    for (auto const& [key, val] : database)
+        deadline = std::min(deadline, val.last_time + SPEC_IDLE_TIMEOUT_US + 1);
+    for (auto const& [key, val] : database)
+        if (!val.paced.empty()) deadline = std::min(deadline, val.paced.front().first);
+    for (auto const& [key, val] : striped)
+        if (val.open == 0) deadline = std::min(deadline, val.last_time + SPEC_IDLE_TIMEOUT_US + 1);
+    return deadline;
+}
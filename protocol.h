@@ -0,0 +1,353 @@
+#ifndef PROTOCOL
+#define PROTOCOL
+#include <stdio.h>
+
+#include <fstream>
+#include <functional>
+#include <map>
+#include <queue>
+#include <string>
+
+#include "common.h"
+#include "delta.h"
+#include "durable.h"
+#include "fec.h"
+#include "journal.h"
+
+// Client and server protocol state machines. Neither side touches a socket or
+// a clock: packets are handed in with the current time in microseconds
+// (time_now_us() for real sockets), replies go out through a callback, and
+// the caller asks next_deadline() when to call on_tick() again.
+// client.cpp and server.cpp drive these over UDP, sim.cpp over a virtual link.
+
+#define CLIENT_SYN_SENT 1
+#define CLIENT_ESTABLISHED 2
+#define CLIENT_FIN_SENT 3
+#define CLIENT_TIME_WAIT 4
+#define CLIENT_DONE 5
+#define CLIENT_FAILED 6
+#define CLIENT_SUMS 7 // fetching the basis block sums for a delta
+
+#define NO_DEADLINE UINT64_MAX
+
+// how often a client waiting on its data source looks again
+#define CLIENT_STARVED_POLL_US 1000
+
+// an unanswered SYN is sent again after an RTO, then twice as long each
+// time, up to this many RTOs, until the idle timeout
+#define CLIENT_SYN_MAX_BACKOFF 4
+
+// RACK loss detection (RFC 8985): a segment is lost once one sent after it
+// has been delivered and an RTT plus a reordering window has passed since it
+// went out. The window starts at a quarter of the lowest RTT seen, widens by
+// that much each time a resend turns out to have been needless, up to the
+// last RTT, and narrows back after this many recoveries without one.
+#define RACK_REO_WND_DIV 4
+#define RACK_REO_WND_PERSIST 16
+
+// block sums requests a client has out at once
+#define CLIENT_SUMS_WINDOW 32
+
+// how much a resumable upload writes between journal records
+#define SERVER_JOURNAL_BYTES (1 << 20)
+
+// With an ingest budget, connections that have taken data this recently share
+// it. With ingest_drops on, one that gets further ahead of its share than the
+// most an ACK is held back loses a datagram, at most one that often, so its
+// client's window comes down before its RTO goes off.
+#define SERVER_ACTIVE_US 100000
+#define SERVER_MAX_ACK_DELAY_US (SPEC_RTO_US / 4)
+
+// what open_fn is opening N.file for
+#define OPEN_NEW 0    // a new upload, truncating it
+#define OPEN_RESUME 1 // to carry on writing it
+#define OPEN_BASIS 2  // to read it as a delta's basis
+
+// send a datagram of len bytes to the other end
+typedef std::function<void(const packet*, int len)> send_fn;
+
+// send a datagram of len bytes to a given client
+typedef std::function<void(const Peer&, const packet*, int len)> reply_fn;
+
+// open N.file for an OPEN_ mode
+typedef std::function<FILE*(uint16_t file_id, int mode)> open_fn;
+
+// read_at() has nothing yet, but it isn't the end of the data either
+#define SOURCE_PENDING -1
+
+// where the client gets the bytes it uploads
+class DataSource {
+    public:
+        virtual ~DataSource() {}
+        // copy up to len bytes at offset into buf, returns bytes copied (0 at
+        // end of data, SOURCE_PENDING if the data isn't there yet)
+        virtual int read_at(uint64_t offset, char* buf, int len) = 0;
+        // bytes before offset are ACKed and won't be read again
+        virtual void release(uint64_t offset) {}
+        // the server already has the bytes before offset, so reading starts
+        // there; called before the first read_at
+        virtual void skip_to(uint64_t offset) { release(offset); }
+};
+
+class FileSource : public DataSource {
+    public:
+        FileSource(std::ifstream& file);
+        int read_at(uint64_t offset, char* buf, int len) override;
+    private:
+        std::ifstream& file;
+};
+
+class MemorySource : public DataSource {
+    public:
+        MemorySource(const std::string& data);
+        int read_at(uint64_t offset, char* buf, int len) override;
+    private:
+        const std::string& data;
+};
+
+// one segment sent and not yet ACKed
+struct SentSegment {
+    uint64_t offset;
+    int len;
+    int sends;        // times it went out
+    bool lost;        // declared lost and not yet sent again
+    bool held;        // a duplicate ACK says the server is holding it
+    uint64_t sent_us; // when it last went out
+};
+
+// The segments in flight in file order, in a ring that doubles when full.
+class Scoreboard {
+    public:
+        Scoreboard() : slots(64), mask(63), head(0), tail(0) {}
+
+        size_t size() const { return tail - head; }
+        bool empty() const { return head == tail; }
+        SentSegment& at(size_t i) { return slots[(head + i) & mask]; }
+        SentSegment& front() { return at(0); }
+        void pop() { head++; }
+        void push(const SentSegment& seg) {
+            if (size() == slots.size()) {
+                std::vector<SentSegment> grown(slots.size() * 2);
+                for (size_t i = 0; i < size(); i++) grown[i] = at(i);
+                tail  = size();
+                head  = 0;
+                slots = std::move(grown);
+                mask  = slots.size() - 1;
+            }
+            slots[tail++ & mask] = seg;
+        }
+
+    private:
+        std::vector<SentSegment> slots;
+        size_t mask;
+        size_t head;
+        size_t tail;
+};
+
+class ClientConn {
+    public:
+        ClientConn(DataSource* source, send_fn send, std::ostream* trace = &std::cout);
+
+        // send the SYN
+        void start(uint64_t now);
+        void on_packet(const packet* pack, int len, uint64_t now);
+        // fire any timers that are due
+        void on_tick(uint64_t now);
+        uint64_t next_deadline() const;
+        bool finished() const { return state == CLIENT_DONE || state == CLIENT_FAILED; }
+
+        // sent as the SYN's payload, e.g. an encoded stripe
+        std::string syn_payload;
+        // sent as the SYN's connection id, so a resent SYN is known; unique
+        // among the connections from one address, 0 if the caller can't say
+        uint16_t nonce;
+        // send as much of the data as fits with the SYN; not with packed or
+        // a basis, as what is sent depends on what the server agrees to
+        bool zero_rtt;
+        // ask for CRC32C trailers on every segment and a digest check at FIN
+        bool integrity;
+        bool crc;      // the server agreed to it
+        bool verified; // the server's FINACK says its digest matched ours
+        // compressed view of the source, offered to the server and sent
+        // instead of the source if it agrees
+        DataSource* packed;
+        bool compressed; // the server agreed to it
+        // names the upload across connections and restarts, so the server
+        // can say how much it already has; 0 to always start from the top
+        uint64_t token;
+        uint64_t resumed_from; // where the server said to carry on from
+        // the N.file on the server to send a delta against, -1 for none, and
+        // where the basis block sums go for the delta source to match with;
+        // they stay unset if the server won't, and the source then sends
+        // the file as it is
+        int basis;
+        BlockSums* sums;
+        bool mismatch; // the server's FINACK says its copy isn't ours
+        // send a parity segment after each group of data segments, sized
+        // to the loss the server reports, so it can rebuild a lost one
+        bool parity;
+        bool fec;             // the server agreed to it
+        uint64_t parity_sent; // parity segments
+
+        int state;
+        uint16_t cid;
+        int cwnd;
+        int ssthresh;
+        // offsets into the data are 64 bit and only folded into the wrapping
+        // sequence space on the wire, so there is no limit on transfer size
+        uint64_t snd_una; // first byte of the file not yet ACKed
+        uint64_t snd_nxt; // next byte of the file to send
+        uint64_t snd_max; // highest byte of the file ever sent
+        uint64_t retransmits;
+        uint64_t rack_losses; // segments RACK declared lost before the RTO
+
+    private:
+        void update_cwnd_ssthresh();
+        void on_timeout();
+        void on_ack(uint32_t ack_number, uint64_t now, bool data_ack);
+        void rack_delivered(const SentSegment& seg, uint64_t now);
+        void detect_losses(uint64_t now);
+        void pump(uint64_t now);
+        bool resend_lost(uint64_t now);
+        void send_data(packet* pack, uint64_t offset, int len, int type);
+        void send_fin(int type);
+        void ask_sums(uint64_t now);
+        void send_sums_request(uint32_t chunk, int type);
+        void on_sums(const packet* pack, int len, uint64_t now);
+        void send_parity();
+        void on_parity_reply(const packet* pack, int len);
+        void emit(packet* pack, int len, int type);
+        uint32_t wire_seq(uint64_t offset) const;
+
+        DataSource* source;
+        send_fn send;
+        std::ostream* trace;
+
+        Scoreboard scoreboard;
+        uint64_t lost_bytes;    // declared lost and not yet sent again
+        uint64_t held_bytes;    // in segments the server is holding
+        uint64_t rack_xmit;     // when the latest sent segment known delivered went out
+        uint64_t rack_end;      // and where it ends, 0 before any
+        uint64_t rack_rtt;      // RTT measured on it
+        uint64_t min_rtt;       // lowest RTT seen, UINT64_MAX before any
+        uint64_t rack_deadline; // when a segment sent before rack_xmit is due
+        int reo_mult;           // reordering window in quarters of min_rtt
+        int reo_persist;        // recoveries before it narrows again
+        uint64_t una_moved;     // when snd_una last moved
+        bool in_recovery;       // cwnd was cut for a loss below recovery_end
+        uint64_t recovery_end;
+
+        packet syn;        // kept to send again as it was
+        int syn_len;
+        int syn_backoff;   // RTOs until the SYN is sent again
+        int early_at;      // where the data starts in its payload
+        int early_len;     // and how much there is
+
+        uint32_t data_isn; // sequence number of the first payload byte
+        uint32_t ack_num;
+        uint32_t fin_seq;
+        bool eof;
+        uint64_t last_active_time;
+        uint64_t retransmit_last_time;
+        uint64_t time_wait_start;
+        uint32_t digest;       // CRC32C of every byte sent so far, in order
+        bool starved;          // read_at last came back pending
+        uint64_t starved_time; // and when
+        uint32_t sums_block;   // block size the server summed the basis with
+        std::vector<bool> sums_got;              // chunks of sums received
+        uint32_t sums_missing;                   // chunks still to come
+        uint32_t sums_next;                      // next chunk to ask for
+        std::map<uint32_t, uint64_t> sums_asked; // chunks asked for -> when
+        std::vector<char> fec_parity;   // of the group being sent
+        uint64_t fec_start;             // offset of the group's first byte
+        int fec_segments;               // data segments in it so far
+        int fec_group;                  // data segments it gets
+        double fec_loss;                // share of the bytes the server reports missing
+        std::queue<uint64_t> parity_q;  // ends of groups whose parity is in flight
+        std::queue<int> parity_size_q;  // and the parity sizes
+        uint64_t parity_in_flight;      // counted against cwnd along with the data
+};
+
+// output file shared by the stripes of one striped upload
+struct SharedOutput {
+    FILE* file;
+    uint16_t file_id;
+    uint16_t stripes;  // stripes the transfer was split into
+    uint16_t done;     // stripes that finished with a FIN
+    uint16_t open;     // stripes with a live connection
+    uint64_t last_time;
+    uint64_t token;    // resume token, if the stripes have one
+};
+
+class ServerCore {
+    public:
+        ServerCore(open_fn open_file, reply_fn send, std::ostream* trace = &std::cout);
+
+        // a buffer to receive the next datagram into; if on_packet is handed
+        // this buffer and needs to hold on to it, it keeps it instead of copying
+        packet* rx_buffer();
+        void on_packet(const packet* pack, int len, const Peer& from, uint64_t now);
+        // close connections that have been idle too long, and send the ACKs
+        // the ingest budget has paid for
+        void on_tick(uint64_t now);
+        uint64_t next_deadline() const;
+        // send the FINACKs whose files the group commit has made durable
+        void on_durable(uint64_t now);
+
+        std::map<unsigned int, Store> database;
+        // out of order payloads held until the gap before them fills, seq -> pool handle
+        std::map<uint16_t, std::map<uint32_t, uint32_t>> out_of_order;
+        // striped uploads by transfer id, kept until every stripe has finished
+        // or none has been connected for the idle timeout
+        std::map<uint32_t, SharedOutput> striped;
+        uint16_t num_connections;
+        uint64_t total_written;
+        uint64_t crc_failures;      // datagrams dropped for a bad CRC trailer
+        uint64_t digest_mismatches; // files whose FIN digest, or delta CRC32C, didn't match
+        // where resumable uploads record how far they got; without one
+        // every upload starts from the top
+        Journal* journal;
+        uint64_t resumed; // uploads that carried on from an earlier connection
+        uint64_t fec_recovered; // gaps rebuilt from parity
+        // makes each finished file durable before its FIN is ACKed; without
+        // one the FINACK goes as soon as the data is with the kernel
+        GroupCommit* durable;
+        // bytes a second taken in across all connections, 0 for no limit
+        uint64_t ingest_rate;
+        // also drop a datagram now and then from a connection far over its
+        // share, rather than only pacing its ACKs; off by default, as it
+        // throws away data that already came in intact
+        bool ingest_drops;
+        uint64_t paced_drops; // data dropped for running over its share
+
+    private:
+        void reply(const Peer& to, uint32_t seq, uint32_t ack, uint16_t cid, uint8_t flags, int type, uint8_t ext = 0,
+                   const char* payload = NULL, int payload_len = 0);
+        void write_payload(uint16_t cid, const char* data, int len);
+        void drain(uint16_t cid, const Peer& from, uint64_t now);
+        void take_parity(uint16_t cid, const packet* pack, int len, const Peer& from, uint64_t now);
+        void recover(uint16_t cid, const Peer& from, uint64_t now);
+        void ack_data(uint16_t cid, const Peer& from, uint64_t now, bool held = false);
+        uint32_t advertised(const Store& conn) const { return conn.paced.empty() ? conn.seq : conn.acked; }
+        int write_at(Store& conn, const char* data, int len);
+        int unpack(Store& conn, const char* data, int len);
+        int deliver(Store& conn, const char* data, int len);
+        int apply_delta(Store& conn, const char* data, int len);
+        bool open_basis(Store& conn, uint16_t basis);
+        void close_output(Store& conn, bool complete, uint64_t now);
+        void drop_buffered(uint16_t cid);
+        bool claim_id(int avoid);
+        void take_over(uint64_t token, uint16_t index, uint64_t now);
+        void journal_progress(Store& conn);
+
+        open_fn open_file;
+        reply_fn send;
+        std::ostream* trace;
+        PacketPool pool;
+        uint32_t spare; // pool buffer rx_buffer() hands out
+        uint64_t last_sync; // group commit tag last handed out
+        std::vector<char> unpacked; // one block, inflated
+        std::vector<char> basis_block; // one block, read from a basis
+};
+
+#endif
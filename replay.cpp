@@ -0,0 +1,473 @@
+// ========================================================================== //
+// INCLUDES
+// ========================================================================== //
+
+// Standard Libraries
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// C libraries
+#include <cerrno>
+#include <cstring>
+
+// Networking
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// Local
+#include "common.h"
+#include "pcap.h"
+
+// ========================================================================== //
+// DEFINITIONS
+// ========================================================================== //
+
+// Replays the client side of captured Confundo sessions against a running
+// server. Every session in the capture is sent COPIES times, each copy from
+// its own socket and rewritten to the connection id the server gives it,
+// keeping the capture's packet order and so its reordering and retransmissions.
+// The server only has 11 connection ids, so at most REPLAY_MAX_OPEN copies are
+// open at once, and the rest wait for one of them to finish. A copy whose FIN
+// never got its FINACK may leave its id with the server until the idle
+// timeout, so it keeps its place until then, and a SYN is given that long to
+// be answered, in case the ids are held by someone else.
+
+#define REPLAY_QUEUED 0
+#define REPLAY_SYN_WAIT 1
+#define REPLAY_SENDING 2
+#define REPLAY_CLOSING 3
+#define REPLAY_DONE 4
+#define REPLAY_FAILED 5
+
+#define REPLAY_MAX_OPEN 10
+#define REPLAY_SYN_TIMEOUT_US (SPEC_IDLE_TIMEOUT_US + 2 * SPEC_RTO_US)
+#define REPLAY_FIN_TIMEOUT_US 1000000
+#define REPLAY_DRAIN_US 1000000
+
+// client to server datagrams of one captured session, in capture order
+struct Flow {
+    std::vector<const PcapRecord*> packets;
+    bool closes; // the capture has the session's FIN
+};
+
+// an ACK we are waiting for, and when the packet that asks for it went out
+struct Pending {
+    uint32_t ack;
+    uint64_t sent_us;
+};
+
+struct Copy {
+    int fd;
+    const Flow* flow;
+    size_t next;
+    int state;
+    uint16_t cid;
+    uint16_t nonce; // sent in place of the captured SYN's
+    uint64_t syn_us;
+    uint64_t resend_us; // when the SYN last went
+    uint64_t fin_us;
+    bool finacked;      // the server has ACKed the capture's FIN
+    uint32_t end_seq; // one past the last sequence number sent
+    std::vector<Pending> pending;
+};
+
+// ========================================================================== //
+// FUNCTIONS
+// ========================================================================== //
+
+Peer resolve(const char* hostname, int port) {
+    struct addrinfo hints, *server_info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+
+    auto port_name = std::to_string(port);
+    if (getaddrinfo(hostname, port_name.c_str(), &hints, &server_info) != 0)
+        _exit("Incorrect hostname or port?", errno);
+
+    Peer server;
+    memset(&server, 0, sizeof(server));
+    memcpy(&server.addr, server_info->ai_addr, server_info->ai_addrlen);
+    server.len = server_info->ai_addrlen;
+    freeaddrinfo(server_info);
+    return server;
+}
+
+void send_record(Copy& c, const PcapRecord* r, uint64_t now) {
+    packet pack;
+    int len = std::min(r->payload.size(), sizeof(struct packet));
+    memcpy(&pack, r->payload.data(), len);
+    fields in   = decode_header(&pack.packet_head);
+    bool sealed = (in.ext & EXT_CRC) && in.flags != SYN && len >= 12 + CRC_TRAILER_SIZE;
+    if (in.flags != SYN) {
+        pack.packet_head.connection_id = htons(c.cid);
+        // the trailer covers the header, so it has to follow the new id
+        if (sealed) seal_crc(&pack, len - CRC_TRAILER_SIZE);
+    } else {
+        // the server would take a copy's SYN for the last loop's
+        pack.packet_head.connection_id = htons(c.nonce);
+        int token_at = in.ext & EXT_EARLY ? EARLY_LENGTH_SIZE : 0;
+        if ((in.ext & EXT_RESUME) && len >= 12 + token_at + RESUME_TOKEN_SIZE) {
+            // copies of one session would keep taking over from each other,
+            // and resume where the captured one got to, so they go without
+            // the token
+            char* token = pack.payload + token_at;
+            memmove(token, token + RESUME_TOKEN_SIZE, len - 12 - token_at - RESUME_TOKEN_SIZE);
+            len -= RESUME_TOKEN_SIZE;
+            pack.packet_head.empty &= ~EXT_RESUME;
+        }
+        if ((in.ext & EXT_CRC) && len >= 12 + CRC_TRAILER_SIZE) seal_crc(&pack, len - CRC_TRAILER_SIZE);
+    }
+
+    // a datagram the socket had no room for is lost like any other, and
+    // shows up as a short session
+    int numbytes = send(c.fd, &pack, len, 0);
+    if (send_dropped(numbytes)) _log("REPLAY: socket buffer full, datagram dropped");
+    else err(numbytes, "Sending replayed packet");
+
+    // SYN and FIN payloads (stripe, digest), block sums requests and parity
+    // aren't data, save what came early with the SYN
+    int data = len - 12 - (sealed ? CRC_TRAILER_SIZE : 0);
+    if (in.flags == SYN) {
+        uint16_t early = 0;
+        if ((in.ext & EXT_EARLY) && len >= 12 + EARLY_LENGTH_SIZE) memcpy(&early, pack.payload, EARLY_LENGTH_SIZE);
+        data = 1 + ntohs(early);
+    }
+    if ((in.flags & FIN) || (in.flags != SYN && (in.ext & (EXT_DELTA | EXT_FEC)))) data = 0;
+    uint32_t end = (in.seq + data) % (SPEC_MAX_SEQ + 1);
+    if (in.flags == SYN || seq_diff(end, c.end_seq) > 0) c.end_seq = end;
+
+    // a payload asks for an ACK of everything up to its end
+    if (in.flags != SYN && data > 0) c.pending.push_back({end, now});
+}
+
+// close a session the capture left open, so the server can reuse its id
+void send_fin(Copy& c, uint64_t now) {
+    packet fin;
+    encode_header(&fin.packet_head, c.end_seq, 0, c.cid, FIN);
+    int numbytes = send(c.fd, &fin, 12, 0);
+    if (send_dropped(numbytes)) _log("REPLAY: socket buffer full, FIN dropped");
+    else err(numbytes, "Sending FIN");
+    c.state  = REPLAY_CLOSING;
+    c.fin_us = now;
+}
+
+// drain every reply waiting on a copy's socket, returns how many there were
+int receive_replies(Copy& c, std::vector<uint64_t>& latencies) {
+    int count = 0;
+    packet reply;
+    while (true) {
+        int rc = recv(c.fd, &reply, sizeof(struct packet), 0);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+            if (errno == ECONNREFUSED) continue;
+            err(rc, "REPLAY while recv from socket");
+        }
+        if (rc < 12) continue;
+        count++;
+
+        uint64_t now = time_now_us();
+        if (c.state == REPLAY_SYN_WAIT) {
+            if (reply.packet_head.flags != SYNACK) continue;
+            c.cid   = ntohs(reply.packet_head.connection_id);
+            c.state = REPLAY_SENDING;
+            latencies.push_back(now - c.syn_us);
+            continue;
+        }
+        // a FINACK for the capture's own FIN; the capture then has the final
+        // ACK. The server ACKs a FIN over a gap too, so it says nothing of
+        // the data
+        if (c.state == REPLAY_SENDING && reply.packet_head.flags == FINACK) {
+            c.finacked = true;
+            continue;
+        }
+        if (c.state == REPLAY_CLOSING && reply.packet_head.flags == FINACK) {
+            fields in = decode_header(&reply.packet_head);
+            packet ack;
+            encode_header(&ack.packet_head, in.ack, in.seq + 1, c.cid, ACK);
+            int numbytes = send(c.fd, &ack, 12, 0);
+            if (send_dropped(numbytes)) _log("REPLAY: socket buffer full, final ACK dropped");
+            else err(numbytes, "Sending final ACK");
+            c.state = REPLAY_DONE;
+            continue;
+        }
+
+        uint32_t ack = ntohl(reply.packet_head.ack_number);
+        auto done    = std::partition(c.pending.begin(), c.pending.end(), [&](const Pending& p) {
+            return seq_diff(p.ack, ack) > 0;
+        });
+        for (auto it = done; it != c.pending.end(); ++it) latencies.push_back(now - it->sent_us);
+        c.pending.erase(done, c.pending.end());
+    }
+    return count;
+}
+
+uint64_t percentile(std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[i];
+}
+
+int main(int argc, char** argv) {
+    // ========================================================================== //
+    //     get arguments
+    // ========================================================================== //
+
+    uint64_t OPT_RATE  = 0;
+    int OPT_COPIES     = 1;
+    int OPT_LOOPS      = 1;
+    int OPT_CAPTURE    = 5000;
+    const char* usage  = "usage: ./replay [-r PACKETS-PER-SEC] [-c COPIES] [-n LOOPS] [-p CAPTURED-SERVER-PORT] "
+                         "<HOSTNAME-OR-IP> <PORT> <PCAP-FILE>";
+    std::string OPT_HOST;
+    int OPT_PORT = 0;
+    std::string OPT_FILE;
+
+    int opt;
+    try {
+        while ((opt = getopt(argc, argv, "r:c:n:p:")) != -1) {
+            switch (opt) {
+                case 'r': OPT_RATE = std::stoull(optarg); break;
+                case 'c': OPT_COPIES = std::stoi(optarg); break;
+                case 'n': OPT_LOOPS = std::stoi(optarg); break;
+                case 'p': OPT_CAPTURE = std::stoi(optarg); break;
+                default: throw std::invalid_argument("Unknown option");
+            }
+        }
+        if (argc - optind != 3) throw std::invalid_argument("Missing arguments");
+        OPT_HOST = argv[optind];
+        OPT_PORT = std::stoi(argv[optind + 1]);
+        OPT_FILE = argv[optind + 2];
+        if (OPT_PORT < 0 || OPT_PORT > 65535) throw std::invalid_argument("Invalid Port");
+        if (OPT_COPIES < 1 || OPT_LOOPS < 1) throw std::invalid_argument("Invalid count");
+    } catch (const std::exception& e) {
+        _exit((std::string("Invalid arguments.\n") + usage).c_str());
+    }
+
+    // ========================================================================== //
+    //     load capture
+    // ========================================================================== //
+
+    std::vector<PcapRecord> records;
+    if (!pcap_read_udp(OPT_FILE.c_str(), records)) _exit("Reading pcap file");
+
+    // one session per connection, starting at its SYN. A client socket runs
+    // one handshake at a time, so a SYNACK back to it answers its last SYN,
+    // and names the id the rest of the session's datagrams carry; a SYN with
+    // the same nonce is that one sent again
+    typedef std::pair<uint32_t, uint16_t> Client;
+    std::map<Client, size_t> connecting;                 // last session a client opened
+    std::map<std::pair<Client, uint16_t>, size_t> by_id; // client and id -> session
+    std::vector<Flow> flows;
+    std::vector<bool> answered;
+    auto cid_of = [](const PcapRecord& r) { return (uint16_t)((uint8_t)r.payload[8] << 8 | (uint8_t)r.payload[9]); };
+    for (auto const& r : records) {
+        if (r.payload.size() < 12) continue;
+        uint8_t flags = r.payload[11];
+        uint16_t cid  = cid_of(r);
+        if (r.src_port == OPT_CAPTURE) {
+            auto last = connecting.find({r.dst_ip, r.dst_port});
+            if (flags == SYNACK && last != connecting.end()) {
+                by_id[{last->first, cid}] = last->second;
+                answered[last->second]    = true;
+            }
+            continue;
+        }
+        if (r.dst_port != OPT_CAPTURE) continue;
+        Client client = {r.src_ip, r.src_port};
+        if (flags == SYN) {
+            auto last  = connecting.find(client);
+            bool again = last != connecting.end() && cid == cid_of(*flows[last->second].packets[0]) &&
+                         (cid != 0 || !answered[last->second]);
+            if (!again) {
+                connecting[client] = flows.size();
+                flows.push_back(Flow());
+                answered.push_back(false);
+            }
+            flows[connecting[client]].packets.push_back(&r);
+            continue;
+        }
+        auto session = by_id.find({client, cid});
+        if (session == by_id.end()) continue;
+        Flow& flow = flows[session->second];
+        if (flags == FIN) flow.closes = true;
+        flow.packets.push_back(&r);
+    }
+    if (flows.empty()) _exit("No Confundo sessions with a SYN in capture");
+    _log("REPLAY: ", flows.size(), " sessions from ", records.size(), " datagrams");
+
+    // ========================================================================== //
+    //     replay
+    // ========================================================================== //
+
+    Peer server = resolve(OPT_HOST.c_str(), OPT_PORT);
+
+    std::vector<Copy> copies;
+    std::vector<struct pollfd> fds;
+    for (auto const& flow : flows) {
+        for (int i = 0; i < OPT_COPIES; i++) {
+            Copy c;
+            c.next      = 0;
+            c.state     = REPLAY_QUEUED;
+            c.cid       = 0;
+            c.nonce     = 0;
+            c.syn_us    = 0;
+            c.resend_us = 0;
+            c.fin_us    = 0;
+            c.finacked  = false;
+            c.end_seq   = 0;
+            c.fd        = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            err(c.fd, "Opening socket");
+            err(connect(c.fd, (struct sockaddr*)&server.addr, server.len), "Connecting socket");
+            fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL) | O_NONBLOCK);
+            c.flow = &flow;
+            copies.push_back(c);
+            fds.push_back({c.fd, POLLIN, 0});
+        }
+    }
+
+    uint64_t interval_us = OPT_RATE > 0 ? 1000000 / OPT_RATE : 0;
+    uint64_t sent        = 0;
+    uint64_t replies     = 0;
+    int failed           = 0;
+    int short_sessions   = 0; // closed with payloads the server never ACKed
+    std::vector<uint64_t> latencies;
+    std::vector<uint64_t> held; // when copies that didn't close cleanly last sent
+    // ids the server may still hold from those copies, until its idle timeout
+    // lets them go
+    auto lingering = [&](uint64_t now) {
+        held.erase(std::remove_if(held.begin(), held.end(), [&](uint64_t t) { return now - t > SPEC_IDLE_TIMEOUT_US; }),
+                   held.end());
+        return (int)held.size();
+    };
+
+    uint64_t start_us = time_now_us();
+    for (int loop = 0; loop < OPT_LOOPS; loop++) {
+        for (auto& c : copies) c.state = REPLAY_QUEUED;
+        size_t queued = 0; // next copy to start
+
+        uint64_t next_send_us = time_now_us();
+        size_t turn           = 0;
+        while (true) {
+            uint64_t now = time_now_us();
+
+            int open = 0;
+            for (auto& c : copies) {
+                if (c.state == REPLAY_SYN_WAIT && now - c.syn_us > REPLAY_SYN_TIMEOUT_US) {
+                    // its SYNACK may be what was lost
+                    c.state = REPLAY_FAILED;
+                    failed++;
+                    held.push_back(c.resend_us);
+                } else if (c.state == REPLAY_SYN_WAIT && now - c.resend_us > SPEC_RTO_US) {
+                    // an id may have come free just after it went; the
+                    // server knows a SYN sent again by its nonce
+                    c.resend_us = now;
+                    send_record(c, c.flow->packets[0], now);
+                    sent++;
+                } else if (c.state == REPLAY_SENDING && c.next == c.flow->packets.size()) {
+                    // a captured FIN waits for its FINACK, so the id is free
+                    // once the copy is done
+                    if (c.finacked) {
+                        c.state = REPLAY_DONE;
+                    } else if (c.flow->closes) {
+                        c.state  = REPLAY_CLOSING;
+                        c.fin_us = now;
+                    } else {
+                        send_fin(c, now);
+                    }
+                } else if (c.state == REPLAY_CLOSING && now - c.fin_us > REPLAY_FIN_TIMEOUT_US) {
+                    c.state = REPLAY_DONE;
+                    held.push_back(c.fin_us);
+                }
+                if (c.state == REPLAY_SYN_WAIT || c.state == REPLAY_SENDING || c.state == REPLAY_CLOSING) open++;
+            }
+
+            // start the next copies as ids come free
+            int busy = open + lingering(now);
+            for (; queued < copies.size() && busy < REPLAY_MAX_OPEN; queued++, open++, busy++) {
+                Copy& c    = copies[queued];
+                c.next     = 0;
+                c.state    = REPLAY_SYN_WAIT;
+                c.cid      = 0;
+                c.nonce    = loop % 0xffff + 1;
+                c.finacked = false;
+                c.pending.clear();
+                c.syn_us    = now;
+                c.resend_us = now;
+                send_record(c, c.flow->packets[c.next++], now);
+                sent++;
+            }
+            if (open == 0 && queued == copies.size()) break;
+
+            // one packet per due slot, round robin over copies that have their id
+            int burst = interval_us == 0 ? copies.size() : 1;
+            for (int b = 0; b < burst && now >= next_send_us; b++) {
+                size_t i;
+                for (i = 0; i < copies.size(); i++) {
+                    Copy& c = copies[(turn + i) % copies.size()];
+                    if (c.state == REPLAY_SENDING && c.next < c.flow->packets.size()) break;
+                }
+                if (i == copies.size()) break;
+                Copy& c = copies[(turn + i) % copies.size()];
+                turn    = (turn + i + 1) % copies.size();
+
+                send_record(c, c.flow->packets[c.next++], now);
+                sent++;
+                next_send_us = interval_us == 0 ? now : next_send_us + interval_us;
+            }
+
+            int wait_ms = 0;
+            if (interval_us > 0 && next_send_us > now) wait_ms = (next_send_us - now) / 1000;
+            if (open == 0) wait_ms = 10; // only waiting for held ids to lapse
+            if (poll(fds.data(), fds.size(), wait_ms) > 0) {
+                for (size_t i = 0; i < copies.size(); i++)
+                    if (fds[i].revents & POLLIN) replies += receive_replies(copies[i], latencies);
+            }
+        }
+
+        // give the server a moment to ACK the tail
+        uint64_t drain_start = time_now_us();
+        while (time_now_us() - drain_start < REPLAY_DRAIN_US) {
+            bool waiting = false;
+            for (auto const& c : copies) waiting = waiting || !c.pending.empty();
+            if (!waiting) break;
+            if (poll(fds.data(), fds.size(), 10) > 0) {
+                for (size_t i = 0; i < copies.size(); i++)
+                    if (fds[i].revents & POLLIN) replies += receive_replies(copies[i], latencies);
+            }
+        }
+
+        // replay never resends, so a payload still unACKed is data the
+        // server doesn't have
+        for (auto const& c : copies)
+            if (c.state == REPLAY_DONE && !c.pending.empty()) short_sessions++;
+    }
+    uint64_t elapsed_us = std::max<uint64_t>(time_now_us() - start_us, 1);
+
+    for (auto const& c : copies) close(c.fd);
+
+    // ========================================================================== //
+    //     report
+    // ========================================================================== //
+
+    std::sort(latencies.begin(), latencies.end());
+    std::cerr << "sessions " << flows.size() * OPT_COPIES * OPT_LOOPS << " failed " << failed << " short "
+              << short_sessions << std::endl;
+    std::cerr << "sent " << sent << " packets, " << sent * 1000000 / elapsed_us << " pkt/s" << std::endl;
+    std::cerr << "server replied " << replies << " packets, " << replies * 1000000 / elapsed_us << " pkt/s" << std::endl;
+    std::cerr << "ack latency us: p50 " << percentile(latencies, 0.50) << " p90 " << percentile(latencies, 0.90)
+              << " p99 " << percentile(latencies, 0.99) << " max " << (latencies.empty() ? 0 : latencies.back())
+              << " over " << latencies.size() << " samples" << std::endl;
+
+    return failed == 0 && short_sessions == 0 ? 0 : 1;
+}
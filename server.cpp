@@ -10,10 +10,13 @@
 #include <fstream>
 #include <unistd.h>
 #include <fcntl.h>
+#include <climits>
 #include <ctime>
 #include <vector>
 #include <dirent.h>
 #include <map>
+#include <memory>
+#include <csignal>
 #include <stdio.h>
 
 // C libraries
@@ -23,6 +26,7 @@
 // Networking
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
@@ -31,7 +35,12 @@
 #include <filesystem>
 
 // Local
+#include "busypoll.h"
 #include "common.h"
+#include "durable.h"
+#include "journal.h"
+#include "pcap.h"
+#include "protocol.h"
 
 using namespace std;
 
@@ -39,16 +48,22 @@ using namespace std;
 // DEFINITIONS
 // ========================================================================== //
 
-std::map<unsigned int, Store> database;
+// kept in the output directory, next to the files it describes
+#define SERVER_JOURNAL_NAME ".resume-journal"
 
-std::map<uint16_t, std::map<int32_t, packet>> out_of_order;
-
-uint64_t total_written = 0;
+// every datagram sent and received, when run with -w
+std::unique_ptr<PcapWriter> capture;
 
 // ========================================================================== //
 // FUNCTIONS
 // ========================================================================== //
 
+// exit() runs static destructors, which flush the capture
+void sig_handle(int sig) {
+    if (sig == SIGTERM || sig == SIGINT || sig == SIGQUIT) exit(0);
+    exit(sig);
+}
+
 int open_socket(int port, int* addrlen) {
     // https://man7.org/linux/man-pages/man3/getaddrinfo.3.html
 
@@ -105,292 +120,134 @@ int open_socket(int port, int* addrlen) {
 int main(int argc, char **argv) {
     int OPT_PORT = 0;
     std::string OPT_DIR;
+    std::string OPT_CAPTURE;
+    size_t OPT_CAPTURE_SLOTS = PCAP_DEFAULT_SLOTS;
+    bool OPT_DURABLE = false;
+    uint64_t OPT_RATE = 0;
+    bool OPT_RATE_DROPS = false;
+    uint64_t OPT_BUSY_US = 0;
+    int OPT_CPU = -1;
 
     int rc = 0;
 
-    if (argc != 3)
-        _exit("Invalid arguments.\n usage: ./server <PORT> <FILE-DIR>");
+    const char* usage = "Invalid arguments.\nusage: \"./server [-w CAPTURE-FILE] [-W CAPTURE-SLOTS] [-S] [-r BYTES-PER-SEC] [-L] [-B SPIN-US] [-A CPU] <PORT> <FILE-DIR>\"";
 
     // if make debug instead of make
     _log("Debug logging enabled.");
 
     try {
-        OPT_PORT = std::stoi(argv[1]);
-        OPT_DIR  = argv[2];
+        int opt;
+        while ((opt = getopt(argc, argv, "w:W:Sr:LB:A:")) != -1) {
+            switch (opt) {
+                case 'w': OPT_CAPTURE = optarg; break;
+                case 'W': OPT_CAPTURE_SLOTS = std::stoul(optarg); break;
+                case 'S': OPT_DURABLE = true; break;
+                case 'r': OPT_RATE = std::stoull(optarg); break;
+                case 'L': OPT_RATE_DROPS = true; break;
+                case 'B': OPT_BUSY_US = std::stoull(optarg); break;
+                case 'A': OPT_CPU = std::stoi(optarg); break;
+                default: throw std::invalid_argument("Unknown option");
+            }
+        }
+        if (argc - optind != 2) throw std::invalid_argument("Wrong number of arguments");
+        OPT_PORT = std::stoi(argv[optind]);
+        OPT_DIR  = argv[optind + 1];
         if (OPT_PORT < 0 || OPT_PORT > 65535) throw std::invalid_argument("Invalid Port");
     } catch (const std::exception &e) {
         _log("Invalid arg in ", e.what());
-        _exit("Invalid arguments.\nusage: \"./server <PORT> <FILE-DIR>\"");
+        _exit(usage);
     }
 
+    signal(SIGINT, sig_handle);
+    signal(SIGQUIT, sig_handle);
+    signal(SIGTERM, sig_handle);
+
     std::filesystem::path dir (OPT_DIR);
     
     int socket_fd;
     int addr_len = 0;
     socket_fd = open_socket(OPT_PORT, &addr_len);
 
-    packet incoming_packet;
-
-    struct sockaddr_storage client_addr;
+    Peer local;
+    local.len = sizeof(local.addr);
+    getsockname(socket_fd, (struct sockaddr *)&local.addr, &local.len);
+    if (!OPT_CAPTURE.empty()) capture.reset(new PcapWriter(OPT_CAPTURE.c_str(), OPT_CAPTURE_SLOTS));
 
-    uint16_t num_connections = 0;
+    Journal journal((dir / SERVER_JOURNAL_NAME).string());
 
-    while (true) {
-        memset(&incoming_packet, 0, sizeof(struct packet));
-
-        
-
-        uint32_t incoming_seq;
-        uint32_t incoming_ack;
-        uint16_t cid;
-        uint8_t incoming_flag;
-
-        
-        bool reply_needed = false;
-        uint32_t reply_seq = 0;
-        uint32_t reply_ack = 0;
-        uint16_t reply_cid = 0;
-        uint8_t reply_flag = 0;
-        int reply_type = 0;
-
-        uint32_t got_seq = 0;
-
-        int packet_from = PACKET_FROM_REC;
-        for (auto& [c_id, value] : out_of_order) {
-            _log("CHECK ", c_id, ", ", value.size());
-            if (value.size() == 0) continue;
-            if (database.count(c_id) <= 0) continue;
-            if (database[c_id].state == STATE_FIN) continue;
-
-            uint32_t smallest_seq = value.begin()->first;
-            while (smallest_seq < database.at(c_id).seq)
-            {
-                if (value.size() == 0) break;
-                value.erase(smallest_seq);
-                smallest_seq = value.begin()->first;
-            }
-            
-            if (value.size() == 0) continue;
-            smallest_seq = value.begin()->first;
-            if (smallest_seq == database.at(c_id).seq)
-            {
-                //
-                incoming_packet = value.begin()->second;
-                cid = ntohs(incoming_packet.packet_head.connection_id);
-                got_seq = ntohl(incoming_packet.packet_head.sequence_number);
-
-                if (value.size() == 1) {
-                    packet_from = PACKET_LAST_FROM_BUFFER;
-                } else {
-                    packet_from = PACKET_FROM_BUFFER;
-                }
-            };
-        }
-
-        if (packet_from == PACKET_FROM_BUFFER || packet_from == PACKET_LAST_FROM_BUFFER) {
-            out_of_order[cid].erase(got_seq);
-        }
+    ServerCore core(
+        [&](uint16_t file_id, int mode) {
+            char filename[50];
+            snprintf(filename, 49, "%d.file", file_id);
+            std::filesystem::path full_path = dir / std::filesystem::path(filename);
+            return fopen(full_path.c_str(), mode == OPEN_BASIS ? "r" : mode == OPEN_RESUME ? "r+" : "w+");
+        },
+        [&](const Peer& to, const packet* pack, int len) {
+            int numbytes = sendto(socket_fd, pack, len, 0, (struct sockaddr *)&to.addr, to.len);
+            // with -B the socket is non-blocking; a reply that doesn't fit
+            // is lost like any other, and the client's resend brings it again
+            if (send_dropped(numbytes)) _log("SEND: socket buffer full, reply dropped");
+            else err(numbytes, "Sending response");
+            if (capture && numbytes >= 0) capture->record(pack, numbytes, local, to);
+            _log("talker: sent ", numbytes, " bytes");
+        });
+    core.journal = &journal;
+    // with -r, what all uploads together may take in, shared out among them
+    core.ingest_rate = OPT_RATE;
+    // with -L, a connection far over its share also loses a datagram now and then
+    core.ingest_drops = OPT_RATE_DROPS;
+
+    // with -S, each upload is synced to disk before its FIN is ACKed
+    std::unique_ptr<GroupCommit> durable;
+    if (OPT_DURABLE) {
+        int dir_fd = open(OPT_DIR.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        err(dir_fd, "Opening file directory");
+        durable.reset(new GroupCommit(dir_fd));
+        core.durable = durable.get();
+    }
 
-        if (packet_from == PACKET_FROM_REC) {
-            addr_len = sizeof(client_addr);
-            rc = recvfrom(socket_fd, &incoming_packet, sizeof(struct packet), 0, (struct sockaddr *)&client_addr, (socklen_t*)&addr_len);
-            err(rc, "SERVER: while recvfrom socket (server)");
-            _log("RECV: Successfully got datagram, length ", rc);
-            _log("RECEIVED PACKET");
-            
-            incoming_seq = ntohl(incoming_packet.packet_head.sequence_number);
-            incoming_ack = ntohl(incoming_packet.packet_head.ack_number);
-            cid = ntohs(incoming_packet.packet_head.connection_id);
-            incoming_flag = incoming_packet.packet_head.flags;
-
-            if (incoming_flag != SYN && incoming_seq < database.at(cid).seq) {
-                output_packet_server(&incoming_packet, TYPE_DROP);
-                
-                if (database.count(cid) > 0) {
-                    reply_seq =  database.at(cid).ack;
-                    reply_ack = database.at(cid).seq;
-                    reply_cid = cid;
-                    reply_flag = ACK;
-                    reply_type = TYPE_DUP;
-
-                    packet reply;
-                    memset(&reply, 0, sizeof(struct packet));
-                    reply.packet_head.sequence_number = htonl(reply_seq);
-                    reply.packet_head.ack_number = htonl(reply_ack);
-                    reply.packet_head.connection_id = htons(reply_cid);
-                    reply.packet_head.flags = reply_flag;
-
-                    int numbytes = 0;
-                    numbytes     = sendto(socket_fd, &reply, 12, 0, (struct sockaddr *)&client_addr, addr_len);
-                    _log("current expected: ", database.at(cid).seq);
-                    err(numbytes, "Sending response");
-                    output_packet_server(&reply, reply_type);    
-                }
-                
-                continue;
-            }
+    // with -B the loop spins on poll while datagrams keep coming, and with
+    // -A it runs on that cpu; the capture and group commit threads started
+    // before, so they aren't pinned with it
+    std::unique_ptr<BusyPoller> poller;
+    if (OPT_BUSY_US > 0) {
+        poller.reset(new BusyPoller(OPT_BUSY_US));
+        if (!busy_poll_socket(socket_fd)) _log("SO_BUSY_POLL not available, spinning on poll alone");
+    }
+    if (OPT_CPU >= 0 && !pin_thread(OPT_CPU)) _exit("Pinning to CPU");
 
-            printpacket(&incoming_packet);
-            output_packet_server(&incoming_packet, TYPE_RECV);
-        } else if (packet_from == PACKET_FROM_BUFFER || packet_from == PACKET_LAST_FROM_BUFFER) {
-            incoming_seq = ntohl(incoming_packet.packet_head.sequence_number);
-            incoming_ack = ntohl(incoming_packet.packet_head.ack_number);
-            cid = ntohs(incoming_packet.packet_head.connection_id);
-            incoming_flag = incoming_packet.packet_head.flags;
-
-            if (incoming_flag != SYN && database.count(cid) <= 0) {
-                out_of_order.erase(cid);
-                continue;
-            }
-        }
+    Peer client;
+    // poll skips the second entry while its fd is negative
+    struct pollfd fds[2] = {{socket_fd, POLLIN, 0}, {durable ? durable->fd() : -1, POLLIN, 0}};
 
-        if(cid != 0 && database.count(cid) <= 0) {
-            output_packet_server(&incoming_packet, TYPE_DROP);
+    while (true) {
+        // wake for the next held back ACK or idle timeout, rounding up
+        uint64_t deadline = core.next_deadline();
+        uint64_t now      = time_now_us();
+        int timeout       = deadline == NO_DEADLINE ? -1 : deadline <= now ? 0 : std::min<uint64_t>((deadline - now + 999) / 1000, INT_MAX);
+        if (poller && poller->spinning(now)) timeout = 0;
+        rc = poll(fds, 2, timeout);
+        if (rc < 0 && errno == EINTR) continue;
+        err(rc, "SERVER: while polling");
+        // one clock read serves everything this pass does
+        now = time_now_us();
+        if (fds[1].revents & POLLIN) core.on_durable(now);
+        if (!(fds[0].revents & POLLIN)) {
+            if (now >= deadline) core.on_tick(now);
             continue;
         }
 
-        uint64_t time_now = time_now_ms();
-
-        if (incoming_flag > 7) _exit("Incorrect flags");
-
-
-        // Check timing for RTO
-        for (auto const& [key, val] : database)
-        {
-            uint64_t time_diff = time_now - val.last_time;
-            // _log(key, " time diff = ", time_diff / 10);
-            if (time_now > val.last_time && time_diff > 10000) {
-                database.at(key).state = STATE_FIN;
-                char err_msg[50];
-                sprintf(err_msg, "ERROR");
-                // int written = write(database.at(key).writefd, err_msg, sizeof(err_msg));
-                int written = fwrite(err_msg, sizeof(char), sizeof(err_msg), database.at(key).writefd);
-                fflush(database.at(cid).writefd);
-                // total_written += written;
-                _log("write rto= ", written);
-                fclose(database.at(key).writefd);
-                database.erase(key);
-                out_of_order.erase(key);
-            }
-        }
-
-
-        // new connection (incoming SYN)
-        if (incoming_flag == SYN) {
-            num_connections++;
-            num_connections %= 11;
-            
-            char filename[50];
-            snprintf(filename, 49, "%d.file", num_connections);
-            std::filesystem::path new_connection(filename);
-            std::filesystem::path full_path = dir / new_connection;
-
-            // int write_fd = open(full_path.c_str(), O_CREAT | O_WRONLY, S_IRWXU);
-            FILE * write_fd = fopen(full_path.c_str(), "w+");
-            
-            _log("WRITEFD = ", write_fd);
-
-            reply_needed = true;
-            reply_seq = 4321;
-            reply_ack = incoming_seq + 1;
-            reply_cid = num_connections;
-            reply_flag = SYNACK;
-            reply_type = TYPE_SEND;
-
-            Store temp(reply_ack, 0, time_now_ms(), write_fd, STATE_ACTIVE);
-            database[num_connections] = temp;
-        } else if (incoming_flag == FIN) {
-            database.at(cid).state = STATE_FIN;
-            fflush(database[cid].writefd);
-            fclose(database.at(cid).writefd);
-
-            reply_needed = true;
-            reply_seq = database.at(cid).ack;
-            reply_ack = incoming_seq + 1;
-            reply_cid = cid;
-            reply_flag = FINACK;
-            reply_type = TYPE_SEND;
-        }
-        else if (incoming_flag == ACK) {
-            if (incoming_seq > database.at(cid).seq) {
-                database.at(cid).seq = database.at(cid).seq;
-                if (packet_from == PACKET_FROM_REC) {
-                    _log("=STORED=========================================");
-                    packet copy = incoming_packet;
-                    out_of_order[cid][incoming_seq] = copy;
-                }
-            } else {
-                if (packet_from == PACKET_FROM_BUFFER) {
-                    _log("=OUT=========================================");
-                }
-                database.at(cid).seq = (database.at(cid).seq + rc - 12) % (SPEC_MAX_SEQ + 1);
-                int written = fwrite(incoming_packet.payload, sizeof(char), rc-12, database.at(cid).writefd);
-                fflush(database.at(cid).writefd);
-                total_written += written;
-                _log("writte = ", written);
-            }
-            database.at(cid).ack = incoming_ack;
-            database.at(cid).last_time = time_now_ms();
-
-            reply_needed = true;
-            reply_seq = incoming_ack;
-            reply_ack = database.at(cid).seq;
-            reply_cid = cid;
-            reply_flag = ACK;
-            reply_type = TYPE_SEND;
-            if (database.at(cid).state == STATE_FIN) {
-                reply_needed = false;
-                database.erase(cid);
-                out_of_order.erase(cid);
-                _log("total written, ", total_written);
-                total_written = 0;
-            }
-        }
-        else {
-            if (incoming_seq > database.at(cid).seq) {
-                database.at(cid).seq = database.at(cid).seq;
-                if (packet_from == PACKET_FROM_REC) {
-                    _log("=STORED=========================================");
-                    packet copy = incoming_packet;
-                    out_of_order[cid][incoming_seq] = copy;
-                }
-            } else {
-                if (packet_from == PACKET_FROM_BUFFER) {
-                    _log("==========================================");
-                }
-                database.at(cid).seq = (database.at(cid).seq + rc - 12) % (SPEC_MAX_SEQ + 1);
-                // int written = write(database.at(cid).writefd, incoming_packet.payload, rc-12);
-                int written = fwrite(incoming_packet.payload, sizeof(char), rc-12, database.at(cid).writefd);
-                fflush(database.at(cid).writefd);
-                total_written += written;
-                _log("write nonack = ", written);
-            }
-            database.at(cid).last_time = time_now_ms();
-
-            reply_needed = true;
-            reply_seq = database.at(cid).ack;
-            reply_ack = database.at(cid).seq;
-            reply_flag = ACK;
-            reply_cid = cid;
-            reply_type = TYPE_SEND;
-        }
-
-        if (reply_needed) {
-            packet reply;
-            memset(&reply, 0, sizeof(struct packet));
-            reply.packet_head.sequence_number = htonl(reply_seq);
-            reply.packet_head.ack_number = htonl(reply_ack);
-            reply.packet_head.connection_id = htons(reply_cid);
-            reply.packet_head.flags = reply_flag;
-
-            int numbytes = 0;
-            numbytes     = sendto(socket_fd, &reply, 12, 0, (struct sockaddr *)&client_addr, addr_len);
-            err(numbytes, "Sending response");
-            _log("talker: sent ", numbytes, " bytes");
-            _log("SENT PACKET:");
-            // printpacket(&reply);
-            output_packet_server(&reply, reply_type);    
-        }
+        packet* incoming_packet = core.rx_buffer();
+        client.len = sizeof(client.addr);
+        rc = recvfrom(socket_fd, incoming_packet, sizeof(struct packet), 0, (struct sockaddr *)&client.addr, &client.len);
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        err(rc, "SERVER: while recvfrom socket (server)");
+        _log("RECV: Successfully got datagram, length ", rc);
+        if (capture) capture->record(incoming_packet, rc, client, local);
+
+        if (poller) poller->on_event(now);
+        core.on_tick(now);
+        core.on_packet(incoming_packet, rc, client, now);
     }
 
     shutdown(socket_fd, 2);
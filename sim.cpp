@@ -0,0 +1,656 @@
+// ========================================================================== //
+// INCLUDES
+// ========================================================================== //
+
+// Standard Libraries
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+// C libraries
+#include <cstring>
+
+// Local
+#include "common.h"
+#include "journal.h"
+#include "pipeline.h"
+#include "protocol.h"
+
+// ========================================================================== //
+// DEFINITIONS
+// ========================================================================== //
+
+// Discrete-event simulator: runs ClientConn and ServerCore against each other
+// over a virtual lossy link with a virtual clock. Nothing sleeps, so thousands
+// of transfers finish in well under their simulated time, and a given seed
+// always replays the exact same run.
+
+#define SIM_RESUME_RETRIES 3 // with -R, times an aborted transfer is started again
+#define SIM_DELTA_EDITS 4    // with -D, most edits made to the basis
+#define SIM_DELTA_EDIT_BYTES 1000
+
+struct LinkOptions {
+    double loss;       // chance a datagram is dropped
+    double dup;        // chance a datagram is delivered twice
+    double corrupt;    // chance a client's datagram arrives with a bit flipped
+    double handshake;  // chance a SYN or SYNACK, either way, arrives with a header bit flipped
+    uint64_t delay_us;  // one-way propagation delay
+    uint64_t jitter_us; // extra uniform delay, reorders datagrams
+};
+
+struct Event {
+    uint64_t time;
+    uint64_t order; // ties go in send order
+    int src;        // client slot the datagram came from or goes to
+    bool to_server;
+    int len;
+    packet pack;
+};
+
+struct EventLater {
+    bool operator()(const Event& a, const Event& b) const {
+        if (a.time != b.time) return a.time > b.time;
+        return a.order > b.order;
+    }
+};
+
+// one transfer split into stripes, each uploaded from a slot of its own
+struct SimStripes {
+    std::string data; // the whole file
+    uint32_t transfer_id;
+    uint16_t count;
+    int left;     // stripes not yet finished
+    int verified; // stripes the server confirmed
+    int file_id;  // the file the server writes them into, -1 until known
+    bool failed;
+    uint64_t sent;
+    uint64_t started;
+};
+
+struct SimClient {
+    std::string data; // a stripe's data is its range of the file
+    std::shared_ptr<SimStripes> group; // set for a stripe
+    stripe info;
+    std::unique_ptr<MemorySource> source;
+    int basis;      // file id the data is an edit of, -1 for none
+    BlockSums sums;
+    std::unique_ptr<DeltaSource> delta;
+    std::unique_ptr<CompressSource> packed;
+    std::unique_ptr<ClientConn> conn;
+    bool verified;
+    int attempt; // 0 the first time
+    uint64_t started; // virtual time of the first attempt
+};
+
+// what the server wrote for one connection id
+struct Output {
+    char* buf;
+    size_t size;
+};
+
+// A FILE* over an Output, for the server to write through. Unlike a memory
+// stream, its size is the furthest byte written rather than where the last
+// write ended, as stripes write their ranges in any order.
+struct OutputCookie {
+    Output* out;
+    off64_t pos;
+};
+
+static ssize_t output_read(void* cookie, char* buf, size_t len) {
+    OutputCookie* c = (OutputCookie*)cookie;
+    if ((size_t)c->pos >= c->out->size) return 0;
+    len = std::min(len, c->out->size - c->pos);
+    memcpy(buf, c->out->buf + c->pos, len);
+    c->pos += len;
+    return len;
+}
+
+static ssize_t output_write(void* cookie, const char* buf, size_t len) {
+    OutputCookie* c = (OutputCookie*)cookie;
+    size_t end      = c->pos + len;
+    if (end > c->out->size) {
+        char* grown = (char*)realloc(c->out->buf, end);
+        if (grown == NULL) return 0;
+        memset(grown + c->out->size, 0, end - c->out->size);
+        c->out->buf  = grown;
+        c->out->size = end;
+    }
+    memcpy(c->out->buf + c->pos, buf, len);
+    c->pos = end;
+    return len;
+}
+
+static int output_seek(void* cookie, off64_t* offset, int whence) {
+    OutputCookie* c = (OutputCookie*)cookie;
+    off64_t base    = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? c->pos : (off64_t)c->out->size;
+    if (base + *offset < 0) return -1;
+    c->pos  = base + *offset;
+    *offset = c->pos;
+    return 0;
+}
+
+static int output_close(void* cookie) {
+    delete (OutputCookie*)cookie;
+    return 0;
+}
+
+static FILE* open_output(Output& out) {
+    return fopencookie(new OutputCookie{&out, 0}, "w+", {output_read, output_write, output_seek, output_close});
+}
+
+class Simulator {
+    public:
+        Simulator(LinkOptions link, uint64_t seed, std::ostream* trace);
+        ~Simulator();
+        // run count transfers with at most concurrency in flight, returns number that failed
+        int run(int count, int concurrency, uint32_t max_bytes);
+
+        uint64_t now;
+        uint64_t bytes;
+        uint64_t sent; // of the bytes, how many went over the link after compression
+        uint64_t retransmits;
+        uint64_t rack_losses; // segments declared lost before an RTO
+        int aborted;
+        int corrupt;    // the output differs and nothing noticed
+        int unverified; // the client knows the server couldn't confirm its copy
+        bool integrity; // clients run with CRC trailers and a FIN digest
+        bool compress;  // clients send text-like data and offer compression
+        bool resume;    // clients have resume tokens and go again when they time out
+        bool delta;     // clients send edits of finished files as deltas against them
+        bool zero_rtt;  // clients send the first of their data with the SYN
+        bool fec;       // clients send parity segments
+        int stripes;    // most stripes a transfer is split into, as with client -P
+        uint64_t parity; // parity segments sent
+        int deltas;     // transfers that went as a delta
+        // size and time taken, first SYN to last ACK, of every transfer done
+        std::vector<std::pair<uint32_t, uint64_t>> completions;
+
+        void set_ingest_rate(uint64_t rate, bool drops) {
+            server->ingest_rate  = rate;
+            server->ingest_drops = drops;
+        }
+        uint64_t crc_failures() const { return server->crc_failures; }
+        uint64_t paced_drops() const { return server->paced_drops; }
+        uint64_t resumed() const { return server->resumed; }
+        uint64_t recovered() const { return server->fec_recovered; }
+
+    private:
+        void transmit(int slot, bool to_server, const packet* pack, int len);
+        void launch(int slot, uint32_t max_bytes);
+        bool launch_stripes(uint32_t max_bytes);
+        void connect(int slot);
+        void verify(int slot);
+        void verify_stripes(SimStripes* g);
+        bool finish(int slot);
+
+        LinkOptions link;
+        std::mt19937_64 rng;
+        std::ostream* trace;
+        std::priority_queue<Event, std::vector<Event>, EventLater> events;
+        uint64_t order;
+        uint16_t nonce; // of the last SYN
+        uint32_t transfer_id; // of the last striped transfer
+        std::vector<std::unique_ptr<SimClient>> slots;
+        std::map<uint16_t, Output> outputs;
+        std::set<uint16_t> complete; // ids whose output is a whole verified file
+        Journal journal; // in memory
+        std::unique_ptr<ServerCore> server;
+};
+
+// ========================================================================== //
+// FUNCTIONS
+// ========================================================================== //
+
+Simulator::Simulator(LinkOptions l, uint64_t seed, std::ostream* tr) : link(l), rng(seed), trace(tr) {
+    now         = 0;
+    bytes       = 0;
+    sent        = 0;
+    retransmits = 0;
+    rack_losses = 0;
+    aborted     = 0;
+    corrupt     = 0;
+    unverified  = 0;
+    integrity   = false;
+    compress    = false;
+    resume      = false;
+    delta       = false;
+    zero_rtt    = false;
+    fec         = false;
+    stripes     = 1;
+    transfer_id = 0;
+    parity      = 0;
+    deltas      = 0;
+    order       = 0;
+    nonce       = 0;
+
+    server.reset(new ServerCore(
+        [this](uint16_t file_id, int mode) {
+            // a basis is read through its fd, which a memory stream hasn't got
+            Output& out = outputs[file_id];
+            if (mode == OPEN_BASIS) {
+                FILE* f = tmpfile();
+                if (f != NULL && out.size > 0) fwrite(out.buf, 1, out.size, f);
+                if (f != NULL) fflush(f);
+                return f;
+            }
+            // a new upload truncates the file, a resumed one carries on in it
+            complete.erase(file_id);
+            if (mode == OPEN_NEW) {
+                free(out.buf);
+                out.buf  = NULL;
+                out.size = 0;
+            }
+            return open_output(out);
+        },
+        [this](const Peer& to, const packet* pack, int len) {
+            transmit(ntohs(((const struct sockaddr_in*)&to.addr)->sin_port), false, pack, len);
+        },
+        trace));
+}
+
+Simulator::~Simulator() {
+    for (auto& [cid, out] : outputs) free(out.buf);
+}
+
+void Simulator::transmit(int slot, bool to_server, const packet* pack, int len) {
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    int copies = 1;
+    if (coin(rng) < link.loss) copies = 0;
+    else if (coin(rng) < link.dup) copies = 2;
+
+    for (int i = 0; i < copies; i++) {
+        Event ev;
+        ev.time = now + link.delay_us;
+        if (link.jitter_us > 0) ev.time += rng() % (link.jitter_us + 1);
+        ev.order = order++;
+        ev.src       = slot;
+        ev.to_server = to_server;
+        ev.len       = len;
+        memcpy(&ev.pack, pack, len);
+        // only the client's datagrams, since the server's replies are bare
+        // headers no CRC covers
+        if (to_server && link.corrupt > 0 && coin(rng) < link.corrupt) ((char*)&ev.pack)[rng() % len] ^= 1 << (rng() % 8);
+        // the negotiation itself, whichever field the bit lands in
+        if ((pack->packet_head.flags & SYN) && link.handshake > 0 && coin(rng) < link.handshake)
+            ((char*)&ev.pack)[rng() % 12] ^= 1 << (rng() % 8);
+        events.push(ev);
+    }
+}
+
+void Simulator::launch(int slot, uint32_t max_bytes) {
+    SimClient* c = new SimClient();
+    c->verified  = false;
+    c->basis     = -1;
+    uint32_t size = max_bytes > 0 ? rng() % (max_bytes + 1) : 0;
+    c->data.resize(size);
+    if (delta && !complete.empty()) {
+        // a few bytes replaced, put in or taken out of a finished file
+        auto pick = complete.begin();
+        std::advance(pick, rng() % complete.size());
+        c->basis = *pick;
+        c->data.assign(outputs[c->basis].buf, outputs[c->basis].size);
+        for (int edits = 1 + rng() % SIM_DELTA_EDITS; edits > 0; edits--) {
+            size_t at  = c->data.empty() ? 0 : rng() % c->data.size();
+            size_t len = 1 + rng() % SIM_DELTA_EDIT_BYTES;
+            std::string bytes(len, 0);
+            for (auto& ch : bytes) ch = (char)(rng() & 0xff);
+            switch (rng() % 3) {
+                case 0: c->data.replace(at, len, bytes); break;
+                case 1: c->data.insert(at, bytes); break;
+                case 2: c->data.erase(at, len); break;
+            }
+        }
+    } else if (compress) {
+        // words from a short list with numbers in between, about as
+        // compressible as a log file
+        static const char* words[] = {"GET ", "POST ", "/index ", "200 ", "404 ", "user=", "id=", "\n"};
+        uint32_t i = 0;
+        while (i < size) {
+            uint64_t r   = rng();
+            const char* w = words[r % 8];
+            while (*w && i < size) c->data[i++] = *w++;
+            for (int d = 0; d < 3 && i < size; d++) c->data[i++] = '0' + (r >> (8 + 4 * d)) % 10;
+        }
+    } else {
+        for (uint32_t i = 0; i < size; i++) c->data[i] = (char)(rng() & 0xff);
+    }
+
+    c->source.reset(new MemorySource(c->data));
+    c->attempt = 0;
+    c->started = now;
+    slots[slot].reset(c);
+    connect(slot);
+    if (resume) c->conn->token = rng() | 1;
+    c->conn->start(now);
+}
+
+// start a transfer split into stripes, each in a free slot, the way the
+// client splits a file with -P: whole payloads per stripe, and no more
+// stripes than payloads; false if it would be a single stripe
+bool Simulator::launch_stripes(uint32_t max_bytes) {
+    uint32_t size     = max_bytes > 0 ? rng() % (max_bytes + 1) : 0;
+    uint64_t segments = (size + SPEC_MAX_PAYLOAD_SIZE - 1) / SPEC_MAX_PAYLOAD_SIZE;
+    uint64_t per      = std::max<uint64_t>((segments + stripes - 1) / stripes, 1);
+    uint16_t count    = (segments + per - 1) / per;
+    std::vector<int> free;
+    for (size_t i = 0; i < slots.size(); i++)
+        if (!slots[i]) free.push_back(i);
+    if (count < 2) return false;
+
+    auto g = std::make_shared<SimStripes>();
+    g->data.resize(size);
+    for (auto& ch : g->data) ch = (char)(rng() & 0xff);
+    do transfer_id++; while (transfer_id == 0);
+    g->transfer_id = transfer_id;
+    g->count       = count;
+    g->left        = count;
+    g->verified    = 0;
+    g->file_id     = -1;
+    g->failed      = false;
+    g->sent        = 0;
+    g->started     = now;
+    for (uint16_t i = 0; i < count; i++) {
+        SimClient* c = new SimClient();
+        uint64_t at  = i * per * SPEC_MAX_PAYLOAD_SIZE;
+        c->group     = g;
+        c->info      = {transfer_id, at, i, count};
+        c->data      = g->data.substr(at, per * SPEC_MAX_PAYLOAD_SIZE);
+        c->verified  = false;
+        c->basis     = -1;
+        c->source.reset(new MemorySource(c->data));
+        c->attempt = 0;
+        c->started = now;
+        slots[free[i]].reset(c);
+        connect(free[i]);
+        c->conn->start(now);
+    }
+    return true;
+}
+
+// a new connection for the slot's data, as a retry keeps the data and token
+void Simulator::connect(int slot) {
+    SimClient* c   = slots[slot].get();
+    uint64_t token = c->conn ? c->conn->token : 0;
+    c->verified    = false;
+    c->conn.reset();
+    c->packed.reset();
+    c->delta.reset();
+    c->sums = BlockSums();
+
+    // staged on demand rather than on a thread, so runs stay repeatable
+    DataSource* data = c->source.get();
+    if (c->basis >= 0) {
+        c->delta.reset(new DeltaSource(data, &c->sums, false));
+        data = c->delta.get();
+    }
+    c->conn.reset(new ClientConn(data, [this, slot](const packet* pack, int len) {
+        transmit(slot, true, pack, len);
+    }, trace));
+    c->conn->integrity = integrity;
+    c->conn->token     = token;
+    c->conn->zero_rtt  = zero_rtt;
+    c->conn->parity    = fec;
+    if (c->group) {
+        char info[STRIPE_INFO_SIZE];
+        encode_stripe(info, c->info);
+        c->conn->syn_payload.assign(info, sizeof(info));
+    }
+    do nonce++; while (nonce == 0);
+    c->conn->nonce = nonce;
+    if (c->basis >= 0) {
+        c->conn->basis = c->basis;
+        c->conn->sums  = &c->sums;
+    }
+    if (compress) {
+        c->packed.reset(new CompressSource(data, false));
+        c->conn->packed = c->packed.get();
+    }
+}
+
+void Simulator::verify(int slot) {
+    // the server closed the file before its FINACK, and cannot hand the id
+    // out again until our final ACK, so this is the moment to compare
+    SimClient* c = slots[slot].get();
+    c->verified  = true;
+    if (c->group) {
+        if ((integrity && !c->conn->verified) || c->conn->mismatch) {
+            _log("UNVERIFIED stripe on cid ", c->conn->cid);
+            unverified++;
+            c->group->failed = true;
+            return;
+        }
+        c->group->sent += c->conn->snd_max;
+        if (++c->group->verified == c->group->count) verify_stripes(c->group.get());
+        return;
+    }
+
+    // a resumed upload carries on in the file it started
+    auto conn       = server->database.find(c->conn->cid);
+    uint16_t file_id = conn != server->database.end() ? conn->second.file_id : c->conn->cid;
+    Output& out      = outputs[file_id];
+    if ((integrity && !c->conn->verified) || c->conn->mismatch) {
+        _log("UNVERIFIED transfer on cid ", c->conn->cid);
+        unverified++;
+    } else if (out.size != c->data.size() || memcmp(out.buf, c->data.data(), out.size) != 0) {
+        _log("CORRUPT transfer on cid ", c->conn->cid, " got ", out.size, " wanted ", c->data.size());
+        corrupt++;
+    } else {
+        bytes += c->data.size();
+        sent += c->conn->snd_max;
+        if (c->sums.block_size > 0) deltas++;
+        complete.insert(file_id);
+    }
+}
+
+// the last stripe's FIN closed the shared file, which no other upload may
+// have taken over while its stripes were running
+void Simulator::verify_stripes(SimStripes* g) {
+    Output* out = g->file_id >= 0 ? &outputs[g->file_id] : NULL;
+    if (out == NULL || out->size != g->data.size() || memcmp(out->buf, g->data.data(), out->size) != 0) {
+        _log("CORRUPT striped transfer ", g->transfer_id, " got ", out ? out->size : 0, " wanted ", g->data.size());
+        corrupt++;
+        g->failed = true;
+    } else {
+        bytes += g->data.size();
+        sent += g->sent;
+    }
+}
+
+// false if the transfer is going again
+bool Simulator::finish(int slot) {
+    SimClient* c = slots[slot].get();
+    retransmits += c->conn->retransmits;
+    rack_losses += c->conn->rack_losses;
+    parity += c->conn->parity_sent;
+    if (!c->verified && resume && c->attempt < SIM_RESUME_RETRIES) {
+        c->attempt++;
+        connect(slot);
+        c->conn->start(now);
+        return false;
+    }
+    if (!c->verified) aborted++;
+    auto g = c->group;
+    slots[slot].reset();
+    // a striped transfer is done with its last stripe
+    if (g) {
+        if (--g->left > 0) return false;
+        if (!g->failed) completions.emplace_back(g->data.size(), now - g->started);
+        return true;
+    }
+    completions.emplace_back(c->data.size(), now - c->started);
+    return true;
+}
+
+int Simulator::run(int count, int concurrency, uint32_t max_bytes) {
+    slots.clear();
+    slots.resize(concurrency);
+    if (resume) server->journal = &journal;
+    int launched = 0;
+    int finished = 0;
+
+    while (finished < count) {
+        for (int i = 0; i < concurrency && launched < count; i++) {
+            if (slots[i]) continue;
+            // a transfer that may be striped waits until it has a slot for each
+            if (stripes > 1) {
+                int free = std::count_if(slots.begin(), slots.end(), [](const std::unique_ptr<SimClient>& c) { return !c; });
+                if (free < stripes) break;
+                if (launch_stripes(max_bytes)) {
+                    launched++;
+                    continue;
+                }
+            }
+            launch(i, max_bytes);
+            launched++;
+        }
+
+        uint64_t next = server->next_deadline();
+        if (!events.empty()) next = std::min(next, events.top().time);
+        for (auto& c : slots)
+            if (c) next = std::min(next, c->conn->next_deadline());
+        if (next == NO_DEADLINE) break;
+        now = std::max(now, next);
+
+        while (!events.empty() && events.top().time <= now) {
+            Event ev = events.top();
+            events.pop();
+            if (ev.to_server) {
+                // the slot doubles as the client's source port
+                Peer from;
+                memset(&from, 0, sizeof(from));
+                struct sockaddr_in* sin = (struct sockaddr_in*)&from.addr;
+                sin->sin_family         = AF_INET;
+                sin->sin_port           = htons(ev.src);
+                from.len                = sizeof(struct sockaddr_in);
+                server->on_packet(&ev.pack, ev.len, from, now);
+                // note which file a striped transfer went into while the
+                // server still knows
+                if (stripes > 1) {
+                    for (auto& c : slots) {
+                        if (!c || !c->group || c->group->file_id >= 0) continue;
+                        auto shared = server->striped.find(c->group->transfer_id);
+                        if (shared != server->striped.end()) c->group->file_id = shared->second.file_id;
+                    }
+                }
+            } else if (slots[ev.src]) {
+                SimClient* c = slots[ev.src].get();
+                c->conn->on_packet(&ev.pack, ev.len, now);
+                if (!c->verified && c->conn->state == CLIENT_TIME_WAIT) verify(ev.src);
+            }
+        }
+
+        server->on_tick(now);
+        for (int i = 0; i < concurrency; i++) {
+            if (!slots[i]) continue;
+            slots[i]->conn->on_tick(now);
+            if (slots[i]->conn->finished() && finish(i)) finished++;
+        }
+    }
+    return aborted + corrupt + unverified;
+}
+
+int main(int argc, char** argv) {
+    int OPT_COUNT       = 1000;
+    int OPT_CONCURRENCY = 1;
+    uint32_t OPT_BYTES  = 100000;
+    uint64_t OPT_SEED   = 1;
+    bool OPT_TRACE      = false;
+    LinkOptions link    = {0.0, 0.0, 0.0, 0.0, 10000, 0};
+    bool OPT_INTEGRITY  = false;
+    bool OPT_COMPRESS   = false;
+    bool OPT_RESUME     = false;
+    bool OPT_DELTA      = false;
+    bool OPT_ZERO_RTT   = false;
+    bool OPT_FEC        = false;
+    int OPT_STRIPES     = 1;
+    uint64_t OPT_RATE   = 0;
+    bool OPT_RATE_DROPS = false;
+
+    const char* usage = "usage: ./sim [-n TRANSFERS] [-c CONCURRENCY] [-b MAX-BYTES] [-l LOSS] [-u DUP] [-x CORRUPT] [-H HANDSHAKE-CORRUPT] [-C] [-z] [-R] [-D] [-0] [-F] [-P STRIPES] "
+                        "[-r BYTES-PER-SEC] [-L] [-d DELAY-MS] [-j JITTER-MS] [-s SEED] [-v]";
+
+    int opt;
+    try {
+        while ((opt = getopt(argc, argv, "n:c:b:l:u:x:H:CzRD0FP:r:Ld:j:s:v")) != -1) {
+            switch (opt) {
+                case 'n': OPT_COUNT = std::stoi(optarg); break;
+                case 'c': OPT_CONCURRENCY = std::stoi(optarg); break;
+                case 'b': OPT_BYTES = std::stoul(optarg); break;
+                case 'l': link.loss = std::stod(optarg); break;
+                case 'u': link.dup = std::stod(optarg); break;
+                case 'x': link.corrupt = std::stod(optarg); break;
+                case 'H': link.handshake = std::stod(optarg); break;
+                case 'C': OPT_INTEGRITY = true; break;
+                case 'z': OPT_COMPRESS = true; break;
+                case 'R': OPT_RESUME = true; break;
+                case 'D': OPT_DELTA = true; break;
+                case '0': OPT_ZERO_RTT = true; break;
+                case 'F': OPT_FEC = true; break;
+                case 'P': OPT_STRIPES = std::stoi(optarg); break;
+                case 'r': OPT_RATE = std::stoull(optarg); break;
+                case 'L': OPT_RATE_DROPS = true; break;
+                case 'd': link.delay_us = std::stod(optarg) * 1000; break;
+                case 'j': link.jitter_us = std::stod(optarg) * 1000; break;
+                case 's': OPT_SEED = std::stoull(optarg); break;
+                case 'v': OPT_TRACE = true; break;
+                default: throw std::invalid_argument("Unknown option");
+            }
+        }
+        // the server hands out only 11 connection ids
+        if (OPT_COUNT < 0 || OPT_CONCURRENCY < 1 || OPT_CONCURRENCY > 10) throw std::invalid_argument("Invalid count");
+        if (OPT_BYTES > 100 * 1024 * 1024) throw std::invalid_argument("Invalid size");
+        // stripes are retried and diffed as a whole file, which sim doesn't model
+        if (OPT_STRIPES < 1 || OPT_STRIPES > OPT_CONCURRENCY || (OPT_STRIPES > 1 && (OPT_RESUME || OPT_DELTA)))
+            throw std::invalid_argument("Invalid stripes");
+    } catch (const std::exception& e) {
+        _exit((std::string("Invalid arguments.\n") + usage).c_str());
+    }
+
+    Simulator sim(link, OPT_SEED, OPT_TRACE ? &std::cout : NULL);
+    sim.integrity = OPT_INTEGRITY;
+    sim.compress  = OPT_COMPRESS;
+    sim.resume    = OPT_RESUME;
+    sim.delta     = OPT_DELTA;
+    sim.zero_rtt  = OPT_ZERO_RTT;
+    sim.fec       = OPT_FEC;
+    sim.stripes   = OPT_STRIPES;
+    sim.set_ingest_rate(OPT_RATE, OPT_RATE_DROPS);
+
+    auto wall_start = std::chrono::steady_clock::now();
+    int failed      = sim.run(OPT_COUNT, OPT_CONCURRENCY, OPT_BYTES);
+    auto wall_ms    = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - wall_start).count();
+
+    std::cerr << "transfers " << OPT_COUNT << " ok " << OPT_COUNT - failed << " aborted " << sim.aborted
+              << " corrupt " << sim.corrupt << " unverified " << sim.unverified << std::endl;
+    std::cerr << "bytes " << sim.bytes << " sent " << sim.sent << " retransmits " << sim.retransmits << " rack lost " << sim.rack_losses << " crc drops " << sim.crc_failures()
+              << " resumed " << sim.resumed() << " deltas " << sim.deltas << " parity " << sim.parity
+              << " recovered " << sim.recovered() << std::endl;
+
+    // the smallest tenth of transfers on their own, the ones a budget shared
+    // out fairly keeps from waiting behind the big ones
+    auto& done = sim.completions;
+    std::sort(done.begin(), done.end());
+    std::vector<uint64_t> all, small;
+    for (size_t i = 0; i < done.size(); i++) {
+        all.push_back(done[i].second);
+        if (i < (done.size() + 9) / 10) small.push_back(done[i].second);
+    }
+    auto pct = [](std::vector<uint64_t>& v, int p) {
+        if (v.empty()) return (uint64_t)0;
+        std::sort(v.begin(), v.end());
+        return v[(v.size() - 1) * p / 100] / 1000;
+    };
+    std::cerr << "completion p50 " << pct(all, 50) << " p99 " << pct(all, 99) << " ms, smallest tenth p99 "
+              << pct(small, 99) << " ms, paced drops " << sim.paced_drops() << std::endl;
+    std::cerr << "virtual " << sim.now / 1000 << " ms, wall " << wall_ms << " ms" << std::endl;
+
+    return failed == 0 ? 0 : 1;
+}